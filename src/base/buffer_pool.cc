@@ -0,0 +1,145 @@
+/*
+ * base/buffer_pool.cc
+ * -------------------------------------------------------------------------
+ * Transfer buffer pool implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <map>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+#include "base/buffer_pool.h"
+#include "base/config.h"
+#include "base/statistics.h"
+
+using boost::condition;
+using boost::mutex;
+using boost::detail::atomic_count;
+using std::multimap;
+using std::ostream;
+
+using s3::base::buffer_pool;
+using s3::base::char_vector;
+using s3::base::char_vector_ptr;
+using s3::base::config;
+using s3::base::statistics;
+
+namespace
+{
+  // sizes are rounded up to a multiple of this, so that the tails of files
+  // of different sizes can share buffers
+  const size_t SIZE_CLASS_GRANULARITY = 64 * 1024;
+
+  // upper bound on memory kept in idle buffers
+  const size_t MAX_IDLE_BYTES = 32 * 1024 * 1024;
+
+  typedef multimap<size_t, char_vector *> idle_map;
+
+  mutex s_mutex;
+  condition s_condition;
+  idle_map s_idle; // keyed on capacity, protected by s_mutex
+  size_t s_idle_bytes = 0, s_used_bytes = 0, s_peak_used_bytes = 0; // protected by s_mutex
+
+  atomic_count s_acquired(0), s_reused(0), s_waits(0);
+
+  void statistics_writer(ostream *o)
+  {
+    mutex::scoped_lock lock(s_mutex);
+
+    *o <<
+      "buffer pool:\n"
+      "  acquired: " << s_acquired << "\n"
+      "  reused: " << s_reused << "\n"
+      "  budget waits: " << s_waits << "\n"
+      "  peak bytes in use: " << s_peak_used_bytes << "\n"
+      "  idle bytes: " << s_idle_bytes << "\n";
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
+
+  inline size_t get_budget()
+  {
+    return static_cast<size_t>(config::get_transfer_buffer_budget_in_mb()) * 1024 * 1024;
+  }
+}
+
+char_vector_ptr buffer_pool::acquire(size_t size, bool wait_for_budget)
+{
+  mutex::scoped_lock lock(s_mutex);
+  size_t charge = (size + SIZE_CLASS_GRANULARITY - 1) / SIZE_CLASS_GRANULARITY * SIZE_CLASS_GRANULARITY;
+  size_t budget = get_budget();
+  char_vector *buffer = NULL;
+  idle_map::iterator itor;
+
+  ++s_acquired;
+
+  // a single buffer is always allowed, however large, so that nothing waits
+  // forever
+  if (wait_for_budget && budget && s_used_bytes && s_used_bytes + charge > budget) {
+    ++s_waits;
+
+    while (s_used_bytes && s_used_bytes + charge > budget)
+      s_condition.wait(lock);
+  }
+
+  itor = s_idle.lower_bound(charge);
+
+  // don't hand out buffers much larger than needed
+  if (itor != s_idle.end() && itor->first <= 2 * charge) {
+    buffer = itor->second;
+    s_idle_bytes -= itor->first;
+    s_idle.erase(itor);
+
+    ++s_reused;
+  }
+
+  s_used_bytes += charge;
+  s_peak_used_bytes = std::max(s_peak_used_bytes, s_used_bytes);
+
+  lock.unlock();
+
+  if (!buffer) {
+    buffer = new char_vector();
+    buffer->reserve(charge);
+  }
+
+  return char_vector_ptr(buffer, bind(&buffer_pool::release, _1, charge));
+}
+
+void buffer_pool::release(char_vector *buffer, size_t charge)
+{
+  mutex::scoped_lock lock(s_mutex);
+  size_t capacity = buffer->capacity();
+
+  s_used_bytes -= charge;
+  s_condition.notify_all();
+
+  if (s_idle_bytes + capacity > MAX_IDLE_BYTES) {
+    lock.unlock();
+    delete buffer;
+
+    return;
+  }
+
+  buffer->clear();
+
+  s_idle.insert(std::make_pair(capacity, buffer));
+  s_idle_bytes += capacity;
+}
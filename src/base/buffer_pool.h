@@ -0,0 +1,53 @@
+/*
+ * base/buffer_pool.h
+ * -------------------------------------------------------------------------
+ * Reusable transfer buffers with a process-wide memory budget.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_BASE_BUFFER_POOL_H
+#define S3_BASE_BUFFER_POOL_H
+
+#include "base/request.h"
+
+namespace s3
+{
+  namespace base
+  {
+    // buffers are handed out by size class and go back to the pool when the
+    // last reference to them is dropped, so that transfers of many equally-
+    // sized parts don't keep allocating and freeing them.
+    //
+    // buffers should only be held for the duration of a single transfer
+    // step: acquire() waits while buffers in use exceed the budget (see
+    // transfer_buffer_budget_in_mb) and they're only given back when their
+    // holders are done with them.
+    class buffer_pool
+    {
+    public:
+      // returns an empty buffer with room for at least "size" bytes. callers
+      // that already hold a buffer should not wait for the budget, since
+      // they'd otherwise wait on each other.
+      static char_vector_ptr acquire(size_t size, bool wait_for_budget = true);
+
+    private:
+      static void release(char_vector *buffer, size_t charge);
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ * base/rate_governor.cc
+ * -------------------------------------------------------------------------
+ * Request rate governor implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iomanip>
+#include <map>
+#include <boost/thread.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+#include "base/config.h"
+#include "base/logger.h"
+#include "base/rate_governor.h"
+#include "base/request.h"
+#include "base/statistics.h"
+#include "base/timer.h"
+
+using boost::mutex;
+using boost::detail::atomic_count;
+using std::map;
+using std::ostream;
+using std::setprecision;
+using std::string;
+
+using s3::base::config;
+using s3::base::rate_governor;
+using s3::base::statistics;
+using s3::base::timer;
+
+namespace
+{
+  const double MIN_RATE = 1.0; // requests per second
+  const double DECREASE_FACTOR = 0.5;
+
+  // raises the rate by about one request per second, per second
+  const double INCREASE_PER_SECOND = 1.0;
+
+  // the limit is lifted once the rate reaches this multiple of the highest
+  // rate at which we've been throttled
+  const double UNLIMITED_FACTOR = 2.0;
+
+  // a burst of throttling responses to requests sent at the same time only
+  // counts once
+  const double MIN_DECREASE_INTERVAL = 1.0; // seconds
+
+  const double RETRY_BASE_DELAY = 0.1; // seconds
+  const double RETRY_MAX_DELAY = 20.0; // seconds
+
+  struct endpoint
+  {
+    double rate; // allowed requests per second, or 0 if not limited
+    double throttled_rate; // highest rate at which we've been throttled
+    double next_send_time;
+    double last_decrease_time;
+    double avg_latency;
+
+    // for measuring the rate at which requests are sent
+    double window_start;
+    size_t window_count;
+    double sent_rate;
+
+    inline endpoint()
+      : rate(0),
+        throttled_rate(0),
+        next_send_time(0),
+        last_decrease_time(0),
+        avg_latency(0),
+        window_start(0),
+        window_count(0),
+        sent_rate(0)
+    {
+    }
+  };
+
+  typedef map<string, endpoint> endpoint_map;
+
+  mutex s_mutex;
+  endpoint_map s_endpoints; // protected by s_mutex
+  unsigned int s_seed = 0; // protected by s_mutex
+
+  double s_total_pacing_delay = 0.0; // protected by s_mutex
+  atomic_count s_throttled(0), s_decreases(0), s_paced(0), s_lifted(0);
+
+  void statistics_writer(ostream *o)
+  {
+    mutex::scoped_lock lock(s_mutex);
+
+    o->setf(ostream::fixed);
+
+    *o <<
+      "request rate governor:\n"
+      "  throttled responses: " << s_throttled << "\n"
+      "  rate decreases: " << s_decreases << "\n"
+      "  limits lifted: " << s_lifted << "\n"
+      "  paced requests: " << s_paced << "\n"
+      "  total pacing delay: " << setprecision(3) << s_total_pacing_delay << " s\n";
+
+    for (endpoint_map::const_iterator itor = s_endpoints.begin(); itor != s_endpoints.end(); ++itor) {
+      *o << "  [" << itor->first << "]: ";
+
+      if (itor->second.rate > 0)
+        *o << setprecision(1) << itor->second.rate << " req/s";
+      else
+        *o << "not limited";
+
+      *o << ", avg latency " << setprecision(3) << itor->second.avg_latency * 1.0e3 << " ms\n";
+    }
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
+
+  inline endpoint * get_endpoint(const mutex::scoped_lock &, const string &url)
+  {
+    return &s_endpoints[rate_governor::get_key(url, config::get_request_rate_key_prefix_depth())];
+  }
+}
+
+string rate_governor::get_key(const string &url, int prefix_depth)
+{
+  size_t end = url.find("://");
+
+  end = url.find_first_of("/?", (end == string::npos) ? 0 : end + 3);
+
+  for (int i = 0; i < prefix_depth && end != string::npos && url[end] == '/'; i++)
+    end = url.find_first_of("/?", end + 1);
+
+  return url.substr(0, end);
+}
+
+void rate_governor::wait_for_turn(const string &url)
+{
+  double delay = reserve_turn(url);
+
+  if (delay > 0.0)
+    timer::sleep_for(delay);
+}
+
+double rate_governor::reserve_turn(const string &url)
+{
+  mutex::scoped_lock lock(s_mutex);
+  endpoint *ep;
+  double now, send_time;
+
+  if (!config::get_adaptive_request_rate())
+    return 0.0;
+
+  ep = get_endpoint(lock, url);
+  now = timer::get_current_time();
+
+  if (ep->window_start == 0) {
+    ep->window_start = now;
+
+  } else if (now - ep->window_start >= 1.0) {
+    ep->sent_rate = ep->window_count / (now - ep->window_start);
+    ep->window_start = now;
+    ep->window_count = 0;
+  }
+
+  ep->window_count++;
+
+  if (ep->rate <= 0)
+    return 0.0;
+
+  // requests are spaced evenly rather than let through in bursts
+  send_time = std::max(now, ep->next_send_time);
+  ep->next_send_time = send_time + 1.0 / ep->rate;
+
+  if (send_time <= now)
+    return 0.0;
+
+  ++s_paced;
+  s_total_pacing_delay += send_time - now;
+
+  return send_time - now;
+}
+
+void rate_governor::on_response(const string &url, long response_code, double elapsed_time)
+{
+  mutex::scoped_lock lock(s_mutex);
+  endpoint *ep;
+  double now, throttled_rate;
+
+  if (!config::get_adaptive_request_rate())
+    return;
+
+  ep = get_endpoint(lock, url);
+  now = timer::get_current_time();
+
+  ep->avg_latency = (ep->avg_latency > 0) ? (0.9 * ep->avg_latency + 0.1 * elapsed_time) : elapsed_time;
+
+  if (response_code == HTTP_SC_SERVICE_UNAVAILABLE) {
+    ++s_throttled;
+
+    if (now - ep->last_decrease_time < std::max(MIN_DECREASE_INTERVAL, ep->avg_latency))
+      return;
+
+    if (ep->rate <= 0) {
+      // the rate in the current window is a better guess if it's already
+      // been going for a while
+      double window_rate = (now - ep->window_start > 0.1) ? ep->window_count / (now - ep->window_start) : 0;
+
+      throttled_rate = std::max(ep->sent_rate, window_rate);
+    } else {
+      throttled_rate = ep->rate;
+    }
+
+    // a repeat throttle comes at an already-reduced rate, and lifting the
+    // limit at a multiple of that would take us back to about the rate that
+    // was first throttled
+    ep->throttled_rate = std::max(ep->throttled_rate, throttled_rate);
+
+    ep->rate = std::max(MIN_RATE, throttled_rate * DECREASE_FACTOR);
+    ep->next_send_time = now + 1.0 / ep->rate;
+    ep->last_decrease_time = now;
+
+    ++s_decreases;
+    S3_LOG(LOG_DEBUG, "rate_governor::on_response", "throttled by [%s], limiting to %.1f requests per second.\n", url.c_str(), ep->rate);
+
+  } else if (ep->rate > 0 && response_code < HTTP_SC_INTERNAL_SERVER_ERROR) {
+    // each response adds 1 / rate, and there are about "rate" of them per
+    // second
+    ep->rate += INCREASE_PER_SECOND / ep->rate;
+
+    if (ep->rate >= std::max(MIN_RATE, ep->throttled_rate) * UNLIMITED_FACTOR) {
+      ep->rate = 0;
+      ++s_lifted;
+    }
+  }
+}
+
+double rate_governor::get_retry_delay(double previous_delay)
+{
+  mutex::scoped_lock lock(s_mutex);
+  double upper = std::max(RETRY_BASE_DELAY, previous_delay * 3.0);
+  double r;
+
+  // so that separate processes don't pick the same delays
+  if (!s_seed)
+    s_seed = static_cast<unsigned int>(time(NULL)) ^ static_cast<unsigned int>(getpid());
+
+  r = static_cast<double>(rand_r(&s_seed)) / RAND_MAX;
+
+  return std::min(RETRY_MAX_DELAY, RETRY_BASE_DELAY + r * (upper - RETRY_BASE_DELAY));
+}
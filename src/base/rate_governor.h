@@ -0,0 +1,61 @@
+/*
+ * base/rate_governor.h
+ * -------------------------------------------------------------------------
+ * Paces requests to endpoints that are throttling us.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_BASE_RATE_GOVERNOR_H
+#define S3_BASE_RATE_GOVERNOR_H
+
+#include <string>
+
+namespace s3
+{
+  namespace base
+  {
+    // requests are grouped by endpoint (scheme and host), and optionally by
+    // the first few components of the path (see
+    // request_rate_key_prefix_depth). a group isn't limited until it gets a
+    // throttling response (503), at which point its allowed rate is set to
+    // half the rate at which requests were being sent. each successful
+    // response then raises the rate again by a small amount
+    // (additive-increase/multiplicative-decrease), and the limit is lifted
+    // once the rate is well past where it was first throttled.
+    class rate_governor
+    {
+    public:
+      // blocks until a request to "url" may be sent
+      static void wait_for_turn(const std::string &url);
+
+      // takes the next turn to send a request to "url" without waiting for
+      // it, and returns the number of seconds until it comes up
+      static double reserve_turn(const std::string &url);
+
+      static void on_response(const std::string &url, long response_code, double elapsed_time);
+
+      // seconds to wait before retrying a failed request, given the previous
+      // wait (or 0 for the first retry). uses "decorrelated jitter", so that
+      // clients that failed together don't retry together.
+      static double get_retry_delay(double previous_delay);
+
+      static std::string get_key(const std::string &url, int prefix_depth);
+    };
+  }
+}
+
+#endif
@@ -19,6 +19,7 @@
  * limitations under the License.
  */
 
+#include <math.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -27,6 +28,7 @@
 
 #include "config.h"
 #include "logger.h"
+#include "rate_governor.h"
 #include "request.h"
 #include "request_hook.h"
 #include "statistics.h"
@@ -40,6 +42,7 @@ using std::runtime_error;
 using std::setprecision;
 using std::string;
 
+using s3::base::rate_governor;
 using s3::base::request;
 using s3::base::statistics;
 using s3::base::timer;
@@ -48,34 +51,6 @@ using s3::base::timer;
 
 namespace
 {
-  class curl_slist_wrapper
-  {
-  public:
-    curl_slist_wrapper()
-      : _list(NULL)
-    {
-    }
-
-    ~curl_slist_wrapper()
-    {
-      if (_list)
-        curl_slist_free_all(_list);
-    }
-
-    inline void append(const char *item)
-    {
-      _list = curl_slist_append(_list, item);
-    }
-
-    inline const curl_slist * get() const
-    {
-      return _list;
-    }
-
-  private:
-    curl_slist *_list;
-  };
-
   const string USER_AGENT = string(PACKAGE_NAME) + " " + PACKAGE_VERSION_WITH_REV;
 
   uint64_t s_run_count = 0;
@@ -156,6 +131,26 @@ size_t request::output_write(char *data, size_t size, size_t items, void *contex
   if (req->_canceled)
     return 0; // abort!
 
+  if (req->_output_sink) {
+    long response_code = 0;
+
+    // no TEST_OK() here since we can't throw through curl
+    curl_easy_getinfo(req->_curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+    if (response_code == req->_output_sink_response_code) {
+      int r = req->_output_sink(data, size, req->_output_sink_offset);
+
+      if (r) {
+        req->_output_sink_error = r;
+        return 0; // abort!
+      }
+
+      req->_output_sink_offset += size;
+
+      return size;
+    }
+  }
+
   old_size = req->_output_buffer.size();
   req->_output_buffer.resize(old_size + size);
   memcpy(&req->_output_buffer[old_size], data, size);
@@ -173,6 +168,26 @@ size_t request::input_read(char *data, size_t size, size_t items, void *context)
   if (req->_canceled)
     return 0; // abort!
 
+  if (req->_input_source) {
+    int r;
+
+    size = min(req->_input_source_size - req->_input_source_offset, size);
+
+    if (size == 0)
+      return 0;
+
+    r = req->_input_source(data, size, req->_input_source_offset);
+
+    if (r <= 0) {
+      req->_input_source_error = (r < 0) ? r : -EIO;
+      return CURL_READFUNC_ABORT;
+    }
+
+    req->_input_source_offset += r;
+
+    return r;
+  }
+
   remaining = min(req->_input_remaining, size);
 
   memcpy(data, req->_input_pos, remaining);
@@ -198,6 +213,22 @@ int request::input_seek(void *context, curl_off_t offset, int origin)
   return CURL_SEEKFUNC_OK;
 }
 
+#if LIBCURL_VERSION_NUM >= 0x072000
+int request::progress(void *context, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+#else
+int request::progress(void *context, double, double, double, double)
+#endif
+{
+  request *req = static_cast<request *>(context);
+
+  if (req->_abort_check && req->_abort_check()) {
+    req->_aborted = true;
+    return 1; // abort!
+  }
+
+  return 0;
+}
+
 request::request()
   : _hook(NULL),
     _current_run_time(0.0),
@@ -205,12 +236,27 @@ request::request()
     _run_count(0),
     _total_bytes_transferred(0),
     _canceled(false),
-    _timeout(0)
+    _timeout(0),
+    _curl_timeout(false),
+    _aborted(false),
+    _run_timeout_in_s(DEFAULT_REQUEST_TIMEOUT),
+    _attempt(0),
+    _last_result(CURLE_OK),
+    _elapsed_time(0.0),
+    _retry_delay(0.0),
+    _bytes_transferred(0),
+    _attempt_request_size(0),
+    _header_list(NULL),
+    _output_sink_response_code(0),
+    _output_sink_offset(0),
+    _output_sink_error(0),
+    _input_source_size(0),
+    _input_source_offset(0),
+    _input_source_error(0)
 {
   // stuff that's set in the ctor shouldn't be modified elsewhere, since the call to init() won't reset it
 
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_VERBOSE, config::get_verbose_requests()));
-  TEST_OK(curl_easy_setopt(_curl, CURLOPT_NOPROGRESS, true));
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_FOLLOWLOCATION, true));
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_ERRORBUFFER, _curl_error));
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_FILETIME, true));
@@ -224,10 +270,20 @@ request::request()
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_SEEKFUNCTION, &request::input_seek));
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_SEEKDATA, this));
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_USERAGENT, USER_AGENT.c_str()));
+
+#if LIBCURL_VERSION_NUM >= 0x072000
+  TEST_OK(curl_easy_setopt(_curl, CURLOPT_XFERINFOFUNCTION, &request::progress));
+  TEST_OK(curl_easy_setopt(_curl, CURLOPT_XFERINFODATA, this));
+#else
+  TEST_OK(curl_easy_setopt(_curl, CURLOPT_PROGRESSFUNCTION, &request::progress));
+  TEST_OK(curl_easy_setopt(_curl, CURLOPT_PROGRESSDATA, this));
+#endif
 }
 
 request::~request()
 {
+  free_header_list();
+
   if (_total_bytes_transferred > 0) {
     mutex::scoped_lock lock(s_stats_mutex);
 
@@ -246,11 +302,19 @@ void request::init(http_method method)
   _url.clear();
   _curl_url.clear();
   _output_buffer.clear();
+  _output_sink.clear();
+  _output_sink_response_code = 0;
+  _output_sink_offset = 0;
+  _output_sink_error = 0;
   _response_headers.clear();
   _response_code = 0;
   _last_modified = 0;
   _headers.clear();
   _input_buffer.reset();
+  _input_source.clear();
+  _input_source_size = 0;
+  _input_source_offset = 0;
+  _input_source_error = 0;
 
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_CUSTOMREQUEST, NULL));
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_UPLOAD, false));
@@ -304,13 +368,37 @@ bool request::check_timeout()
   return false;
 }
 
+void request::free_header_list()
+{
+  if (_header_list) {
+    curl_slist_free_all(_header_list);
+    _header_list = NULL;
+  }
+}
+
 void request::run(int timeout_in_s)
 {
-  int r = CURLE_OK;
-  int iter;
-  double elapsed_time = 0.0;
-  uint64_t bytes_transferred = 0;
+  begin_run(timeout_in_s);
+
+  while (true) {
+    double delay = begin_attempt();
+
+    if (delay > 0.0)
+      timer::sleep_for(delay);
+
+    delay = end_attempt(curl_easy_perform(_curl));
 
+    if (delay < 0.0)
+      break;
+
+    timer::sleep_for(delay);
+  }
+
+  end_run();
+}
+
+void request::begin_run(int timeout_in_s)
+{
   // sanity
   if (_url.empty())
     throw runtime_error("call set_url() first!");
@@ -324,83 +412,158 @@ void request::run(int timeout_in_s)
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_URL, _curl_url.c_str()));
 
   if (_method == "PUT")
-    TEST_OK(curl_easy_setopt(_curl, CURLOPT_INFILESIZE_LARGE, _input_buffer ? static_cast<curl_off_t>(_input_buffer->size()) : 0));
+    TEST_OK(curl_easy_setopt(_curl, CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(get_input_size())));
   else if (_method == "POST")
-    TEST_OK(curl_easy_setopt(_curl, CURLOPT_POSTFIELDSIZE_LARGE, _input_buffer ? static_cast<curl_off_t>(_input_buffer->size()) : 0));
-  else if (_input_buffer && !_input_buffer->empty())
+    TEST_OK(curl_easy_setopt(_curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(get_input_size())));
+  else if (get_input_size() > 0)
     throw runtime_error("can't set input data for non-POST/non-PUT request.");
 
-  for (iter = 0; iter < config::get_max_transfer_retries(); iter++) {
-    curl_slist_wrapper headers;
-    uint64_t request_size = 0;
-   
-    _output_buffer.clear();
-    _response_headers.clear();
+  // the progress callback is only needed to poll the abort check
+  TEST_OK(curl_easy_setopt(_curl, CURLOPT_NOPROGRESS, !_abort_check));
+  _aborted = false;
 
-    if (_hook)
-      _hook->pre_run(this, iter);
+  _run_timeout_in_s = (timeout_in_s == DEFAULT_REQUEST_TIMEOUT) ? config::get_request_timeout_in_s() : timeout_in_s;
+  _attempt = 0;
+  _last_result = CURLE_OK;
+  _elapsed_time = 0.0;
+  _retry_delay = 0.0;
+  _bytes_transferred = 0;
+}
 
-    for (header_map::const_iterator itor = _headers.begin(); itor != _headers.end(); ++itor) {
-      string header = itor->first + ": " + itor->second;
+double request::begin_attempt()
+{
+  double delay;
 
-      headers.append(header.c_str());
-      request_size += header.size();
-    }
+  _output_buffer.clear();
+  _output_sink_offset = 0;
+  _output_sink_error = 0;
+  _input_source_error = 0;
+  _response_headers.clear();
+  _attempt_request_size = 0;
 
-    TEST_OK(curl_easy_setopt(_curl, CURLOPT_HTTPHEADER, headers.get()));
+  if (_hook)
+    _hook->pre_run(this, _attempt);
 
-    if (_input_buffer)
-      request_size += _input_buffer->size();
+  free_header_list();
 
-    rewind();
+  for (header_map::const_iterator itor = _headers.begin(); itor != _headers.end(); ++itor) {
+    string header = itor->first + ": " + itor->second;
 
-    _timeout = time(NULL) + ((timeout_in_s == DEFAULT_REQUEST_TIMEOUT) ? config::get_request_timeout_in_s() : timeout_in_s);
-    r = curl_easy_perform(_curl);
-    _timeout = 0; // reset this here so that subsequent calls to check_timeout() don't fail
+    _header_list = curl_slist_append(_header_list, header.c_str());
+    _attempt_request_size += header.size();
+  }
 
-    if (_canceled) {
-      ++s_timeouts;
-      throw runtime_error("request timed out.");
-    }
+  TEST_OK(curl_easy_setopt(_curl, CURLOPT_HTTPHEADER, _header_list));
+  TEST_OK(curl_easy_setopt(_curl, CURLOPT_TIMEOUT, _curl_timeout ? static_cast<long>(_run_timeout_in_s) : 0L));
 
-    if (
-      r == CURLE_COULDNT_RESOLVE_PROXY || 
-      r == CURLE_COULDNT_RESOLVE_HOST || 
-      r == CURLE_COULDNT_CONNECT || 
-      r == CURLE_PARTIAL_FILE || 
-      r == CURLE_UPLOAD_FAILED || 
-      r == CURLE_OPERATION_TIMEDOUT || 
-      r == CURLE_SSL_CONNECT_ERROR || 
-      r == CURLE_GOT_NOTHING || 
-      r == CURLE_SEND_ERROR || 
-      r == CURLE_RECV_ERROR || 
-      r == CURLE_BAD_CONTENT_ENCODING)
-    {
-      ++s_curl_failures;
-      S3_LOG(LOG_WARNING, "request::run", "got error [%s]. retrying.\n", _curl_error);
-      timer::sleep(1);
-
-      continue;
-    }
+  _attempt_request_size += get_input_size();
 
-    if (r == CURLE_OK) {
-      double this_iter_et = 0.0;
+  rewind();
 
-      TEST_OK(curl_easy_getinfo(_curl, CURLINFO_RESPONSE_CODE, &_response_code));
-      TEST_OK(curl_easy_getinfo(_curl, CURLINFO_TOTAL_TIME, &this_iter_et));
-      TEST_OK(curl_easy_getinfo(_curl, CURLINFO_FILETIME, &_last_modified));
+  delay = rate_governor::reserve_turn(_curl_url);
 
-      elapsed_time += this_iter_et;
-      bytes_transferred += request_size + _output_buffer.size();
+  _timeout = time(NULL) + static_cast<time_t>(ceil(delay)) + _run_timeout_in_s;
 
-      if (_hook && _hook->should_retry(this, iter)) {
-        ++s_hook_retries;
-        continue;
-      }
+  return delay;
+}
+
+double request::next_attempt()
+{
+  if (++_attempt >= config::get_max_transfer_retries())
+    return -1.0;
+
+  _retry_delay = rate_governor::get_retry_delay(_retry_delay);
+
+  return _retry_delay;
+}
+
+double request::end_attempt(CURLcode r)
+{
+  _timeout = 0; // reset this here so that subsequent calls to check_timeout() don't fail
+  _last_result = r;
+
+  if (_canceled) {
+    ++s_timeouts;
+    throw runtime_error("request timed out.");
+  }
+
+  // when curl enforces the run timeout, an attempt that hits it has used up
+  // the whole run, so retrying it is left to the caller
+  if (_curl_timeout && r == CURLE_OPERATION_TIMEDOUT) {
+    ++s_timeouts;
+    S3_LOG(LOG_WARNING, "request::end_attempt", "got error [%s]. not retrying.\n", _curl_error);
+
+    return -1.0;
+  }
+
+  if (
+    r == CURLE_COULDNT_RESOLVE_PROXY || 
+    r == CURLE_COULDNT_RESOLVE_HOST || 
+    r == CURLE_COULDNT_CONNECT || 
+    r == CURLE_PARTIAL_FILE || 
+    r == CURLE_UPLOAD_FAILED || 
+    r == CURLE_OPERATION_TIMEDOUT || 
+    r == CURLE_SSL_CONNECT_ERROR || 
+    r == CURLE_GOT_NOTHING || 
+    r == CURLE_SEND_ERROR || 
+    r == CURLE_RECV_ERROR || 
+    r == CURLE_BAD_CONTENT_ENCODING)
+  {
+    ++s_curl_failures;
+    S3_LOG(LOG_WARNING, "request::end_attempt", "got error [%s]. retrying.\n", _curl_error);
+
+    return next_attempt();
+  }
+
+  if (r == CURLE_OK) {
+    double this_iter_et = 0.0;
+
+    TEST_OK(curl_easy_getinfo(_curl, CURLINFO_RESPONSE_CODE, &_response_code));
+    TEST_OK(curl_easy_getinfo(_curl, CURLINFO_TOTAL_TIME, &this_iter_et));
+    TEST_OK(curl_easy_getinfo(_curl, CURLINFO_FILETIME, &_last_modified));
+
+    _elapsed_time += this_iter_et;
+
+    rate_governor::on_response(_curl_url, _response_code, this_iter_et);
+    _bytes_transferred += _attempt_request_size + _output_buffer.size() + _output_sink_offset;
+
+    if (_hook && _hook->should_retry(this, _attempt)) {
+      ++s_hook_retries;
+
+      return next_attempt();
     }
+  }
+
+  // done on CURLE_OK or some other error where we don't want to try the request again
+  return -1.0;
+}
+
+void request::end_run()
+{
+  CURLcode r = _last_result;
 
-    // break on CURLE_OK or some other error where we don't want to try the request again
-    break;
+  free_header_list();
+
+  if (r == CURLE_ABORTED_BY_CALLBACK && _aborted) {
+    ++s_aborts;
+    S3_LOG(LOG_DEBUG, "request::run", "[%s] [%s] aborted by abort check.\n", _method.c_str(), _url.c_str());
+
+    return;
+  }
+
+  if (r == CURLE_WRITE_ERROR && _output_sink_error) {
+    // the caller will want to see the sink's error rather than an exception
+    ++s_aborts;
+    S3_LOG(LOG_WARNING, "request::run", "output sink for [%s] [%s] failed with error %i.\n", _method.c_str(), _url.c_str(), _output_sink_error);
+
+    return;
+  }
+
+  if (r == CURLE_ABORTED_BY_CALLBACK && _input_source_error) {
+    ++s_aborts;
+    S3_LOG(LOG_WARNING, "request::run", "input source for [%s] [%s] failed with error %i.\n", _method.c_str(), _url.c_str(), _input_source_error);
+
+    return;
   }
 
   if (r != CURLE_OK) {
@@ -410,14 +573,14 @@ void request::run(int timeout_in_s)
 
   // don't save the time for the first request since it's likely to be disproportionately large
   if (_run_count > 0) {
-    _total_run_time += elapsed_time;
-    _total_bytes_transferred += bytes_transferred;
+    _total_run_time += _elapsed_time;
+    _total_bytes_transferred += _bytes_transferred;
   }
 
   // but save it in _current_run_time since it's compared to overall function time (i.e., it's relative)
-  _current_run_time += elapsed_time;
+  _current_run_time += _elapsed_time;
 
-  _run_count += iter + 1;
+  _run_count += _attempt + 1;
 
   if (_response_code >= HTTP_SC_BAD_REQUEST && _response_code != HTTP_SC_NOT_FOUND) {
     ++s_request_failures;
@@ -432,4 +595,3 @@ void request::run(int timeout_in_s)
       get_output_string().c_str());
   }
 }
-
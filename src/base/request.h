@@ -78,6 +78,19 @@ namespace s3
 
       typedef boost::shared_ptr<request> ptr;
 
+      // receives response body data at "offset" bytes into the body. a
+      // non-zero return value aborts the transfer.
+      typedef boost::function3<int, const char *, size_t, off_t> output_sink_fn;
+
+      // fills "buffer" with up to "size" bytes of the request body, starting
+      // "offset" bytes in. returns the number of bytes filled, or a negative
+      // error code to abort the transfer.
+      typedef boost::function3<int, char *, size_t, off_t> input_source_fn;
+
+      // polled while a transfer is in progress. returning true aborts the
+      // transfer.
+      typedef boost::function0<bool> abort_check_fn;
+
       inline static std::string url_encode(const std::string &url)
       {
         const char *HEX = "0123456789ABCDEF";
@@ -121,6 +134,17 @@ namespace s3
         _input_buffer = buffer;
       }
 
+      // reads a request body of "size" bytes from "source" as it's sent, in
+      // place of an input buffer. cleared by init().
+      inline void set_input_source(const input_source_fn &source, size_t size)
+      {
+        _input_source = source;
+        _input_source_size = size;
+      }
+
+      // the error returned by the input source, if it aborted the transfer
+      inline int get_input_source_error() { return _input_source_error; }
+
       inline void set_input_buffer(const std::string &str)
       { 
         char_vector_ptr buffer(new char_vector(str.size()));
@@ -130,6 +154,19 @@ namespace s3
         set_input_buffer(buffer);
       }
 
+      // if set, the body of a response with status "response_code" is passed
+      // to "sink" as it arrives rather than being stored in the output buffer.
+      // offsets start over at zero if the request is retried. cleared by
+      // init().
+      inline void set_output_sink(const output_sink_fn &sink, long response_code)
+      {
+        _output_sink = sink;
+        _output_sink_response_code = response_code;
+      }
+
+      // the error returned by the output sink, if it aborted the transfer
+      inline int get_output_sink_error() { return _output_sink_error; }
+
       inline const std::vector<char> & get_output_buffer() { return _output_buffer; }
 
       inline std::string get_output_string()
@@ -142,6 +179,17 @@ namespace s3
         return s;
       }
 
+      // not cleared by init(), but request workers clear it before running
+      // each work item
+      inline void set_abort_check(const abort_check_fn &check) { _abort_check = check; }
+
+      // for work that isn't a transfer, and so isn't polled by curl
+      inline bool is_abort_requested() { return _abort_check && _abort_check(); }
+
+      // true if the last call to run() was aborted by the abort check, in
+      // which case it returns without a response
+      inline bool was_aborted() { return _aborted; }
+
       inline const std::string & get_response_header(const std::string &key) { return _response_headers[key]; }
       inline const header_map & get_response_headers() { return _response_headers; }
 
@@ -153,20 +201,71 @@ namespace s3
 
       bool check_timeout();
 
+      // if set, run() has curl enforce the timeout on each attempt, for
+      // requests that aren't watched by something calling check_timeout().
+      // a timed-out attempt isn't retried: run() throws, did_time_out()
+      // returns true and it's up to the caller to try again. the request can
+      // be reused afterwards. not reset by init().
+      inline void set_curl_timeout(bool enable) { _curl_timeout = enable; }
+
+      // true if the last attempt made by run() timed out at the curl level
+      inline bool did_time_out() { return _last_result == CURLE_OPERATION_TIMEDOUT; }
+
+      // forgets the last attempt's result, so that did_time_out() only
+      // reports on runs made after this is called
+      inline void clear_last_result() { _last_result = CURLE_OK; }
+
       void run(int timeout_in_s = DEFAULT_REQUEST_TIMEOUT);
 
+      // run() is begin_run(), then begin_attempt(), curl_easy_perform() and
+      // end_attempt() for as long as end_attempt() asks for another attempt,
+      // then end_run(). an event loop (see threads::io_engine) makes the same
+      // calls, but adds get_curl_handle() to a multi handle in place of
+      // curl_easy_perform().
+      void begin_run(int timeout_in_s = DEFAULT_REQUEST_TIMEOUT);
+
+      // returns the number of seconds to wait before starting the transfer
+      // (see rate_governor)
+      double begin_attempt();
+
+      // returns the number of seconds to wait before the next attempt, or a
+      // negative value if there won't be one
+      double end_attempt(CURLcode result);
+
+      void end_run();
+
+      inline CURL * get_curl_handle() { return _curl; }
+
     private:
       static size_t header_process(char *data, size_t size, size_t items, void *context);
       static size_t output_write(char *data, size_t size, size_t items, void *context);
       static size_t input_read(char *data, size_t size, size_t items, void *context);
       static int input_seek(void *context, curl_off_t offset, int origin);
 
+#if LIBCURL_VERSION_NUM >= 0x072000
+      static int progress(void *context, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
+#else
+      static int progress(void *context, double, double, double, double);
+#endif
+
       inline void rewind()
       {
         _input_pos = (_input_buffer ? &(*_input_buffer)[0] : NULL);
         _input_remaining = (_input_buffer ? _input_buffer->size() : 0);
+        _input_source_offset = 0;
+      }
+
+      inline size_t get_input_size()
+      {
+        if (_input_source)
+          return _input_source_size;
+
+        return _input_buffer ? _input_buffer->size() : 0;
       }
 
+      double next_attempt();
+      void free_header_list();
+
       // not reset by init()
       curl_easy_handle _curl;
 
@@ -178,9 +277,21 @@ namespace s3
 
       bool _canceled;
       time_t _timeout;
+      bool _curl_timeout;
+
+      abort_check_fn _abort_check;
+      bool _aborted;
 
       std::string _tag;
 
+      // state of the current call to run() (or begin_run())
+      int _run_timeout_in_s;
+      int _attempt;
+      CURLcode _last_result;
+      double _elapsed_time, _retry_delay;
+      uint64_t _bytes_transferred, _attempt_request_size;
+      curl_slist *_header_list;
+
       // should be reset by init()
       char _curl_error[CURL_ERROR_SIZE];
 
@@ -190,6 +301,11 @@ namespace s3
 
       std::vector<char> _output_buffer;
 
+      output_sink_fn _output_sink;
+      long _output_sink_response_code;
+      off_t _output_sink_offset;
+      int _output_sink_error;
+
       long _response_code;
       time_t _last_modified;
 
@@ -198,6 +314,11 @@ namespace s3
       char_vector_ptr _input_buffer;
       const char *_input_pos;
       size_t _input_remaining;
+
+      input_source_fn _input_source;
+      size_t _input_source_size;
+      off_t _input_source_offset;
+      int _input_source_error;
     };
   }
 }
@@ -0,0 +1,95 @@
+#include <unistd.h>
+
+#include <fstream>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <gtest/gtest.h>
+
+#include "base/buffer_pool.h"
+#include "base/config.h"
+
+using boost::posix_time::milliseconds;
+using std::ofstream;
+
+using s3::base::buffer_pool;
+using s3::base::char_vector_ptr;
+using s3::base::config;
+
+namespace
+{
+  const size_t MB = 1024 * 1024;
+
+  void load_config(int budget_in_mb)
+  {
+    const char *TEMP_FILE = "/tmp/s3fuse.test-buffer-pool";
+
+    {
+      ofstream f(TEMP_FILE, ofstream::out | ofstream::trunc);
+
+      f << "bucket_name=test\n";
+
+      #ifndef FIXED_SERVICE
+        f << "service=test\n";
+      #endif
+
+      f << "transfer_buffer_budget_in_mb=" << budget_in_mb << "\n";
+    }
+
+    config::init(TEMP_FILE);
+
+    unlink(TEMP_FILE);
+  }
+
+  void acquire(size_t size, bool wait_for_budget, char_vector_ptr *buffer)
+  {
+    *buffer = buffer_pool::acquire(size, wait_for_budget);
+  }
+}
+
+TEST(buffer_pool, holder_does_not_wait)
+{
+  char_vector_ptr part, block;
+
+  load_config(1);
+
+  // the way an upload hashes its local copy while its parts hold the budget
+  part = buffer_pool::acquire(MB);
+
+  boost::thread t(boost::bind(acquire, 128 * 1024, false, &block));
+
+  ASSERT_TRUE(t.timed_join(milliseconds(5000)));
+  EXPECT_TRUE(block);
+}
+
+TEST(buffer_pool, waiter_resumes_on_release)
+{
+  char_vector_ptr block, part;
+
+  load_config(1);
+
+  block = buffer_pool::acquire(MB);
+
+  boost::thread t(boost::bind(acquire, MB, true, &part));
+
+  // over budget until the block is given back
+  EXPECT_FALSE(t.timed_join(milliseconds(200)));
+
+  block.reset();
+
+  ASSERT_TRUE(t.timed_join(milliseconds(5000)));
+  EXPECT_TRUE(part);
+}
+
+TEST(buffer_pool, no_budget)
+{
+  char_vector_ptr a, b;
+
+  load_config(0);
+
+  a = buffer_pool::acquire(4 * MB);
+
+  boost::thread t(boost::bind(acquire, 4 * MB, true, &b));
+
+  ASSERT_TRUE(t.timed_join(milliseconds(5000)));
+  EXPECT_TRUE(b);
+}
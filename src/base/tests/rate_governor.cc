@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <gtest/gtest.h>
+
+#include "base/rate_governor.h"
+#include "base/request.h"
+#include "base/timer.h"
+
+using s3::base::rate_governor;
+using s3::base::timer;
+
+TEST(rate_governor, key_is_endpoint)
+{
+  EXPECT_EQ("https://bucket.s3.amazonaws.com", rate_governor::get_key("https://bucket.s3.amazonaws.com/a/b/c?acl", 0));
+  EXPECT_EQ("https://s3.amazonaws.com", rate_governor::get_key("https://s3.amazonaws.com", 0));
+  EXPECT_EQ("https://s3.amazonaws.com", rate_governor::get_key("https://s3.amazonaws.com?delete", 0));
+}
+
+TEST(rate_governor, key_with_prefix)
+{
+  EXPECT_EQ("https://s3.amazonaws.com/bucket", rate_governor::get_key("https://s3.amazonaws.com/bucket/a/b", 1));
+  EXPECT_EQ("https://s3.amazonaws.com/bucket/a", rate_governor::get_key("https://s3.amazonaws.com/bucket/a/b", 2));
+  EXPECT_EQ("https://s3.amazonaws.com/bucket/a", rate_governor::get_key("https://s3.amazonaws.com/bucket/a?uploads", 5));
+}
+
+TEST(rate_governor, retry_delay_bounds)
+{
+  double delay = 0.0;
+
+  for (int i = 0; i < 100; i++) {
+    double next = rate_governor::get_retry_delay(delay);
+
+    EXPECT_GE(next, 0.1);
+    EXPECT_LE(next, std::max(0.1, delay * 3.0));
+    EXPECT_LE(next, 20.0);
+
+    delay = next;
+  }
+}
+
+TEST(rate_governor, throttling_paces_requests)
+{
+  const std::string url = "http://throttled.example.com/key";
+
+  for (int i = 0; i < 5; i++)
+    rate_governor::wait_for_turn(url);
+
+  rate_governor::on_response(url, s3::base::HTTP_SC_SERVICE_UNAVAILABLE, 0.01);
+
+  // five requests in no time at all means we drop to the minimum rate of
+  // one per second
+  double start = timer::get_current_time();
+
+  rate_governor::wait_for_turn(url);
+
+  EXPECT_GT(timer::get_current_time() - start, 0.9);
+}
+
+TEST(rate_governor, repeat_throttle_keeps_limit)
+{
+  const std::string url = "http://throttled-twice.example.com/key";
+
+  // about 100 requests per second
+  for (int i = 0; i < 20; i++)
+    rate_governor::reserve_turn(url);
+
+  timer::sleep_for(0.2);
+  rate_governor::on_response(url, s3::base::HTTP_SC_SERVICE_UNAVAILABLE, 0.01);
+
+  // throttled again at 50 per second, once enough time has passed to count
+  timer::sleep_for(1.1);
+  rate_governor::on_response(url, s3::base::HTTP_SC_SERVICE_UNAVAILABLE, 0.01);
+
+  // enough to climb from 25 to about 140 requests per second, which is past
+  // twice the second throttled rate but not past twice the first
+  for (int i = 0; i < 10000; i++)
+    rate_governor::on_response(url, s3::base::HTTP_SC_OK, 0.01);
+
+  rate_governor::reserve_turn(url);
+  EXPECT_GT(rate_governor::reserve_turn(url), 0.0);
+}
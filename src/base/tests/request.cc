@@ -1,9 +1,14 @@
+#include <errno.h>
+
 #include <stdexcept>
+#include <string>
+#include <boost/bind.hpp>
 #include <gtest/gtest.h>
 
 #include "base/request.h"
 
 using std::runtime_error;
+using std::string;
 
 using s3::base::request;
 
@@ -39,3 +44,85 @@ TEST(request, valid_page)
   ASSERT_EQ(s3::base::HTTP_SC_OK, r.get_response_code());
   ASSERT_FALSE(r.get_output_string().empty());
 }
+
+namespace
+{
+  int append_to_string(string *s, const char *data, size_t size, off_t offset)
+  {
+    s->resize(offset);
+    s->append(data, size);
+
+    return 0;
+  }
+}
+
+TEST(request, output_sink)
+{
+  request r;
+  string body;
+
+  r.init(s3::base::HTTP_GET);
+  r.set_url("http://www.google.com/");
+  r.set_output_sink(boost::bind(&append_to_string, &body, _1, _2, _3), s3::base::HTTP_SC_OK);
+  ASSERT_NO_THROW(r.run());
+
+  ASSERT_EQ(s3::base::HTTP_SC_OK, r.get_response_code());
+  ASSERT_EQ(0, r.get_output_sink_error());
+  ASSERT_FALSE(body.empty());
+  ASSERT_TRUE(r.get_output_buffer().empty());
+}
+
+TEST(request, output_sink_skipped_on_other_status)
+{
+  request r;
+  string body;
+
+  r.init(s3::base::HTTP_GET);
+  r.set_url("http://www.google.com/this_shouldnt_exist");
+  r.set_output_sink(boost::bind(&append_to_string, &body, _1, _2, _3), s3::base::HTTP_SC_OK);
+  ASSERT_NO_THROW(r.run());
+
+  ASSERT_EQ(s3::base::HTTP_SC_NOT_FOUND, r.get_response_code());
+  ASSERT_TRUE(body.empty());
+}
+
+namespace
+{
+  int failing_source(char *, size_t, off_t)
+  {
+    return -EIO;
+  }
+}
+
+TEST(request, input_source_error)
+{
+  request r;
+
+  r.init(s3::base::HTTP_POST);
+  r.set_url("http://www.google.com/");
+  r.set_input_source(boost::bind(&failing_source, _1, _2, _3), 1024);
+  ASSERT_NO_THROW(r.run());
+
+  ASSERT_EQ(-EIO, r.get_input_source_error());
+}
+
+namespace
+{
+  bool always_abort()
+  {
+    return true;
+  }
+}
+
+TEST(request, abort_check)
+{
+  request r;
+
+  r.init(s3::base::HTTP_GET);
+  r.set_url("http://www.google.com/");
+  r.set_abort_check(boost::bind(&always_abort));
+  ASSERT_NO_THROW(r.run());
+
+  ASSERT_TRUE(r.was_aborted());
+  ASSERT_EQ(0, r.get_response_code());
+}
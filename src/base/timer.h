@@ -61,6 +61,16 @@ namespace s3
 
         nanosleep(&ts, NULL);
       }
+
+      inline static void sleep_for(double sec)
+      {
+        struct timespec ts;
+
+        ts.tv_sec = static_cast<time_t>(sec);
+        ts.tv_nsec = static_cast<long>((sec - ts.tv_sec) * 1.0e9);
+
+        nanosleep(&ts, NULL);
+      }
     };
   }
 }
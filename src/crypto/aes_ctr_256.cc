@@ -19,36 +19,100 @@
  * limitations under the License.
  */
 
+#include <limits.h>
 #include <string.h>
 
+#include <openssl/evp.h>
+
 #include "crypto/aes_ctr_256.h"
 #include "crypto/symmetric_key.h"
 
+using boost::shared_ptr;
 using std::runtime_error;
 
 using s3::crypto::aes_ctr_256;
 using s3::crypto::symmetric_key;
 
+namespace
+{
+  // identifies our state in symmetric_key
+  const char CIPHER_STATE_OWNER = 0;
+}
+
+shared_ptr<void> aes_ctr_256::prepare(const symmetric_key::ptr &key)
+{
+  shared_ptr<EVP_CIPHER_CTX> ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+  const EVP_CIPHER *cipher = NULL;
+
+  if (!ctx)
+    throw runtime_error("EVP_CIPHER_CTX_new() failed in aes_ctr_256");
+
+  switch (key->get_key()->size()) {
+    case (128 / 8):
+      cipher = EVP_aes_128_ctr();
+      break;
+
+    case (192 / 8):
+      cipher = EVP_aes_192_ctr();
+      break;
+
+    case (256 / 8):
+      cipher = EVP_aes_256_ctr();
+      break;
+  }
+
+  if (!cipher)
+    throw runtime_error("invalid key length for aes_ctr_256");
+
+  // expands the key; the iv is set per call
+  if (EVP_EncryptInit_ex(ctx.get(), cipher, NULL, key->get_key()->get(), NULL) == 0)
+    throw runtime_error("failed to set encryption key for aes_ctr_256");
+
+  key->set_cipher_state(&CIPHER_STATE_OWNER, ctx);
+
+  return ctx;
+}
+
 void aes_ctr_256::crypt(const symmetric_key::ptr &key, uint64_t starting_block, const uint8_t *in, size_t size, uint8_t *out)
 {
   uint8_t iv[BLOCK_LEN];
+  shared_ptr<void> prepared;
+  shared_ptr<EVP_CIPHER_CTX> ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
 
   if (key->get_iv()->size() != IV_LEN)
     throw runtime_error("iv length is not valid for aes_ctr_256");
 
+  if (!ctx)
+    throw runtime_error("EVP_CIPHER_CTX_new() failed in aes_ctr_256");
+
   starting_block = __builtin_bswap64(starting_block);
 
   memcpy(iv, key->get_iv()->get(), IV_LEN);
   memcpy(iv + IV_LEN, &starting_block, sizeof(starting_block));
 
-  AES_KEY aes_key;
-  uint8_t ecount_buf[BLOCK_LEN];
-  unsigned int num = 0;
+  prepared = key->get_cipher_state(&CIPHER_STATE_OWNER);
 
-  memset(ecount_buf, 0, sizeof(ecount_buf));
+  if (!prepared)
+    prepared = prepare(key);
 
-  if (AES_set_encrypt_key(key->get_key()->get(), key->get_key()->size() * 8 /* in bits */, &aes_key) != 0)
-    throw runtime_error("failed to set encryption key for aes_ctr_256");
+  // copying the prepared context is much cheaper than expanding the key
+  // again, and lets threads share it
+  if (EVP_CIPHER_CTX_copy(ctx.get(), static_cast<const EVP_CIPHER_CTX *>(prepared.get())) == 0)
+    throw runtime_error("EVP_CIPHER_CTX_copy() failed in aes_ctr_256");
+
+  if (EVP_EncryptInit_ex(ctx.get(), NULL, NULL, NULL, iv) == 0)
+    throw runtime_error("failed to set iv for aes_ctr_256");
+
+  // EVP takes int lengths, and the counter carries over between updates
+  while (size) {
+    int chunk = (size > INT_MAX) ? (INT_MAX - INT_MAX % BLOCK_LEN) : static_cast<int>(size);
+    int updated = 0;
+
+    if (EVP_EncryptUpdate(ctx.get(), out, &updated, in, chunk) == 0 || updated != chunk)
+      throw runtime_error("EVP_EncryptUpdate() failed in aes_ctr_256");
 
-  AES_ctr128_encrypt(in, out, size, &aes_key, iv, ecount_buf, &num);
+    in += chunk;
+    out += chunk;
+    size -= chunk;
+  }
 }
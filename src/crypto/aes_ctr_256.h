@@ -78,6 +78,8 @@ namespace s3
 
     private:
       static void crypt(const boost::shared_ptr<symmetric_key> &key, uint64_t starting_block, const uint8_t *in, size_t size, uint8_t *out);
+
+      static boost::shared_ptr<void> prepare(const boost::shared_ptr<symmetric_key> &key);
     };
   }
 }
@@ -72,6 +72,13 @@ namespace s3
         hash_type::compute(fd, hash);
       }
 
+      // only for hash types that provide compute_multi()
+      template <class hash_type>
+      inline static void compute_multi(const uint8_t * const *inputs, size_t size, size_t count, uint8_t *hashes)
+      {
+        hash_type::compute_multi(inputs, size, count, hashes);
+      }
+
       template <class hash_type, class encoder_type>
       inline static std::string compute(const uint8_t *input, size_t size)
       {
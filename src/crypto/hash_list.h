@@ -22,10 +22,14 @@
 #ifndef S3_CRYPTO_HASH_LIST_H
 #define S3_CRYPTO_HASH_LIST_H
 
+#include <string.h>
+
+#include <algorithm>
 #include <stdexcept>
 #include <string>
 #include <vector>
 #include <boost/smart_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "crypto/encoder.h"
 #include "crypto/hash.h"
@@ -41,35 +45,46 @@ namespace s3
       typedef boost::shared_ptr<hash_list<hash_type> > ptr;
 
       static const size_t CHUNK_SIZE = 128 * 1024; // 128 KB
+      static const size_t BATCH_SIZE = 16;
 
       inline hash_list(size_t total_size)
         : _hashes((total_size + CHUNK_SIZE - 1) / CHUNK_SIZE * hash_type::HASH_LEN)
       {
       }
 
-      // this is thread safe so long as no two threads try to update the same part
+      // this is thread safe, even for threads hashing the same part (as the
+      // two copies of a hedged upload part do): chunks are hashed without a
+      // lock, and only storing their hashes is serialized. whole chunks are
+      // hashed in batches (see hash::compute_multi()).
       inline void compute_hash(size_t offset, const uint8_t *data, size_t size)
       {
-        size_t remaining_size = size;
+        const uint8_t *batch[BATCH_SIZE];
+        uint8_t hashes[BATCH_SIZE * hash_type::HASH_LEN];
+        size_t full_chunks = size / CHUNK_SIZE;
 
         if (offset % CHUNK_SIZE)
           throw std::runtime_error("cannot compute hash if offset is not chunk-aligned");
 
-        for (size_t o = 0; o < size; o += CHUNK_SIZE) {
-          size_t chunk_size = (remaining_size > CHUNK_SIZE) ? CHUNK_SIZE : remaining_size;
+        for (size_t i = 0; i < full_chunks; i += BATCH_SIZE) {
+          size_t count = std::min(full_chunks - i, static_cast<size_t>(BATCH_SIZE));
+
+          for (size_t j = 0; j < count; j++)
+            batch[j] = data + (i + j) * CHUNK_SIZE;
 
-          hash::compute<hash_type>(
-            data + o,
-            chunk_size,
-            &_hashes[(offset + o) / CHUNK_SIZE * hash_type::HASH_LEN]);
+          hash::compute_multi<hash_type>(batch, CHUNK_SIZE, count, hashes);
+          store(offset / CHUNK_SIZE + i, hashes, count);
+        }
 
-          remaining_size -= chunk_size;
+        if (size % CHUNK_SIZE) {
+          hash::compute<hash_type>(data + full_chunks * CHUNK_SIZE, size % CHUNK_SIZE, hashes);
+          store(offset / CHUNK_SIZE + full_chunks, hashes, 1);
         }
       }
 
       template <class encoder_type>
       inline std::string get_root_hash()
       {
+        boost::mutex::scoped_lock lock(_mutex);
         uint8_t root_hash[hash_type::HASH_LEN];
 
         hash::compute<hash_type>(_hashes, root_hash);
@@ -78,6 +93,14 @@ namespace s3
       }
 
     private:
+      inline void store(size_t first_chunk, const uint8_t *hashes, size_t count)
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+
+        memcpy(&_hashes[first_chunk * hash_type::HASH_LEN], hashes, count * hash_type::HASH_LEN);
+      }
+
+      boost::mutex _mutex;
       std::vector<uint8_t> _hashes;
     };
   }
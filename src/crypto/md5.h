@@ -26,6 +26,8 @@
 
 #include <string>
 
+#include <openssl/md5.h>
+
 namespace s3
 {
   namespace crypto
@@ -52,6 +54,26 @@ namespace s3
         return true;
       }
 
+      // hashes input that arrives in sequential pieces
+      class context
+      {
+      public:
+        inline context() { reset(); }
+
+        inline void reset() { MD5_Init(&_ctx); }
+
+        inline void update(const uint8_t *input, size_t size)
+        {
+          MD5_Update(&_ctx, input, size);
+        }
+
+        // the context has to be reset before it can be used again
+        inline void finish(uint8_t *hash) { MD5_Final(hash, &_ctx); }
+
+      private:
+        MD5_CTX _ctx;
+      };
+
     private:
       friend class hash;
 
@@ -0,0 +1,112 @@
+/*
+ * crypto/md5_accumulator.cc
+ * -------------------------------------------------------------------------
+ * Out-of-order MD5 accumulator implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+
+#include "crypto/md5_accumulator.h"
+
+using boost::mutex;
+using std::vector;
+
+using s3::crypto::md5_accumulator;
+
+namespace
+{
+  const size_t READ_BACK_SIZE = 128 * 1024;
+}
+
+md5_accumulator::md5_accumulator(off_t total_size, const read_fn &on_read, size_t max_held_bytes)
+  : _on_read(on_read),
+    _total_size(total_size),
+    _max_held_bytes(max_held_bytes),
+    _next_offset(0),
+    _held_bytes(0)
+{
+}
+
+int md5_accumulator::add(const char *data, size_t size, off_t offset)
+{
+  mutex::scoped_lock lock(_mutex);
+  off_t end = offset + size;
+
+  if (end <= _next_offset)
+    return 0;
+
+  if (offset > _next_offset) {
+    held_piece &p = _held[offset];
+
+    if (end <= p.end)
+      return 0;
+
+    _held_bytes -= p.data.size();
+    p.end = end;
+    p.data.clear();
+
+    if (_held_bytes + size <= _max_held_bytes) {
+      p.data.assign(data, data + size);
+      _held_bytes += size;
+    }
+
+    return 0;
+  }
+
+  _md5.update(reinterpret_cast<const uint8_t *>(data) + (_next_offset - offset), end - _next_offset);
+  _next_offset = end;
+
+  return drain(lock);
+}
+
+int md5_accumulator::drain(const mutex::scoped_lock &)
+{
+  vector<char> buffer;
+
+  while (!_held.empty() && _held.begin()->first <= _next_offset) {
+    held_map::iterator itor = _held.begin();
+    off_t offset = itor->first;
+    held_piece &p = itor->second;
+
+    if (p.end > _next_offset) {
+      if (!p.data.empty()) {
+        _md5.update(reinterpret_cast<const uint8_t *>(&p.data[_next_offset - offset]), p.end - _next_offset);
+        _next_offset = p.end;
+
+      } else {
+        buffer.resize(std::min(static_cast<off_t>(READ_BACK_SIZE), p.end - offset));
+
+        while (_next_offset < p.end) {
+          size_t size = std::min(static_cast<off_t>(buffer.size()), p.end - _next_offset);
+          int r = _on_read(&buffer[0], size, _next_offset);
+
+          if (r)
+            return r;
+
+          _md5.update(reinterpret_cast<const uint8_t *>(&buffer[0]), size);
+          _next_offset += size;
+        }
+      }
+    }
+
+    _held_bytes -= p.data.size();
+    _held.erase(itor);
+  }
+
+  return 0;
+}
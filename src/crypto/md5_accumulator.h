@@ -0,0 +1,109 @@
+/*
+ * crypto/md5_accumulator.h
+ * -------------------------------------------------------------------------
+ * MD5 hash of data that arrives in pieces, in any order.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_CRYPTO_MD5_ACCUMULATOR_H
+#define S3_CRYPTO_MD5_ACCUMULATOR_H
+
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "crypto/encoder.h"
+#include "crypto/md5.h"
+
+namespace s3
+{
+  namespace crypto
+  {
+    // md5 is strictly sequential, so pieces that arrive ahead of the first
+    // missing byte are held until the gap before them is filled. up to
+    // "max_held_bytes" are held in memory; beyond that, only the piece's range
+    // is remembered, and it's read back with "on_read" when its turn comes.
+    //
+    // pieces that repeat data already seen (retries, say) are ignored.
+    class md5_accumulator
+    {
+    public:
+      typedef boost::shared_ptr<md5_accumulator> ptr;
+
+      // fills "buffer" with "size" bytes from "offset". returns 0 on success
+      // or a negative error code.
+      typedef boost::function3<int, char *, size_t, off_t> read_fn;
+
+      md5_accumulator(off_t total_size, const read_fn &on_read, size_t max_held_bytes);
+
+      // thread safe
+      int add(const char *data, size_t size, off_t offset);
+
+      inline bool is_complete()
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+
+        return _next_offset == _total_size;
+      }
+
+      // returns an empty string unless every byte has been added
+      template <class encoder_type>
+      inline std::string get_hash()
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+        md5::context ctx = _md5;
+        uint8_t hash[md5::HASH_LEN];
+
+        if (_next_offset != _total_size)
+          return std::string();
+
+        ctx.finish(hash);
+
+        return encoder::encode<encoder_type>(hash, md5::HASH_LEN);
+      }
+
+    private:
+      struct held_piece
+      {
+        off_t end;
+        std::vector<char> data; // empty if it has to be read back
+      };
+
+      typedef std::map<off_t, held_piece> held_map;
+
+      int drain(const boost::mutex::scoped_lock &);
+
+      boost::mutex _mutex;
+      read_fn _on_read;
+      off_t _total_size;
+      size_t _max_held_bytes;
+
+      // protected by _mutex
+      md5::context _md5;
+      off_t _next_offset;
+      held_map _held;
+      size_t _held_bytes;
+    };
+  }
+}
+
+#endif
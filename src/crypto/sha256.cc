@@ -19,13 +19,235 @@
  * limitations under the License.
  */
 
+#include <string.h>
+
 #include <openssl/sha.h>
 
 #include "crypto/sha256.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define S3_SHA256_MULTI_AVX2
+  #include <cpuid.h>
+  #include <immintrin.h>
+#endif
+
 using s3::crypto::sha256;
 
+namespace
+{
+  const size_t BLOCK_LEN = 64;
+
+  #ifdef S3_SHA256_MULTI_AVX2
+    const size_t LANES = 8;
+
+    const uint32_t K[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+      0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+      0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+      0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+      0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+      0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+    const uint32_t INITIAL_STATE[8] = {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    #define AVX2 __attribute__((target("avx2")))
+
+    AVX2 inline __m256i rotr(__m256i x, int n)
+    {
+      return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+    }
+
+    AVX2 inline __m256i add(__m256i a, __m256i b)
+    {
+      return _mm256_add_epi32(a, b);
+    }
+
+    // word "index" of the current block of each lane, byte-swapped to host order
+    AVX2 inline __m256i load_word(const uint8_t * const *blocks, int index)
+    {
+      const __m256i swap = _mm256_set_epi8(
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+      uint32_t w[LANES];
+
+      for (size_t i = 0; i < LANES; i++)
+        memcpy(&w[i], blocks[i] + 4 * index, 4);
+
+      return _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(w)), swap);
+    }
+
+    AVX2 void compress(__m256i *state, const uint8_t * const *blocks)
+    {
+      __m256i w[16];
+      __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+      __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+      for (int t = 0; t < 64; t++) {
+        __m256i wt, t1, t2;
+
+        if (t < 16) {
+          wt = load_word(blocks, t);
+        } else {
+          __m256i w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+          __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr(w15, 7), rotr(w15, 18)), _mm256_srli_epi32(w15, 3));
+          __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr(w2, 17), rotr(w2, 19)), _mm256_srli_epi32(w2, 10));
+
+          wt = add(add(w[t & 15], s0), add(w[(t - 7) & 15], s1));
+        }
+
+        w[t & 15] = wt;
+
+        t1 = add(
+          add(h, _mm256_xor_si256(_mm256_xor_si256(rotr(e, 6), rotr(e, 11)), rotr(e, 25))),
+          add(
+            _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)),
+            add(_mm256_set1_epi32(K[t]), wt)));
+
+        t2 = add(
+          _mm256_xor_si256(_mm256_xor_si256(rotr(a, 2), rotr(a, 13)), rotr(a, 22)),
+          _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)), _mm256_and_si256(b, c)));
+
+        h = g;
+        g = f;
+        f = e;
+        e = add(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = add(t1, t2);
+      }
+
+      state[0] = add(state[0], a);
+      state[1] = add(state[1], b);
+      state[2] = add(state[2], c);
+      state[3] = add(state[3], d);
+      state[4] = add(state[4], e);
+      state[5] = add(state[5], f);
+      state[6] = add(state[6], g);
+      state[7] = add(state[7], h);
+    }
+
+    // hashes LANES inputs of "size" bytes each
+    AVX2 void compute_lanes(const uint8_t * const *inputs, size_t size, uint8_t *hashes)
+    {
+      // the message padding takes one or two blocks past the last full one
+      uint8_t tails[LANES][2 * BLOCK_LEN];
+      const uint8_t *blocks[LANES];
+      size_t full_blocks = size / BLOCK_LEN;
+      size_t tail_size = size % BLOCK_LEN;
+      size_t tail_blocks = (tail_size + 1 + 8 > BLOCK_LEN) ? 2 : 1;
+      uint64_t bit_len = static_cast<uint64_t>(size) * 8;
+      __m256i state[8];
+
+      for (int i = 0; i < 8; i++)
+        state[i] = _mm256_set1_epi32(INITIAL_STATE[i]);
+
+      for (size_t n = 0; n < full_blocks; n++) {
+        for (size_t i = 0; i < LANES; i++)
+          blocks[i] = inputs[i] + n * BLOCK_LEN;
+
+        compress(state, blocks);
+      }
+
+      for (size_t i = 0; i < LANES; i++) {
+        uint8_t *tail = tails[i];
+
+        memset(tail, 0, sizeof(tails[i]));
+        memcpy(tail, inputs[i] + full_blocks * BLOCK_LEN, tail_size);
+        tail[tail_size] = 0x80;
+
+        for (int b = 0; b < 8; b++)
+          tail[tail_blocks * BLOCK_LEN - 1 - b] = static_cast<uint8_t>(bit_len >> (8 * b));
+      }
+
+      for (size_t n = 0; n < tail_blocks; n++) {
+        for (size_t i = 0; i < LANES; i++)
+          blocks[i] = tails[i] + n * BLOCK_LEN;
+
+        compress(state, blocks);
+      }
+
+      for (int w = 0; w < 8; w++) {
+        uint32_t words[LANES];
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(words), state[w]);
+
+        for (size_t i = 0; i < LANES; i++) {
+          uint8_t *out = hashes + i * sha256::HASH_LEN + 4 * w;
+
+          out[0] = static_cast<uint8_t>(words[i] >> 24);
+          out[1] = static_cast<uint8_t>(words[i] >> 16);
+          out[2] = static_cast<uint8_t>(words[i] >> 8);
+          out[3] = static_cast<uint8_t>(words[i]);
+        }
+      }
+    }
+
+    #undef AVX2
+
+    // OpenSSL already uses the SHA extensions when they're present, and
+    // hashing one input at a time with them beats AVX2 lanes
+    bool use_lanes()
+    {
+      unsigned int eax, ebx, ecx, edx;
+      bool has_sha = false;
+
+      if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        has_sha = (ebx & (1 << 29)) != 0;
+      }
+
+      return __builtin_cpu_supports("avx2") && !has_sha;
+    }
+
+    const bool CAN_USE_LANES = __builtin_cpu_supports("avx2");
+    const bool USE_LANES_BY_DEFAULT = use_lanes();
+
+    bool s_use_lanes = USE_LANES_BY_DEFAULT;
+  #endif
+}
+
+bool sha256::force_lanes(bool force)
+{
+  #ifdef S3_SHA256_MULTI_AVX2
+    s_use_lanes = force ? CAN_USE_LANES : USE_LANES_BY_DEFAULT;
+
+    return CAN_USE_LANES;
+  #else
+    return false;
+  #endif
+}
+
 void sha256::compute(const uint8_t *input, size_t size, uint8_t *hash)
 {
   SHA256(input, size, hash);
 }
+
+void sha256::compute_multi(const uint8_t * const *inputs, size_t size, size_t count, uint8_t *hashes)
+{
+  #ifdef S3_SHA256_MULTI_AVX2
+    // even a partly-filled set of lanes is faster than two inputs hashed
+    // one at a time
+    while (s_use_lanes && count >= 2) {
+      const uint8_t *lanes[LANES];
+      uint8_t lane_hashes[LANES * HASH_LEN];
+      size_t n = (count < LANES) ? count : LANES;
+
+      for (size_t i = 0; i < LANES; i++)
+        lanes[i] = inputs[(i < n) ? i : 0];
+
+      compute_lanes(lanes, size, lane_hashes);
+      memcpy(hashes, lane_hashes, n * HASH_LEN);
+
+      inputs += n;
+      hashes += n * HASH_LEN;
+      count -= n;
+    }
+  #endif
+
+  for (size_t i = 0; i < count; i++)
+    compute(inputs[i], size, hashes + i * HASH_LEN);
+}
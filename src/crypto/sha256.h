@@ -36,10 +36,20 @@ namespace s3
     public:
       enum { HASH_LEN = 256 / 8 };
 
+      // for tests: if "force" is set, compute_multi() hashes in lanes
+      // whenever the CPU can, even where it would otherwise hash inputs one
+      // at a time. returns false if lanes aren't available at all.
+      static bool force_lanes(bool force);
+
     private:
       friend class hash;
 
       static void compute(const uint8_t *data, size_t size, uint8_t *hash);
+
+      // hashes "count" inputs of the same size, writing HASH_LEN bytes per
+      // input to "hashes". several inputs are hashed at once on CPUs where
+      // that's faster than hashing them one at a time.
+      static void compute_multi(const uint8_t * const *inputs, size_t size, size_t count, uint8_t *hashes);
     };
   }
 }
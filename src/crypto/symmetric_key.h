@@ -25,6 +25,7 @@
 
 #include <string>
 #include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
 
 #include "crypto/buffer.h"
 
@@ -85,12 +86,35 @@ namespace s3
         return _key->to_string() + ":" + _iv->to_string();
       }
 
+      // state that a cipher derives from the key (an expanded key schedule,
+      // say), kept so that it isn't rebuilt on every call. "owner" identifies
+      // the cipher; a key holds state for one cipher at a time.
+      inline boost::shared_ptr<void> get_cipher_state(const void *owner)
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+
+        return (owner == _cipher_state_owner) ? _cipher_state : boost::shared_ptr<void>();
+      }
+
+      inline void set_cipher_state(const void *owner, const boost::shared_ptr<void> &state)
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+
+        _cipher_state_owner = owner;
+        _cipher_state = state;
+      }
+
     private:
       inline symmetric_key()
+        : _cipher_state_owner(NULL)
       {
       }
 
       buffer::ptr _key, _iv;
+
+      boost::mutex _mutex;
+      const void *_cipher_state_owner;
+      boost::shared_ptr<void> _cipher_state;
     };
   }
 }
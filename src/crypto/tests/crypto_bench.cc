@@ -0,0 +1,316 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+#include "base/timer.h"
+#include "crypto/aes_cbc_256.h"
+#include "crypto/aes_ctr_256.h"
+#include "crypto/base64.h"
+#include "crypto/cipher.h"
+#include "crypto/encoder.h"
+#include "crypto/hash.h"
+#include "crypto/hash_list.h"
+#include "crypto/hex.h"
+#include "crypto/hmac_sha1.h"
+#include "crypto/md5.h"
+#include "crypto/sha256.h"
+#include "crypto/symmetric_key.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #include <x86intrin.h>
+  #define HAVE_TSC
+#endif
+
+using boost::thread_group;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using s3::base::timer;
+using s3::crypto::aes_cbc_256_with_pkcs;
+using s3::crypto::aes_ctr_256;
+using s3::crypto::base64;
+using s3::crypto::cipher;
+using s3::crypto::encoder;
+using s3::crypto::hash;
+using s3::crypto::hash_list;
+using s3::crypto::hex;
+using s3::crypto::hmac_sha1;
+using s3::crypto::md5;
+using s3::crypto::sha256;
+using s3::crypto::symmetric_key;
+
+namespace
+{
+  // runs one operation over "size" bytes of "in". "out" has room for at
+  // least size + a block.
+  typedef boost::function3<void, const uint8_t *, size_t, vector<uint8_t> *> operation_fn;
+
+  struct benchmark
+  {
+    const char *name;
+    operation_fn op;
+  };
+
+  struct result
+  {
+    double bytes;
+    uint64_t cycles;
+  };
+
+  const char *SHORT_OPTIONS = ":d:s:t:";
+
+  const option LONG_OPTIONS[] = {
+    { "duration", required_argument, NULL, 'd'  },
+    { "sizes",    required_argument, NULL, 's'  },
+    { "threads",  required_argument, NULL, 't'  },
+    { NULL,       0,                 NULL, '\0' } };
+
+  symmetric_key::ptr s_ctr_key, s_cbc_key;
+  const string HMAC_KEY = "crypto_bench hmac key";
+
+  inline uint64_t read_cycles()
+  {
+    #ifdef HAVE_TSC
+      return __rdtsc();
+    #else
+      return 0;
+    #endif
+  }
+
+  void run_sha256(const uint8_t *in, size_t size, vector<uint8_t> *out)
+  {
+    hash::compute<sha256>(in, size, &(*out)[0]);
+  }
+
+  void run_md5(const uint8_t *in, size_t size, vector<uint8_t> *out)
+  {
+    hash::compute<md5>(in, size, &(*out)[0]);
+  }
+
+  void run_hash_list(const uint8_t *in, size_t size, vector<uint8_t> *)
+  {
+    hash_list<sha256> list(size);
+
+    list.compute_hash(0, in, size);
+  }
+
+  void run_aes_ctr_256(const uint8_t *in, size_t size, vector<uint8_t> *out)
+  {
+    aes_ctr_256::encrypt(s_ctr_key, in, size, &(*out)[0]);
+  }
+
+  void run_aes_cbc_256(const uint8_t *in, size_t size, vector<uint8_t> *out)
+  {
+    cipher::encrypt<aes_cbc_256_with_pkcs>(s_cbc_key, in, size, out);
+  }
+
+  void run_hmac_sha1(const uint8_t *in, size_t size, vector<uint8_t> *out)
+  {
+    hmac_sha1::sign(
+      reinterpret_cast<const uint8_t *>(HMAC_KEY.c_str()),
+      HMAC_KEY.size(),
+      in,
+      size,
+      &(*out)[0]);
+  }
+
+  void run_base64(const uint8_t *in, size_t size, vector<uint8_t> *)
+  {
+    encoder::encode<base64>(in, size);
+  }
+
+  void run_hex(const uint8_t *in, size_t size, vector<uint8_t> *)
+  {
+    encoder::encode<hex>(in, size);
+  }
+
+  const benchmark BENCHMARKS[] = {
+    { "sha256",      run_sha256 },
+    { "md5",         run_md5 },
+    { "hash_list",   run_hash_list },
+    { "aes_ctr_256", run_aes_ctr_256 },
+    { "aes_cbc_256", run_aes_cbc_256 },
+    { "hmac_sha1",   run_hmac_sha1 },
+    { "base64",      run_base64 },
+    { "hex",         run_hex } };
+
+  const int BENCHMARK_COUNT = sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]);
+
+  void worker(const operation_fn &op, size_t size, double duration, result *r)
+  {
+    vector<uint8_t> in(size + 1), out(size + 2 * aes_ctr_256::BLOCK_LEN + hmac_sha1::MAC_LEN);
+    unsigned int seed = size;
+    double end;
+    uint64_t start_cycles;
+
+    for (size_t i = 0; i < in.size(); i++)
+      in[i] = static_cast<uint8_t>(rand_r(&seed));
+
+    r->bytes = 0;
+
+    // once untimed, to warm up caches and lazily-prepared keys
+    op(&in[0], size, &out);
+
+    start_cycles = read_cycles();
+    end = timer::get_current_time() + duration;
+
+    do {
+      op(&in[0], size, &out);
+      r->bytes += size;
+    } while (timer::get_current_time() < end);
+
+    r->cycles = read_cycles() - start_cycles;
+  }
+
+  void run(const benchmark &b, size_t size, int threads, double duration, bool first)
+  {
+    vector<result> results(threads);
+    thread_group group;
+    double start, elapsed, bytes = 0;
+    uint64_t cycles = 0;
+
+    start = timer::get_current_time();
+
+    for (int i = 0; i < threads; i++)
+      group.create_thread(boost::bind(&worker, b.op, size, duration, &results[i]));
+
+    group.join_all();
+    elapsed = timer::get_current_time() - start;
+
+    for (int i = 0; i < threads; i++) {
+      bytes += results[i].bytes;
+      cycles += results[i].cycles;
+    }
+
+    cout << 
+      (first ? "  " : ", ") <<
+      "{ \"name\": \"" << b.name << "\", " <<
+      "\"size\": " << size << ", " <<
+      "\"threads\": " << threads << ", " <<
+      "\"mb_per_s\": " << bytes / elapsed / (1024 * 1024) << ", " <<
+      "\"cycles_per_byte\": ";
+
+    #ifdef HAVE_TSC
+      cout << static_cast<double>(cycles) / bytes;
+    #else
+      cout << "null";
+    #endif
+
+    cout << " }" << endl;
+  }
+
+  bool parse_list(const char *arg, vector<size_t> *out)
+  {
+    std::istringstream in(arg);
+    string item;
+
+    out->clear();
+
+    while (std::getline(in, item, ',')) {
+      long v = atol(item.c_str());
+
+      if (v <= 0)
+        return false;
+
+      out->push_back(v);
+    }
+
+    return !out->empty();
+  }
+
+  void print_usage(const char *arg0)
+  {
+    const char *base_name = strrchr(arg0, '/');
+
+    base_name = base_name ? base_name + 1 : arg0;
+
+    cerr <<
+      "Usage: " << base_name << " [options] [benchmark-name ...]\n"
+      "\n"
+      "[options] can be:\n"
+      "\n"
+      "  -d, --duration <s>      Run each case for <s> seconds (default 0.5).\n"
+      "  -s, --sizes <n,...>     Buffer sizes in bytes (default 1024,131072,5242880).\n"
+      "  -t, --threads <n,...>   Thread counts (default 1 and one per CPU).\n"
+      "\n"
+      "Prints a JSON array with throughput and cycles per byte (as counted by the\n"
+      "time-stamp counter, summed over threads) for each case." << endl;
+
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int opt = 0;
+  double duration = 0.5;
+  vector<size_t> sizes, threads;
+  vector<string> names;
+  bool first = true;
+
+  sizes.push_back(1024);
+  sizes.push_back(static_cast<size_t>(hash_list<sha256>::CHUNK_SIZE));
+  sizes.push_back(5 * 1024 * 1024);
+
+  threads.push_back(1);
+
+  if (boost::thread::hardware_concurrency() > 1)
+    threads.push_back(boost::thread::hardware_concurrency());
+
+  while ((opt = getopt_long(argc, argv, SHORT_OPTIONS, LONG_OPTIONS, NULL)) != -1) {
+    switch (opt) {
+      case 'd':
+        duration = atof(optarg);
+        break;
+
+      case 's':
+        if (!parse_list(optarg, &sizes))
+          print_usage(argv[0]);
+        break;
+
+      case 't':
+        if (!parse_list(optarg, &threads))
+          print_usage(argv[0]);
+        break;
+
+      default:
+        print_usage(argv[0]);
+    }
+  }
+
+  for (int i = optind; i < argc; i++)
+    names.push_back(argv[i]);
+
+  s_ctr_key = symmetric_key::generate<aes_ctr_256>();
+  s_cbc_key = symmetric_key::generate<aes_cbc_256_with_pkcs>();
+
+  cout << "[" << endl;
+
+  for (int b = 0; b < BENCHMARK_COUNT; b++) {
+    if (!names.empty() && std::find(names.begin(), names.end(), BENCHMARKS[b].name) == names.end())
+      continue;
+
+    for (size_t s = 0; s < sizes.size(); s++) {
+      for (size_t t = 0; t < threads.size(); t++) {
+        run(BENCHMARKS[b], sizes[s], threads[t], duration, first);
+        first = false;
+      }
+    }
+  }
+
+  cout << "]" << endl;
+
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include <string.h>
+
+#include <boost/bind.hpp>
+#include <gtest/gtest.h>
+
+#include "crypto/hash.h"
+#include "crypto/hex.h"
+#include "crypto/md5.h"
+#include "crypto/md5_accumulator.h"
+#include "crypto/tests/random.h"
+
+using std::string;
+using std::vector;
+
+using s3::crypto::hash;
+using s3::crypto::hex;
+using s3::crypto::md5;
+using s3::crypto::md5_accumulator;
+using s3::crypto::tests::random;
+
+namespace
+{
+  const size_t TOTAL_SIZE = 1024 * 1024 + 17;
+  const size_t PIECE_SIZE = 64 * 1024;
+
+  int read_back(const vector<uint8_t> *in, int *calls, char *buffer, size_t size, off_t offset)
+  {
+    (*calls)++;
+    memcpy(buffer, &(*in)[offset], size);
+
+    return 0;
+  }
+
+  void add_in_reverse(md5_accumulator *acc, const vector<uint8_t> &in)
+  {
+    size_t last = (in.size() - 1) / PIECE_SIZE * PIECE_SIZE;
+
+    for (off_t offset = last; offset >= 0; offset -= PIECE_SIZE) {
+      size_t size = std::min(PIECE_SIZE, in.size() - offset);
+
+      ASSERT_EQ(0, acc->add(reinterpret_cast<const char *>(&in[offset]), size, offset));
+    }
+  }
+}
+
+TEST(md5_accumulator, in_order)
+{
+  vector<uint8_t> in;
+  int calls = 0;
+
+  random::read(TOTAL_SIZE, &in);
+
+  md5_accumulator acc(in.size(), boost::bind(&read_back, &in, &calls, _1, _2, _3), 0);
+
+  for (size_t offset = 0; offset < in.size(); offset += PIECE_SIZE) {
+    EXPECT_EQ(string(), acc.get_hash<hex>());
+    ASSERT_EQ(0, acc.add(reinterpret_cast<const char *>(&in[offset]), std::min(PIECE_SIZE, in.size() - offset), offset));
+  }
+
+  EXPECT_TRUE(acc.is_complete());
+  EXPECT_EQ((hash::compute<md5, hex>(in)), acc.get_hash<hex>());
+  EXPECT_EQ(0, calls);
+}
+
+TEST(md5_accumulator, reversed_and_held)
+{
+  vector<uint8_t> in;
+  int calls = 0;
+
+  random::read(TOTAL_SIZE, &in);
+
+  md5_accumulator acc(in.size(), boost::bind(&read_back, &in, &calls, _1, _2, _3), in.size());
+
+  add_in_reverse(&acc, in);
+
+  EXPECT_EQ((hash::compute<md5, hex>(in)), acc.get_hash<hex>());
+  EXPECT_EQ(0, calls);
+}
+
+TEST(md5_accumulator, reversed_and_read_back)
+{
+  vector<uint8_t> in;
+  int calls = 0;
+
+  random::read(TOTAL_SIZE, &in);
+
+  md5_accumulator acc(in.size(), boost::bind(&read_back, &in, &calls, _1, _2, _3), 2 * PIECE_SIZE);
+
+  add_in_reverse(&acc, in);
+
+  EXPECT_EQ((hash::compute<md5, hex>(in)), acc.get_hash<hex>());
+  EXPECT_LT(0, calls);
+}
+
+TEST(md5_accumulator, repeated_pieces)
+{
+  vector<uint8_t> in;
+  int calls = 0;
+
+  random::read(TOTAL_SIZE, &in);
+
+  md5_accumulator acc(in.size(), boost::bind(&read_back, &in, &calls, _1, _2, _3), in.size());
+
+  // the second half twice, then the whole thing
+  for (int i = 0; i < 2; i++)
+    ASSERT_EQ(0, acc.add(reinterpret_cast<const char *>(&in[in.size() / 2]), in.size() - in.size() / 2, in.size() / 2));
+
+  ASSERT_EQ(0, acc.add(reinterpret_cast<const char *>(&in[0]), in.size(), 0));
+
+  EXPECT_EQ((hash::compute<md5, hex>(in)), acc.get_hash<hex>());
+}
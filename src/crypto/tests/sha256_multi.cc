@@ -0,0 +1,88 @@
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+#include "crypto/hash.h"
+#include "crypto/hash_list.h"
+#include "crypto/hex.h"
+#include "crypto/sha256.h"
+#include "crypto/tests/random.h"
+
+using std::string;
+using std::vector;
+
+using s3::crypto::hash;
+using s3::crypto::hash_list;
+using s3::crypto::hex;
+using s3::crypto::sha256;
+using s3::crypto::tests::random;
+
+namespace
+{
+  // around the padding boundaries, and a whole hash list chunk
+  const size_t SIZES[] = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 1000, 128 * 1024 };
+  const int SIZE_COUNT = sizeof(SIZES) / sizeof(SIZES[0]);
+
+  const size_t MAX_COUNT = 19;
+
+  void test_compute_multi()
+  {
+    for (int s = 0; s < SIZE_COUNT; s++) {
+      for (size_t count = 1; count <= MAX_COUNT; count++) {
+        vector<vector<uint8_t> > inputs(count);
+        vector<const uint8_t *> pointers(count);
+        vector<uint8_t> hashes(count * sha256::HASH_LEN);
+
+        for (size_t i = 0; i < count; i++) {
+          random::read(SIZES[s] + 1, &inputs[i]); // +1 so that &inputs[i][0] is valid
+          pointers[i] = &inputs[i][0];
+        }
+
+        hash::compute_multi<sha256>(&pointers[0], SIZES[s], count, &hashes[0]);
+
+        for (size_t i = 0; i < count; i++) {
+          uint8_t expected[sha256::HASH_LEN];
+
+          hash::compute<sha256>(pointers[i], SIZES[s], expected);
+
+          EXPECT_EQ(0, memcmp(expected, &hashes[i * sha256::HASH_LEN], sha256::HASH_LEN))
+            << "for size = " << SIZES[s] << ", count = " << count << ", input = " << i;
+        }
+      }
+    }
+  }
+}
+
+TEST(sha256, compute_multi_matches_compute)
+{
+  test_compute_multi();
+}
+
+TEST(sha256, compute_multi_lanes_match_compute)
+{
+  // on CPUs with the SHA extensions, lanes are normally skipped
+  if (!sha256::force_lanes(true))
+    return; // no AVX2 here, so there's nothing to test
+
+  test_compute_multi();
+
+  sha256::force_lanes(false);
+}
+
+TEST(sha256, hash_list_batches_match_single_chunks)
+{
+  const size_t CHUNK_SIZE = hash_list<sha256>::CHUNK_SIZE;
+  const size_t SIZE = 37 * CHUNK_SIZE + 1234;
+
+  vector<uint8_t> in;
+  hash_list<sha256> whole(SIZE), chunked(SIZE);
+
+  random::read(SIZE, &in);
+
+  whole.compute_hash(0, &in[0], SIZE);
+
+  for (size_t offset = 0; offset < SIZE; offset += CHUNK_SIZE)
+    chunked.compute_hash(offset, &in[offset], std::min(CHUNK_SIZE, SIZE - offset));
+
+  EXPECT_EQ(chunked.get_root_hash<hex>(), whole.get_root_hash<hex>());
+}
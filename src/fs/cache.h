@@ -93,6 +93,16 @@ namespace s3
         return 0;
       }
 
+      // true if "path" is cached and hasn't expired (doesn't count as a hit
+      // or a miss)
+      inline static bool is_cached(const std::string &path)
+      {
+        boost::mutex::scoped_lock lock(s_mutex);
+        object::ptr o;
+
+        return s_cache_map->find(path, &o) && o && !o->is_expired();
+      }
+
       // this method is intended to ensure that fn() is called on the one and
       // only cached object at "path"
       inline static void lock_object(const std::string &path, const locked_object_function &fn)
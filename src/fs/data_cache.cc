@@ -0,0 +1,325 @@
+/*
+ * fs/data_cache.cc
+ * -------------------------------------------------------------------------
+ * Local file content cache implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <stdexcept>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+#include "base/config.h"
+#include "base/logger.h"
+#include "base/statistics.h"
+#include "crypto/hash.h"
+#include "crypto/hex.h"
+#include "crypto/sha256.h"
+#include "fs/data_cache.h"
+
+using boost::mutex;
+using boost::detail::atomic_count;
+using std::list;
+using std::make_pair;
+using std::map;
+using std::ostream;
+using std::pair;
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+using s3::base::config;
+using s3::base::statistics;
+using s3::crypto::hash;
+using s3::crypto::hex;
+using s3::crypto::sha256;
+using s3::fs::data_cache;
+
+namespace
+{
+  const char *DIR_NAME = "/" PACKAGE_NAME ".data-cache";
+  const string TEMP_PREFIX = "tmp-";
+  const size_t KEY_LEN = sha256::HASH_LEN * 2; // hex-encoded
+
+  struct entry
+  {
+    off_t size;
+    list<string>::iterator lru_pos;
+  };
+
+  typedef map<string, entry> entry_map;
+
+  mutex s_mutex;
+  string s_dir;
+  entry_map s_entries; // protected by s_mutex
+  list<string> s_lru; // oldest first, protected by s_mutex
+  off_t s_size = 0; // protected by s_mutex
+
+  atomic_count s_hits(0), s_misses(0), s_evictions(0), s_check_in_failures(0);
+
+  void statistics_writer(ostream *o)
+  {
+    mutex::scoped_lock lock(s_mutex);
+
+    *o <<
+      "data cache:\n"
+      "  entries: " << s_entries.size() << "\n"
+      "  size: " << s_size << "\n"
+      "  hits: " << s_hits << "\n"
+      "  misses: " << s_misses << "\n"
+      "  evictions: " << s_evictions << "\n"
+      "  check-in failures: " << s_check_in_failures << "\n";
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
+
+  inline string build_key(const string &path, const string &etag, const string &sha256_hash)
+  {
+    string k = config::get_bucket_name();
+
+    k += '\0';
+    k += path;
+    k += '\0';
+    k += etag;
+    k += '\0';
+    k += sha256_hash;
+
+    return hash::compute<sha256, hex>(k);
+  }
+
+  inline string build_entry_path(const string &key)
+  {
+    return s_dir + "/" + key;
+  }
+
+  void add_entry(const mutex::scoped_lock &, const string &key, off_t size)
+  {
+    entry &e = s_entries[key];
+
+    e.size = size;
+    e.lru_pos = s_lru.insert(s_lru.end(), key);
+
+    s_size += size;
+  }
+
+  void remove_entry(const mutex::scoped_lock &, entry_map::iterator itor)
+  {
+    s_size -= itor->second.size;
+    s_lru.erase(itor->second.lru_pos);
+    s_entries.erase(itor);
+  }
+
+  void prune(const mutex::scoped_lock &lock, off_t max_size)
+  {
+    while (s_size > max_size && !s_lru.empty()) {
+      entry_map::iterator itor = s_entries.find(s_lru.front());
+
+      unlink(build_entry_path(itor->first).c_str());
+      remove_entry(lock, itor);
+
+      ++s_evictions;
+    }
+  }
+
+  int create_temp(int *fd, string *name)
+  {
+    char temp_name[PATH_MAX];
+
+    snprintf(temp_name, sizeof(temp_name), "%s/%sXXXXXX", s_dir.c_str(), TEMP_PREFIX.c_str());
+
+    *fd = mkstemp(temp_name);
+
+    if (*fd == -1)
+      return -errno;
+
+    *name = temp_name;
+
+    return 0;
+  }
+}
+
+off_t data_cache::s_max_size = 0;
+
+void data_cache::init()
+{
+  typedef pair<time_t, pair<string, off_t> > found_entry;
+
+  mutex::scoped_lock lock(s_mutex);
+  vector<found_entry> found;
+  DIR *dir;
+  dirent *de;
+
+  if (config::get_data_cache_size_in_mb() == 0)
+    return;
+
+  s_dir = config::get_tmp_path() + DIR_NAME;
+
+  if (mkdir(s_dir.c_str(), 0700) == -1 && errno != EEXIST) {
+    S3_LOG(LOG_ERR, "data_cache::init", "cannot create data cache directory [%s].\n", s_dir.c_str());
+    throw runtime_error("failed to create data cache directory");
+  }
+
+  dir = opendir(s_dir.c_str());
+
+  if (!dir) {
+    S3_LOG(LOG_ERR, "data_cache::init", "cannot open data cache directory [%s].\n", s_dir.c_str());
+    throw runtime_error("failed to open data cache directory");
+  }
+
+  while ((de = readdir(dir))) {
+    string name = de->d_name;
+    string full_name = build_entry_path(name);
+    struct stat s;
+
+    if (name.substr(0, TEMP_PREFIX.size()) == TEMP_PREFIX) {
+      // working files left behind by an earlier instance
+      unlink(full_name.c_str());
+      continue;
+    }
+
+    if (name.size() != KEY_LEN || stat(full_name.c_str(), &s) == -1 || !S_ISREG(s.st_mode))
+      continue;
+
+    found.push_back(make_pair(s.st_mtime, make_pair(name, s.st_size)));
+  }
+
+  closedir(dir);
+
+  // least-recently checked in first
+  std::sort(found.begin(), found.end());
+
+  for (vector<found_entry>::const_iterator itor = found.begin(); itor != found.end(); ++itor)
+    add_entry(lock, itor->second.first, itor->second.second);
+
+  s_max_size = static_cast<off_t>(config::get_data_cache_size_in_mb()) * 1024 * 1024;
+  prune(lock, s_max_size);
+
+  S3_LOG(
+    LOG_DEBUG,
+    "data_cache::init",
+    "using [%s], found %zu entries, %jd bytes.\n",
+    s_dir.c_str(),
+    s_entries.size(),
+    static_cast<intmax_t>(s_size));
+}
+
+int data_cache::create(int *fd, string *name)
+{
+  return create_temp(fd, name);
+}
+
+int data_cache::check_out(
+  const string &path,
+  const string &etag,
+  const string &sha256_hash,
+  off_t size,
+  int *fd,
+  string *name)
+{
+  mutex::scoped_lock lock(s_mutex);
+  string key = build_key(path, etag, sha256_hash);
+  entry_map::iterator itor = s_entries.find(key);
+  struct stat s;
+  int temp_fd, r;
+
+  if (itor == s_entries.end()) {
+    ++s_misses;
+    return -ENOENT;
+  }
+
+  remove_entry(lock, itor);
+
+  // reserve a working file name and move the cached copy over it
+  r = create_temp(&temp_fd, name);
+
+  if (r)
+    return r;
+
+  close(temp_fd);
+
+  if (rename(build_entry_path(key).c_str(), name->c_str()) == -1) {
+    S3_LOG(LOG_WARNING, "data_cache::check_out", "failed to check out [%s] for [%s].\n", key.c_str(), path.c_str());
+
+    unlink(name->c_str());
+    ++s_misses;
+    return -ENOENT;
+  }
+
+  *fd = open(name->c_str(), O_RDWR);
+
+  if (*fd != -1 && fstat(*fd, &s) == 0 && s.st_size == size) {
+    ++s_hits;
+    return 0;
+  }
+
+  S3_LOG(LOG_WARNING, "data_cache::check_out", "cached copy of [%s] is not usable.\n", path.c_str());
+
+  if (*fd != -1)
+    close(*fd);
+
+  unlink(name->c_str());
+  ++s_misses;
+  return -ENOENT;
+}
+
+void data_cache::check_in(
+  const string &name,
+  const string &path,
+  const string &etag,
+  const string &sha256_hash,
+  off_t size)
+{
+  mutex::scoped_lock lock(s_mutex);
+  string key = build_key(path, etag, sha256_hash);
+  string entry_path = build_entry_path(key);
+  entry_map::iterator itor = s_entries.find(key);
+
+  if (itor != s_entries.end())
+    remove_entry(lock, itor);
+
+  if (rename(name.c_str(), entry_path.c_str()) == -1) {
+    S3_LOG(LOG_WARNING, "data_cache::check_in", "failed to check in [%s].\n", path.c_str());
+
+    unlink(name.c_str());
+    ++s_check_in_failures;
+    return;
+  }
+
+  // the modification time orders entries when they're reloaded in init()
+  utimes(entry_path.c_str(), NULL);
+
+  add_entry(lock, key, size);
+  prune(lock, s_max_size);
+}
+
+void data_cache::discard(const string &name)
+{
+  unlink(name.c_str());
+}
@@ -0,0 +1,77 @@
+/*
+ * fs/data_cache.h
+ * -------------------------------------------------------------------------
+ * Persistent, size-bounded local cache of file contents.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_FS_DATA_CACHE_H
+#define S3_FS_DATA_CACHE_H
+
+#include <sys/types.h>
+
+#include <string>
+
+namespace s3
+{
+  namespace fs
+  {
+    // entries are keyed on path, etag and sha256 hash, so an entry is only
+    // ever returned for an object whose content hasn't changed since the
+    // entry was stored.
+    //
+    // open files are "checked out" of the cache: the cached copy becomes the
+    // file's working copy (no data is copied), and is "checked in" again under
+    // the object's (possibly new) etag when the file is released.
+    class data_cache
+    {
+    public:
+      static void init();
+
+      inline static bool is_enabled() { return s_max_size > 0; }
+
+      // creates an empty working file inside the cache directory
+      static int create(int *fd, std::string *name);
+
+      // if a matching entry of the given size exists, removes it from the
+      // cache and opens it as a working file. returns -ENOENT otherwise.
+      static int check_out(
+        const std::string &path,
+        const std::string &etag,
+        const std::string &sha256_hash,
+        off_t size,
+        int *fd,
+        std::string *name);
+
+      // moves a working file (from create() or check_out()) into the cache
+      static void check_in(
+        const std::string &name,
+        const std::string &path,
+        const std::string &etag,
+        const std::string &sha256_hash,
+        off_t size);
+
+      // removes a working file without caching it
+      static void discard(const std::string &name);
+
+    private:
+      static off_t s_max_size;
+    };
+  }
+}
+
+#endif
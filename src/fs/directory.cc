@@ -76,6 +76,17 @@ namespace
     return 0;
   }
 
+  void precache(const string &path, int hints)
+  {
+    // the object may have been fetched for a getattr() by the time we get to
+    // it, in which case there's no point
+    pool::post_speculative(
+      s3::threads::PR_REQ_1,
+      boost::bind(precache_object, _1, path, hints),
+      config::get_precache_deadline_in_s(),
+      !boost::bind(&cache::is_cached, path));
+  }
+
   int copy_object(const request::ptr &req, string *name, const string &old_base, const string &new_base, bool is_retry)
   {
     string old_name = old_base + *name;
@@ -181,7 +192,7 @@ int directory::read(const request::ptr &req, const filler_function &filler)
       filler(relative_path);
 
       if (config::get_precache_on_readdir())
-        pool::call_async(threads::PR_REQ_1, bind(precache_object, _1, path + relative_path, HINT_IS_DIR));
+        precache(path + relative_path, HINT_IS_DIR);
 
       if (cache)
         cache->push_back(relative_path);
@@ -199,7 +210,7 @@ int directory::read(const request::ptr &req, const filler_function &filler)
         filler(relative_path);
 
         if (config::get_precache_on_readdir())
-          pool::call_async(threads::PR_REQ_1, bind(precache_object, _1, path + relative_path, HINT_IS_FILE));
+          precache(path + relative_path, HINT_IS_FILE);
 
         if (cache)
           cache->push_back(relative_path);
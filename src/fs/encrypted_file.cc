@@ -21,13 +21,16 @@
 
 #include <boost/detail/atomic_count.hpp>
 
+#include "base/buffer_pool.h"
 #include "base/logger.h"
 #include "base/request.h"
 #include "base/statistics.h"
 #include "crypto/aes_cbc_256.h"
 #include "crypto/aes_ctr_256.h"
 #include "crypto/cipher.h"
+#include "crypto/hash_list.h"
 #include "crypto/hex.h"
+#include "crypto/sha256.h"
 #include "crypto/symmetric_key.h"
 #include "fs/encrypted_file.h"
 #include "fs/encryption.h"
@@ -38,9 +41,8 @@ using boost::detail::atomic_count;
 using std::ostream;
 using std::runtime_error;
 using std::string;
-using std::vector;
 
-using s3::base::char_vector;
+using s3::base::buffer_pool;
 using s3::base::char_vector_ptr;
 using s3::base::request;
 using s3::base::statistics;
@@ -48,7 +50,9 @@ using s3::crypto::aes_cbc_256_with_pkcs;
 using s3::crypto::aes_ctr_256;
 using s3::crypto::buffer;
 using s3::crypto::cipher;
+using s3::crypto::hash_list;
 using s3::crypto::hex;
+using s3::crypto::sha256;
 using s3::crypto::symmetric_key;
 using s3::fs::encrypted_file;
 using s3::fs::encryption;
@@ -61,6 +65,10 @@ namespace
   const string CONTENT_TYPE = "binary/encrypted-s3fuse-file_0100"; // version 1.0
   const string META_VERIFIER = "s3fuse_enc_meta ";
 
+  // small enough to stay in cache between hashing and encrypting, and
+  // aligned to hash list chunks
+  const size_t TILE_SIZE = hash_list<sha256>::CHUNK_SIZE;
+
   atomic_count s_non_empty_but_not_intact(0), s_no_iv_or_meta(0), s_init_errors(0), s_open_without_key(0);
 
   object * checker(const string &path, const request::ptr &req)
@@ -219,6 +227,30 @@ int encrypted_file::is_downloadable()
   return 0;
 }
 
+bool encrypted_file::is_cacheable()
+{
+  // never keep decrypted contents around after the file is closed
+  return false;
+}
+
+bool encrypted_file::is_streamable()
+{
+  // streamed parts bypass write_chunk(), which is where we decrypt
+  return false;
+}
+
+bool encrypted_file::can_copy_unchanged_ranges()
+{
+  // every upload uses a new data key, so no existing ciphertext is reusable
+  return false;
+}
+
+bool encrypted_file::can_upload_while_writing()
+{
+  // the data key is only chosen in prepare_upload()
+  return false;
+}
+
 int encrypted_file::prepare_upload()
 {
   _meta_key = symmetric_key::generate<aes_cbc_256_with_pkcs>(encryption::get_volume_key());
@@ -249,36 +281,56 @@ int encrypted_file::finalize_upload(const string &returned_etag)
 
 int encrypted_file::read_chunk(size_t size, off_t offset, const char_vector_ptr &buffer)
 {
-  char_vector_ptr temp(new char_vector());
-  int r;
-
-  r = file::read_chunk(size, offset, temp);
-
-  if (r)
-    return r;
-
-  buffer->resize(temp->size());
-
-  aes_ctr_256::encrypt_with_byte_offset(
-    _data_key, 
-    offset,
-    reinterpret_cast<const uint8_t *>(&(*temp)[0]), 
-    temp->size(), 
-    reinterpret_cast<uint8_t *>(&(*buffer)[0]));
+  buffer->resize(size);
+
+  // each tile is read, hashed and encrypted in place while it's still in
+  // cache, rather than making a pass over the whole buffer for each
+  for (size_t tile = 0; tile < size; tile += TILE_SIZE) {
+    size_t tile_size = std::min(TILE_SIZE, size - tile);
+    char *data = &(*buffer)[tile];
+    int r;
+
+    r = read_and_hash(data, tile_size, offset + tile);
+
+    if (r)
+      return r;
+
+    aes_ctr_256::encrypt_with_byte_offset(
+      _data_key, 
+      offset + tile,
+      reinterpret_cast<const uint8_t *>(data), 
+      tile_size, 
+      reinterpret_cast<uint8_t *>(data));
+  }
 
   return 0;
 }
 
 int encrypted_file::write_chunk(const char *buffer, size_t size, off_t offset)
 {
-  vector<char> temp(size);
+  // called with a transfer buffer already held
+  char_vector_ptr temp(buffer_pool::acquire(std::min(TILE_SIZE, size), false));
 
-  aes_ctr_256::decrypt_with_byte_offset(
-    _data_key, 
-    offset,
-    reinterpret_cast<const uint8_t *>(buffer), 
-    size, 
-    reinterpret_cast<uint8_t *>(&temp[0]));
+  temp->resize(std::min(TILE_SIZE, size));
 
-  return file::write_chunk(&temp[0], size, offset);
+  // decrypted one tile at a time, and then written and hashed while still in
+  // cache
+  for (size_t tile = 0; tile < size; tile += TILE_SIZE) {
+    size_t tile_size = std::min(TILE_SIZE, size - tile);
+    int r;
+
+    aes_ctr_256::decrypt_with_byte_offset(
+      _data_key, 
+      offset + tile,
+      reinterpret_cast<const uint8_t *>(buffer + tile), 
+      tile_size, 
+      reinterpret_cast<uint8_t *>(&(*temp)[0]));
+
+    r = file::write_chunk(&(*temp)[0], tile_size, offset + tile);
+
+    if (r)
+      return r;
+  }
+
+  return 0;
 }
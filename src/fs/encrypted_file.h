@@ -60,6 +60,10 @@ namespace s3
       virtual void set_request_headers(const boost::shared_ptr<base::request> &req);
 
       virtual int is_downloadable();
+      virtual bool is_cacheable();
+      virtual bool is_streamable();
+      virtual bool can_copy_unchanged_ranges();
+      virtual bool can_upload_while_writing();
 
       virtual int prepare_upload();
       virtual int finalize_upload(const std::string &returned_etag);
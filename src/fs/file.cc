@@ -19,8 +19,12 @@
  * limitations under the License.
  */
 
+#include <string.h>
+
+#include <limits>
 #include <boost/detail/atomic_count.hpp>
 
+#include "base/buffer_pool.h"
 #include "base/config.h"
 #include "base/logger.h"
 #include "base/request.h"
@@ -29,10 +33,13 @@
 #include "crypto/hex.h"
 #include "crypto/hex_with_quotes.h"
 #include "crypto/md5.h"
+#include "crypto/md5_accumulator.h"
 #include "fs/cache.h"
+#include "fs/data_cache.h"
 #include "fs/metadata.h"
 #include "fs/mime_types.h"
 #include "fs/file.h"
+#include "fs/read_stream.h"
 #include "fs/static_xattr.h"
 #include "services/file_transfer.h"
 #include "services/service.h"
@@ -44,6 +51,7 @@ using std::ostream;
 using std::runtime_error;
 using std::string;
 
+using s3::base::buffer_pool;
 using s3::base::char_vector_ptr;
 using s3::base::config;
 using s3::base::request;
@@ -53,12 +61,17 @@ using s3::crypto::hash_list;
 using s3::crypto::hex;
 using s3::crypto::hex_with_quotes;
 using s3::crypto::md5;
+using s3::crypto::md5_accumulator;
 using s3::crypto::sha256;
+using s3::fs::data_cache;
 using s3::fs::file;
 using s3::fs::metadata;
 using s3::fs::mime_types;
 using s3::fs::object;
+using s3::fs::read_stream;
 using s3::fs::static_xattr;
+using s3::services::early_upload;
+using s3::services::file_transfer;
 using s3::services::service;
 using s3::threads::pool;
 
@@ -68,8 +81,24 @@ namespace
 {
   const off_t TRUNCATE_LIMIT = 4ULL * 1024 * 1024 * 1024; // 4 GB
 
+  // data downloaded ahead of a missing part is held in memory, up to this
+  // limit, for the md5 hash; beyond it, it's read back from the local copy
+  const size_t MD5_MAX_HELD_BYTES = 16 * 1024 * 1024;
+
+  // the local copy of an early upload is hashed a block at a time, since
+  // parts still being sent hold buffers of their own
+  const size_t HASH_BLOCK_SIZE = hash_list<sha256>::CHUNK_SIZE;
+
   atomic_count s_sha256_mismatches(0), s_md5_mismatches(0), s_no_hash_checks(0);
-  atomic_count s_non_dirty_flushes(0), s_reopens(0);
+  atomic_count s_non_dirty_flushes(0), s_reopens(0), s_reads_during_download(0), s_stream_fallbacks(0);
+  atomic_count s_stale_copy_sources(0), s_early_uploads_abandoned(0), s_early_upload_fallbacks(0);
+  atomic_count s_write_behind_flushes(0), s_write_behind_failures(0), s_write_behind_waits(0);
+  atomic_count s_memory_files(0), s_memory_file_promotions(0);
+
+  // number of uploads queued or running in the background
+  mutex s_write_behind_mutex;
+  boost::condition s_write_behind_condition;
+  int s_write_behind_pending = 0; // protected by s_write_behind_mutex
 
   object * checker(const string &path, const request::ptr &req)
   {
@@ -82,11 +111,42 @@ namespace
       "files:\n"
       "  sha256 mismatches: " << s_sha256_mismatches << ", md5 mismatches: " << s_md5_mismatches << ", no hash checks: " << s_no_hash_checks << "\n"
       "  non-dirty flushes: " << s_non_dirty_flushes << "\n"
-      "  reopens: " << s_reopens << "\n";
+      "  reopens: " << s_reopens << "\n"
+      "  reads during download: " << s_reads_during_download << "\n"
+      "  stream fallbacks: " << s_stream_fallbacks << "\n"
+      "  stale copy sources: " << s_stale_copy_sources << "\n"
+      "  early uploads abandoned: " << s_early_uploads_abandoned << "\n"
+      "  early upload fallbacks: " << s_early_upload_fallbacks << "\n"
+      "  write-behind flushes: " << s_write_behind_flushes << "\n"
+      "  write-behind failures: " << s_write_behind_failures << "\n"
+      "  write-behind waits: " << s_write_behind_waits << "\n"
+      "  files kept in memory: " << s_memory_files << "\n"
+      "  files moved out of memory: " << s_memory_file_promotions << "\n";
   }
 
   object::type_checker_list::entry s_checker_reg(checker, 1000);
   statistics::writers::entry s_writer(statistics_writer, 0);
+
+  int create_temp_file(const string &path, int *fd)
+  {
+    char temp_name[PATH_MAX];
+    snprintf(temp_name, sizeof(temp_name), "%s%s", config::get_tmp_path().c_str(), TEMP_NAME_TEMPLATE);
+
+    *fd = mkstemp(temp_name);
+    unlink(temp_name);
+
+    S3_LOG(LOG_DEBUG, "file::open", "opening [%s] in [%s].\n", path.c_str(), temp_name);
+
+    if (*fd == -1)
+      return -errno;
+
+    return 0;
+  }
+
+  inline off_t get_memory_file_max_size()
+  {
+    return static_cast<off_t>(config::get_memory_file_max_size_in_kb()) * 1024;
+  }
 }
 
 void file::test_transfer_chunk_sizes()
@@ -123,6 +183,16 @@ int file::open(const string &path, file_open_mode mode, uint64_t *handle)
 {
   int r = -EINVAL;
 
+  if (mode & fs::OPEN_TRUNCATE_TO_ZERO) {
+    object::ptr obj = cache::get(path);
+
+    // a closed file whose upload is still pending is reopened as is, which
+    // would skip the truncation, so let the upload finish first (and outside
+    // the cache lock)
+    if (obj && obj->get_type() == S_IFREG)
+      static_cast<file *>(obj.get())->wait_for_upload();
+  }
+
   cache::lock_object(path, bind(&file::open_locked_object, _1, mode, handle, &r));
 
   return r;
@@ -131,9 +201,17 @@ int file::open(const string &path, file_open_mode mode, uint64_t *handle)
 file::file(const string &path)
   : object(path),
     _fd(-1),
+    _in_memory(false),
     _status(0),
     _async_error(0),
-    _ref_count(0)
+    _write_behind_error(0),
+    _ref_count(0),
+    _append_offset(-1),
+    _early_upload_end(0),
+    _copy_source_size(0),
+    _present_chunk_size(0),
+    _download_size(0),
+    _wanted_offset(-1)
 {
   set_type(S_IFREG);
 
@@ -158,7 +236,8 @@ bool file::is_removable()
 {
   mutex::scoped_lock lock(_fs_mutex);
 
-  return _ref_count == 0 && object::is_removable();
+  // a dirty file with no handles holds data from a failed background upload
+  return _ref_count == 0 && !(_status & (FS_UPLOADING | FS_DIRTY)) && object::is_removable();
 }
 
 void file::init(const request::ptr &req)
@@ -204,60 +283,215 @@ void file::on_download_complete(int ret)
 
   _async_error = ret;
   _status = 0;
+  std::vector<bool>().swap(_chunks_present);
+
+  if (ret == 0)
+    set_copy_source(lock, _download_size);
+
   _condition.notify_all();
 }
 
-int file::is_downloadable()
+off_t file::get_download_hint()
 {
-  return 0;
+  mutex::scoped_lock lock(_fs_mutex);
+
+  return _wanted_offset;
 }
 
-int file::open(file_open_mode mode, uint64_t *handle)
+off_t file::find_missing_chunk(const mutex::scoped_lock &, size_t size, off_t offset)
+{
+  off_t end = std::min(static_cast<off_t>(offset + size), _download_size);
+
+  if (_chunks_present.empty())
+    return offset;
+
+  for (off_t i = offset / _present_chunk_size; i * static_cast<off_t>(_present_chunk_size) < end; i++)
+    if (!_chunks_present[i])
+      return i * _present_chunk_size;
+
+  return -1;
+}
+
+void file::set_copy_source(const mutex::scoped_lock &, off_t size)
+{
+  // the local copy now matches the object in the bucket
+  _copy_source_etag = get_etag();
+  _copy_source_size = size;
+  _dirty_ranges.clear();
+}
+
+void file::add_dirty_range(const mutex::scoped_lock &, off_t start, off_t end)
+{
+  dirty_range_map::iterator itor = _dirty_ranges.upper_bound(start);
+
+  // merge with the range that starts at or before "start", if it overlaps
+  if (itor != _dirty_ranges.begin()) {
+    dirty_range_map::iterator prev = itor;
+
+    --prev;
+
+    if (prev->second >= start) {
+      start = prev->first;
+      end = std::max(end, prev->second);
+      _dirty_ranges.erase(prev);
+    }
+  }
+
+  // then swallow any ranges that start within [start, end]
+  while (itor != _dirty_ranges.end() && itor->first <= end) {
+    end = std::max(end, itor->second);
+    _dirty_ranges.erase(itor++);
+  }
+
+  _dirty_ranges[start] = end;
+}
+
+bool file::is_range_dirty(size_t size, off_t offset)
 {
   mutex::scoped_lock lock(_fs_mutex);
+  dirty_range_map::const_iterator itor = _dirty_ranges.upper_bound(offset);
 
-  if (_ref_count == 0) {
-    char temp_name[PATH_MAX];
-    snprintf(temp_name, sizeof(temp_name), "%s%s", config::get_tmp_path().c_str(), TEMP_NAME_TEMPLATE);
-    off_t size = get_stat()->st_size;
+  if (itor != _dirty_ranges.end() && itor->first < static_cast<off_t>(offset + size))
+    return true;
 
-    _fd = mkstemp(temp_name);
-    unlink(temp_name);
+  if (itor == _dirty_ranges.begin())
+    return false;
 
-    S3_LOG(LOG_DEBUG, "file::open", "opening [%s] in [%s].\n", get_path().c_str(), temp_name);
+  --itor;
 
-    if (_fd == -1)
-      return -errno;
+  return itor->second > offset;
+}
 
-    if (mode & fs::OPEN_TRUNCATE_TO_ZERO) {
-      // if the file had a non-zero size but was opened with O_TRUNC, we need
-      // to write back a zero-length file.
+void file::invalidate_early_upload(const mutex::scoped_lock &, off_t offset)
+{
+  // data at or after "offset" is about to change
 
-      if (size)
-        _status = FS_DIRTY;
+  if (offset < _append_offset)
+    _append_offset = -1;
 
-    } else {
-      if (ftruncate(_fd, size) != 0)
-        return -errno;
+  if (_early_upload && offset < _early_upload_end) {
+    ++s_early_uploads_abandoned;
 
-      if (size > 0) {
-        int r;
+    S3_LOG(
+      LOG_DEBUG, 
+      "file::invalidate_early_upload", 
+      "[%s] changed at offset %jd. abandoning early upload.\n", 
+      get_path().c_str(), 
+      static_cast<intmax_t>(offset));
+
+    _early_upload->cancel();
+    _early_upload.reset();
+    _early_upload_end = 0;
+  }
+}
 
-        r = is_downloadable();
+void file::upload_while_writing(const mutex::scoped_lock &, size_t size, off_t offset)
+{
+  if (_append_offset < 0)
+    return;
 
-        if (r)
-          return r;
+  if (offset != _append_offset) {
+    // no longer sequential, but parts that were already sent remain valid
+    _append_offset = -1;
+    return;
+  }
 
-        _status = FS_DOWNLOADING;
+  _append_offset += size;
 
-        pool::post(
-          threads::PR_0,
-          bind(&file::download, shared_from_this(), _1),
-          bind(&file::on_download_complete, shared_from_this(), _1));
-      }
+  if (!_early_upload) {
+    size_t part_size = service::get_file_transfer()->get_upload_chunk_size();
+
+    // wait until there's more than one part's worth of data, so that we know
+    // the file will be uploaded in parts
+    if (part_size == 0 || _append_offset <= static_cast<off_t>(part_size))
+      return;
+
+    _early_upload = service::get_file_transfer()->start_early_upload(
+      get_url(), 
+      bind(&file::read_part, shared_from_this(), _1, _2, _3));
+
+    if (!_early_upload) {
+      _append_offset = -1;
+      return;
     }
+
+    S3_LOG(LOG_DEBUG, "file::upload_while_writing", "starting early upload for [%s].\n", get_path().c_str());
+  }
+
+  _early_upload_end = _early_upload->send_parts(_append_offset);
+}
+
+void file::mark_chunks_present(size_t size, off_t offset)
+{
+  mutex::scoped_lock lock(_fs_mutex);
+  const off_t chunk_size = _present_chunk_size;
+  off_t end = offset + size;
+
+  if (_chunks_present.empty())
+    return;
+
+  // each chunk is written in order from its start, possibly in several
+  // pieces, so it's complete once a write reaches its end
+  for (off_t i = offset / chunk_size; i < static_cast<off_t>(_chunks_present.size()); i++) {
+    if (std::min((i + 1) * chunk_size, _download_size) > end)
+      break;
+
+    _chunks_present[i] = true;
+
+    if (_wanted_offset == i * chunk_size)
+      _wanted_offset = -1;
+  }
+
+  _condition.notify_all();
+}
+
+int file::is_downloadable()
+{
+  return 0;
+}
+
+bool file::is_cacheable()
+{
+  return true;
+}
+
+bool file::is_streamable()
+{
+  return true;
+}
+
+bool file::can_copy_unchanged_ranges()
+{
+  return true;
+}
+
+bool file::can_upload_while_writing()
+{
+  return true;
+}
+
+int file::open(file_open_mode mode, uint64_t *handle)
+{
+  mutex::scoped_lock lock(_fs_mutex);
+
+  // if the last handle was released while an upload was pending in the
+  // background, or after one failed, the local copy is still open and can be
+  // used as is
+  if (_ref_count == 0 && !(_status & (FS_UPLOADING | FS_DIRTY))) {
+    int r = open_local(lock, mode);
+
+    if (r)
+      return r;
+
   } else {
     ++s_reopens;
+
+    if (_stream && !(mode & fs::OPEN_READ_ONLY)) {
+      int r = stop_streaming(lock);
+
+      if (r)
+        return r;
+    }
   }
 
   *handle = reinterpret_cast<uint64_t>(this);
@@ -266,6 +500,136 @@ int file::open(file_open_mode mode, uint64_t *handle)
   return 0;
 }
 
+bool file::can_stream(file_open_mode mode, off_t size)
+{
+  size_t part_size = service::get_file_transfer()->get_download_chunk_size();
+
+  return
+    config::get_stream_window_parts() > 0 &&
+    (mode & fs::OPEN_READ_ONLY) &&
+    !(mode & fs::OPEN_TRUNCATE_TO_ZERO) &&
+    part_size > 0 &&
+    size > static_cast<off_t>(part_size) &&
+    size >= static_cast<off_t>(config::get_stream_min_size_in_mb()) * 1024 * 1024 &&
+    is_streamable();
+}
+
+int file::stop_streaming(const mutex::scoped_lock &lock)
+{
+  S3_LOG(LOG_DEBUG, "file::stop_streaming", "switching [%s] to a local copy.\n", get_path().c_str());
+
+  ++s_stream_fallbacks;
+  _stream.reset();
+
+  return open_local(lock, fs::OPEN_DEFAULT);
+}
+
+int file::open_local(const mutex::scoped_lock &lock, file_open_mode mode)
+{
+  off_t size = get_stat()->st_size;
+  bool use_cache = data_cache::is_enabled() && is_cacheable();
+
+  _cache_name.clear();
+  _copy_source_etag.clear();
+  _dirty_ranges.clear();
+
+  _early_upload.reset();
+  _early_upload_end = 0;
+  _append_offset = 
+    (config::get_upload_while_writing() && can_upload_while_writing() && (size == 0 || (mode & fs::OPEN_TRUNCATE_TO_ZERO)))
+      ? 0
+      : -1;
+
+  if (use_cache && size > 0 && !(mode & fs::OPEN_TRUNCATE_TO_ZERO) && 
+    data_cache::check_out(get_path(), get_etag(), _sha256_hash, size, &_fd, &_cache_name) == 0) {
+    S3_LOG(LOG_DEBUG, "file::open", "opening [%s] from cache in [%s].\n", get_path().c_str(), _cache_name.c_str());
+
+    // contents are already present and were verified when they were cached
+    set_copy_source(lock, size);
+
+    return 0;
+  }
+
+  if (can_stream(mode, size)) {
+    S3_LOG(LOG_DEBUG, "file::open", "streaming [%s].\n", get_path().c_str());
+
+    _stream.reset(new read_stream(
+      get_url(),
+      size,
+      service::get_file_transfer()->get_download_chunk_size(),
+      config::get_stream_window_parts(),
+      _sha256_hash));
+
+    return 0;
+  }
+
+  if (use_cache) {
+    int r = data_cache::create(&_fd, &_cache_name);
+
+    if (r)
+      return r;
+
+    S3_LOG(LOG_DEBUG, "file::open", "opening [%s] in [%s].\n", get_path().c_str(), _cache_name.c_str());
+
+  } else if (get_memory_file_max_size() > 0 && ((mode & fs::OPEN_TRUNCATE_TO_ZERO) || size <= get_memory_file_max_size())) {
+    mutex::scoped_lock memory_lock(_memory_mutex);
+
+    S3_LOG(LOG_DEBUG, "file::open", "opening [%s] in memory.\n", get_path().c_str());
+
+    ++s_memory_files;
+    _in_memory = true;
+    _memory.clear();
+
+  } else {
+    int r = create_temp_file(get_path(), &_fd);
+
+    if (r)
+      return r;
+  }
+
+  if (mode & fs::OPEN_TRUNCATE_TO_ZERO) {
+    // if the file had a non-zero size but was opened with O_TRUNC, we need
+    // to write back a zero-length file.
+
+    if (size)
+      _status = FS_DIRTY;
+
+  } else {
+    if (local_truncate(size) != 0)
+      return -errno;
+
+    if (size > 0) {
+      int r;
+
+      r = is_downloadable();
+
+      if (r)
+        return r;
+
+      _status = FS_DOWNLOADING;
+      _download_size = size;
+      _wanted_offset = -1;
+
+      if (config::get_read_during_download()) {
+        _present_chunk_size = service::get_file_transfer()->get_download_chunk_size();
+
+        if (_present_chunk_size == 0 || _present_chunk_size > static_cast<size_t>(size))
+          _present_chunk_size = size;
+
+        _chunks_present.assign((size + _present_chunk_size - 1) / _present_chunk_size, false);
+      }
+
+      pool::post(
+        threads::PR_0,
+        threads::RC_TRANSFER,
+        bind(&file::download, shared_from_this(), _1),
+        bind(&file::on_download_complete, shared_from_this(), _1));
+    }
+  }
+
+  return 0;
+}
+
 int file::release()
 {
   mutex::scoped_lock lock(_fs_mutex);
@@ -278,51 +642,207 @@ int file::release()
   _ref_count--;
 
   if (_ref_count == 0) {
+    // closed by finish_upload() once the background upload is done
+    if (_status & FS_UPLOADING)
+      return 0;
+
     if (_status != 0) {
       S3_LOG(LOG_ERR, "file::release", "released file [%s] with non-quiescent status [%i].\n", get_path().c_str(), _status);
       return -EBUSY;
     }
 
-    // update stat here so that subsequent calls to copy_stat() will get the
-    // correct file size
-    update_stat(lock);
+    close_local(lock);
+  }
+
+  // reports failed write-behind uploads
+  return _async_error ? _async_error : _write_behind_error;
+}
+
+void file::close_local(const mutex::scoped_lock &lock)
+{
+  // update stat here so that subsequent calls to copy_stat() will get the
+  // correct file size
+  update_stat(lock);
+
+  _stream.reset();
+
+  if (_early_upload) {
+    _early_upload->cancel();
+    _early_upload.reset();
+  }
 
+  if (_fd != -1)
     close(_fd);
-    _fd = -1;
 
-    expire();
+  _fd = -1;
+
+  {
+    mutex::scoped_lock memory_lock(_memory_mutex);
+
+    _in_memory = false;
+    std::vector<char>().swap(_memory);
   }
 
-  return 0;
+  if (!_cache_name.empty()) {
+    // only keep contents that match what's in the bucket
+    if (_async_error == 0 && !(_status & FS_DIRTY) && !get_etag().empty())
+      data_cache::check_in(_cache_name, get_path(), get_etag(), _sha256_hash, get_stat()->st_size);
+    else
+      data_cache::discard(_cache_name);
+
+    _cache_name.clear();
+  }
+
+  expire();
 }
 
 int file::flush()
+{
+  return flush(config::get_write_behind_max_files() > 0);
+}
+
+int file::sync()
+{
+  return flush(false);
+}
+
+int file::wait_for_upload()
+{
+  mutex::scoped_lock lock(_fs_mutex);
+
+  while (_status & FS_UPLOADING)
+    _condition.wait(lock);
+
+  return _async_error ? _async_error : _write_behind_error;
+}
+
+void file::discard_failed_upload()
 {
   mutex::scoped_lock lock(_fs_mutex);
 
+  while (_status & FS_UPLOADING)
+    _condition.wait(lock);
+
+  if (_ref_count == 0 && _write_behind_error) {
+    S3_LOG(LOG_WARNING, "file::discard_failed_upload", "discarding unsaved changes to [%s].\n", get_path().c_str());
+
+    close_local(lock);
+
+    _status = 0;
+    _write_behind_error = 0;
+  }
+}
+
+void file::wait_for_write_behind()
+{
+  mutex::scoped_lock lock(s_write_behind_mutex);
+
+  while (s_write_behind_pending > 0)
+    s_write_behind_condition.wait(lock);
+}
+
+int file::flush(bool write_behind)
+{
+  mutex::scoped_lock lock(_fs_mutex);
+  int r, wb_error;
+
   while (_status & (FS_DOWNLOADING | FS_UPLOADING | FS_WRITING))
     _condition.wait(lock);
 
   if (_async_error)
     return _async_error;
 
+  // a failed background upload left the file dirty, so upload it again.
+  // unless that's done here and succeeds, report the earlier failure.
+  wb_error = _write_behind_error;
+  _write_behind_error = 0;
+
   if (!(_status & FS_DIRTY)) {
     ++s_non_dirty_flushes;
 
     S3_LOG(LOG_DEBUG, "file::flush", "skipping flush for non-dirty file [%s].\n", get_path().c_str());
-    return 0;
+    return wb_error;
   }
 
   _status |= FS_UPLOADING;
 
+  if (write_behind) {
+    lock.unlock();
+
+    {
+      mutex::scoped_lock wb_lock(s_write_behind_mutex);
+
+      if (s_write_behind_pending >= config::get_write_behind_max_files()) {
+        ++s_write_behind_waits;
+
+        while (s_write_behind_pending >= config::get_write_behind_max_files())
+          s_write_behind_condition.wait(wb_lock);
+      }
+
+      s_write_behind_pending++;
+    }
+
+    ++s_write_behind_flushes;
+
+    S3_LOG(LOG_DEBUG, "file::flush", "uploading [%s] in the background.\n", get_path().c_str());
+
+    pool::post(
+      threads::PR_0,
+      threads::RC_BACKGROUND,
+      bind(&file::upload, shared_from_this(), _1),
+      bind(&file::on_write_behind_complete, shared_from_this(), _1));
+
+    return wb_error;
+  }
+
   lock.unlock();
-  _async_error = pool::call(threads::PR_0, bind(&file::upload, shared_from_this(), _1));
+  r = pool::call(threads::PR_0, threads::RC_TRANSFER, bind(&file::upload, shared_from_this(), _1));
   lock.lock();
 
+  finish_upload(lock, r);
+
+  return r;
+}
+
+void file::on_write_behind_complete(int ret)
+{
+  {
+    mutex::scoped_lock lock(_fs_mutex);
+
+    if (ret) {
+      ++s_write_behind_failures;
+      S3_LOG(LOG_ERR, "file::on_write_behind_complete", "background upload of [%s] failed with error %i. keeping local copy.\n", get_path().c_str(), ret);
+
+      // the handle that was closed can't be told, so keep the changes until
+      // the next flush can report the error and try again (see open(),
+      // flush() and is_removable())
+      _write_behind_error = ret;
+      _status &= ~FS_UPLOADING;
+      _condition.notify_all();
+
+    } else {
+      finish_upload(lock, ret);
+    }
+  }
+
+  mutex::scoped_lock wb_lock(s_write_behind_mutex);
+
+  s_write_behind_pending--;
+  s_write_behind_condition.notify_all();
+}
+
+void file::finish_upload(const mutex::scoped_lock &lock, int ret)
+{
+  _async_error = ret;
+
+  if (ret == 0)
+    set_copy_source(lock, get_local_size());
+
   _status = 0;
   _condition.notify_all();
 
-  return _async_error;
+  if (_ref_count == 0)
+    close_local(lock);
 }
 
 int file::write(const char *buffer, size_t size, off_t offset)
@@ -330,19 +850,31 @@ int file::write(const char *buffer, size_t size, off_t offset)
   mutex::scoped_lock lock(_fs_mutex);
   int r;
 
+  if (_stream && (r = stop_streaming(lock)))
+    return r;
+
   while (_status & (FS_DOWNLOADING | FS_UPLOADING))
     _condition.wait(lock);
 
   if (_async_error)
     return _async_error;
 
+  if ((r = reserve_local(lock, offset + size)))
+    return r;
+
   _status |= FS_DIRTY | FS_WRITING;
+  add_dirty_range(lock, offset, offset + size);
+  invalidate_early_upload(lock, offset);
 
   lock.unlock();
-  r = pwrite(_fd, buffer, size, offset);
+  r = local_pwrite(buffer, size, offset);
   lock.lock();
 
   _status &= ~FS_WRITING;
+
+  if (r > 0)
+    upload_while_writing(lock, r, offset);
+
   _condition.notify_all();
 
   return r;
@@ -352,15 +884,42 @@ int file::read(char *buffer, size_t size, off_t offset)
 {
   mutex::scoped_lock lock(_fs_mutex);
 
-  while (_status & FS_DOWNLOADING)
+  if (_stream) {
+    read_stream::ptr stream = _stream;
+    int r;
+
+    lock.unlock();
+    r = stream->read(buffer, size, offset);
+
+    if (r != read_stream::NOT_SEQUENTIAL)
+      return r;
+
+    lock.lock();
+
+    // another reader may have switched to a local copy already
+    if (_stream == stream && (r = stop_streaming(lock)))
+      return r;
+  }
+
+  while (_status & FS_DOWNLOADING) {
+    off_t missing = find_missing_chunk(lock, size, offset);
+
+    if (missing == -1) {
+      ++s_reads_during_download;
+      break;
+    }
+
+    // ask the download to fetch this chunk next
+    _wanted_offset = missing;
     _condition.wait(lock);
+  }
 
   if (_async_error)
     return _async_error;
 
   lock.unlock();
 
-  return pread(_fd, buffer, size, offset);
+  return local_pread(buffer, size, offset);
 }
 
 int file::truncate(off_t length)
@@ -371,16 +930,24 @@ int file::truncate(off_t length)
   if (length > TRUNCATE_LIMIT)
     return -EINVAL;
 
+  if (_stream && (r = stop_streaming(lock)))
+    return r;
+
   while (_status & (FS_DOWNLOADING | FS_UPLOADING))
     _condition.wait(lock);
 
   if (_async_error)
     return _async_error;
 
+  if ((r = reserve_local(lock, length)))
+    return r;
+
   _status |= FS_DIRTY | FS_WRITING;
+  add_dirty_range(lock, length, std::numeric_limits<off_t>::max());
+  invalidate_early_upload(lock, length);
 
   lock.unlock();
-  r = ftruncate(_fd, length);
+  r = local_truncate(length);
   lock.lock();
 
   _status &= ~FS_WRITING;
@@ -393,7 +960,7 @@ int file::write_chunk(const char *buffer, size_t size, off_t offset)
 {
   ssize_t r;
   
-  r = pwrite(_fd, buffer, size, offset);
+  r = local_pwrite(buffer, size, offset);
 
   if (r != static_cast<ssize_t>(size))
     return -errno;
@@ -401,21 +968,147 @@ int file::write_chunk(const char *buffer, size_t size, off_t offset)
   if (_hash_list)
     _hash_list->compute_hash(offset, reinterpret_cast<const uint8_t *>(buffer), size);
 
+  if (_md5_accumulator) {
+    int r = _md5_accumulator->add(buffer, size, offset);
+
+    if (r)
+      return r;
+  }
+
+  mark_chunks_present(size, offset);
+
   return 0;
 }
 
 int file::read_chunk(size_t size, off_t offset, const char_vector_ptr &buffer)
+{
+  buffer->resize(size);
+
+  return read_and_hash(&(*buffer)[0], size, offset);
+}
+
+int file::read_and_hash(char *buffer, size_t size, off_t offset)
 {
   ssize_t r;
 
-  buffer->resize(size);
-  r = pread(_fd, &(*buffer)[0], size, offset);
+  r = local_pread(buffer, size, offset);
 
   if (r != static_cast<ssize_t>(size))
     return -errno;
 
   if (_hash_list)
-    _hash_list->compute_hash(offset, reinterpret_cast<const uint8_t *>(&(*buffer)[0]), size);
+    _hash_list->compute_hash(offset, reinterpret_cast<const uint8_t *>(buffer), size);
+
+  return 0;
+}
+
+int file::read_for_md5(char *buffer, size_t size, off_t offset)
+{
+  ssize_t r = local_pread(buffer, size, offset);
+
+  if (r != static_cast<ssize_t>(size))
+    return (r == -1) ? -errno : -EIO;
+
+  return 0;
+}
+
+int file::read_part(size_t size, off_t offset, const char_vector_ptr &buffer)
+{
+  ssize_t r;
+
+  // unlike read_chunk(), doesn't hash
+  buffer->resize(size);
+  r = local_pread(&(*buffer)[0], size, offset);
+
+  if (r != static_cast<ssize_t>(size))
+    return -errno;
+
+  return 0;
+}
+
+ssize_t file::local_pread(char *buffer, size_t size, off_t offset)
+{
+  {
+    mutex::scoped_lock lock(_memory_mutex);
+
+    if (_in_memory) {
+      if (offset >= static_cast<off_t>(_memory.size()))
+        return 0;
+
+      size = std::min(size, _memory.size() - offset);
+      memcpy(buffer, &_memory[offset], size);
+
+      return size;
+    }
+  }
+
+  return pread(_fd, buffer, size, offset);
+}
+
+ssize_t file::local_pwrite(const char *buffer, size_t size, off_t offset)
+{
+  {
+    mutex::scoped_lock lock(_memory_mutex);
+
+    if (_in_memory) {
+      // reserve_local() has already made sure this fits
+      if (offset + size > _memory.size())
+        _memory.resize(offset + size);
+
+      if (size)
+        memcpy(&_memory[offset], buffer, size);
+
+      return size;
+    }
+  }
+
+  return pwrite(_fd, buffer, size, offset);
+}
+
+int file::local_truncate(off_t length)
+{
+  {
+    mutex::scoped_lock lock(_memory_mutex);
+
+    if (_in_memory) {
+      _memory.resize(length);
+      return 0;
+    }
+  }
+
+  return ftruncate(_fd, length);
+}
+
+int file::reserve_local(const mutex::scoped_lock &, off_t size)
+{
+  mutex::scoped_lock lock(_memory_mutex);
+  ssize_t written;
+  int fd, r;
+
+  if (!_in_memory || size <= get_memory_file_max_size())
+    return 0;
+
+  S3_LOG(LOG_DEBUG, "file::reserve_local", "moving [%s] out of memory.\n", get_path().c_str());
+
+  r = create_temp_file(get_path(), &fd);
+
+  if (r)
+    return r;
+
+  written = _memory.empty() ? 0 : pwrite(fd, &_memory[0], _memory.size(), 0);
+
+  if (written != static_cast<ssize_t>(_memory.size())) {
+    r = (written == -1) ? -errno : -EIO;
+    close(fd);
+
+    return r;
+  }
+
+  ++s_memory_file_promotions;
+
+  _fd = fd;
+  _in_memory = false;
+  std::vector<char>().swap(_memory);
 
   return 0;
 }
@@ -424,6 +1117,13 @@ size_t file::get_local_size()
 {
   struct stat s;
 
+  {
+    mutex::scoped_lock lock(_memory_mutex);
+
+    if (_in_memory)
+      return _memory.size();
+  }
+
   if (fstat(_fd, &s) == -1) {
     S3_LOG(LOG_WARNING, "file::get_local_size", "failed to stat [%s].\n", get_path().c_str());
 
@@ -446,7 +1146,7 @@ void file::update_stat()
 
 void file::update_stat(const mutex::scoped_lock &)
 {
-  if (_fd != -1)
+  if (_fd != -1 || _in_memory)
     get_stat()->st_size = get_local_size();
 }
 
@@ -462,7 +1162,8 @@ int file::download(const request::ptr & /* ignored */)
   r = service::get_file_transfer()->download(
     get_url(),
     get_local_size(),
-    bind(&file::write_chunk, shared_from_this(), _1, _2, _3));
+    bind(&file::write_chunk, shared_from_this(), _1, _2, _3),
+    bind(&file::get_download_hint, shared_from_this()));
 
   if (r)
     return r;
@@ -474,6 +1175,11 @@ int file::prepare_download()
 {
   if (!_sha256_hash.empty())
     _hash_list.reset(new hash_list<sha256>(get_local_size()));
+  else if (md5::is_valid_quoted_hex_hash(get_etag()))
+    _md5_accumulator.reset(new md5_accumulator(
+      get_local_size(),
+      bind(&file::read_for_md5, this, _1, _2, _3),
+      MD5_MAX_HELD_BYTES));
 
   return 0;
 }
@@ -498,7 +1204,21 @@ int file::finalize_download()
     }
   } else if (md5::is_valid_quoted_hex_hash(get_etag())) {
     // as a fallback, use the etag as an md5 hash of the file
-    string computed_hash = hash::compute<md5, hex_with_quotes>(_fd);
+    string computed_hash;
+
+    if (_md5_accumulator)
+      computed_hash = _md5_accumulator->get_hash<hex_with_quotes>();
+
+    _md5_accumulator.reset();
+
+    // empty if the download didn't pass through write_chunk()
+    if (computed_hash.empty()) {
+      mutex::scoped_lock lock(_memory_mutex);
+
+      computed_hash = _in_memory
+        ? hash::compute<md5, hex_with_quotes>(_memory)
+        : hash::compute<md5, hex_with_quotes>(_fd);
+    }
 
     if (computed_hash != get_etag()) {
       ++s_md5_mismatches;
@@ -530,17 +1250,72 @@ int file::upload(const request::ptr & /* ignored */)
 {
   int r;
   string returned_etag;
+  early_upload::ptr early;
+  file_transfer::copy_source source;
+  const file_transfer::copy_source *source_ptr = NULL;
+
+  {
+    mutex::scoped_lock lock(_fs_mutex);
+
+    early.swap(_early_upload);
+    _early_upload_end = 0;
+    _append_offset = -1;
+  }
+
+  if (early) {
+    r = complete_early_upload(early, &returned_etag);
+
+    if (r == 0) {
+      r = finalize_upload(returned_etag);
+
+      return r ? r : commit();
+    }
+
+    ++s_early_upload_fallbacks;
+
+    S3_LOG(LOG_DEBUG, "file::upload", "early upload of [%s] failed with error %i. uploading everything.\n", get_path().c_str(), r);
+  }
 
   r = prepare_upload();
 
   if (r)
     return r;
 
+  {
+    mutex::scoped_lock lock(_fs_mutex);
+
+    if (config::get_copy_unchanged_parts() && !_copy_source_etag.empty() && can_copy_unchanged_ranges()) {
+      source.etag = _copy_source_etag;
+      source.size = _copy_source_size;
+      source.is_range_dirty = bind(&file::is_range_dirty, shared_from_this(), _1, _2);
+
+      source_ptr = &source;
+    }
+  }
+
   r = service::get_file_transfer()->upload(
     get_url(),
     get_local_size(),
     bind(&file::read_chunk, shared_from_this(), _1, _2, _3),
-    &returned_etag);
+    &returned_etag,
+    source_ptr);
+
+  if (r == -ESTALE && source_ptr) {
+    ++s_stale_copy_sources;
+
+    S3_LOG(LOG_DEBUG, "file::upload", "copy source for [%s] is stale. uploading everything.\n", get_path().c_str());
+
+    r = prepare_upload();
+
+    if (r)
+      return r;
+
+    r = service::get_file_transfer()->upload(
+      get_url(),
+      get_local_size(),
+      bind(&file::read_chunk, shared_from_this(), _1, _2, _3),
+      &returned_etag);
+  }
 
   if (r)
     return r;
@@ -550,6 +1325,34 @@ int file::upload(const request::ptr & /* ignored */)
   return r ? r : commit();
 }
 
+int file::complete_early_upload(const early_upload::ptr &upload, string *returned_etag)
+{
+  size_t size = get_local_size();
+  int r;
+
+  r = prepare_upload();
+
+  if (r)
+    return r;
+
+  // parts sent while the file was being written weren't hashed, since the
+  // final size wasn't known yet, so hash the local copy now. the block
+  // doesn't wait for the budget and is given back before complete(), whose
+  // remaining parts do wait for it.
+  {
+    char_vector_ptr block(buffer_pool::acquire(std::min(HASH_BLOCK_SIZE, size), false));
+
+    for (size_t offset = 0; offset < size; offset += HASH_BLOCK_SIZE) {
+      r = read_chunk(std::min(HASH_BLOCK_SIZE, size - offset), offset, block);
+
+      if (r)
+        return r;
+    }
+  }
+
+  return upload->complete(size, returned_etag);
+}
+
 int file::prepare_upload()
 {
   _hash_list.reset(new hash_list<sha256>(get_local_size()));
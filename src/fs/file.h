@@ -22,22 +22,33 @@
 #ifndef S3_FS_FILE_H
 #define S3_FS_FILE_H
 
+#include <map>
+
 #include "base/request.h"
 #include "crypto/hash_list.h"
+#include "crypto/md5_accumulator.h"
 #include "crypto/sha256.h"
 #include "fs/object.h"
 #include "threads/async_handle.h"
 
 namespace s3
 {
+  namespace services
+  {
+    class early_upload;
+  }
+
   namespace fs
   {
     enum file_open_mode
     {
       OPEN_DEFAULT          = 0x0,
-      OPEN_TRUNCATE_TO_ZERO = 0x1
+      OPEN_TRUNCATE_TO_ZERO = 0x1,
+      OPEN_READ_ONLY        = 0x2
     };
 
+    class read_stream;
+
     class file : public object
     {
     public:
@@ -49,6 +60,7 @@ namespace s3
       }
 
       static void test_transfer_chunk_sizes();
+      static void wait_for_write_behind();
       static int open(const std::string &path, file_open_mode mode, uint64_t *handle);
 
       file(const std::string &path);
@@ -63,6 +75,12 @@ namespace s3
 
       int release();
       int flush();
+      int sync();
+      int wait_for_upload();
+
+      // for a file that's about to be removed or overwritten: waits for any
+      // background upload, and drops the local copy kept after a failed one
+      void discard_failed_upload();
       int write(const char *buffer, size_t size, off_t offset);
       int read(char *buffer, size_t size, off_t offset);
       int truncate(off_t length);
@@ -71,10 +89,18 @@ namespace s3
       virtual void init(const boost::shared_ptr<base::request> &req);
 
       virtual int is_downloadable();
+      virtual bool is_cacheable();
+      virtual bool is_streamable();
+      virtual bool can_copy_unchanged_ranges();
+      virtual bool can_upload_while_writing();
 
       virtual int write_chunk(const char *buffer, size_t size, off_t offset);
       virtual int read_chunk(size_t size, off_t offset, const base::char_vector_ptr &buffer);
 
+      // reads from the local copy and hashes what was read, as read_chunk()
+      // does, but into a caller-supplied buffer
+      int read_and_hash(char *buffer, size_t size, off_t offset);
+
       virtual int prepare_download();
       virtual int finalize_download();
 
@@ -114,6 +140,15 @@ namespace s3
       static void open_locked_object(const object::ptr &obj, file_open_mode mode, uint64_t *handle, int *status);
 
       int open(file_open_mode mode, uint64_t *handle);
+      int open_local(const boost::mutex::scoped_lock &, file_open_mode mode);
+      void close_local(const boost::mutex::scoped_lock &lock);
+
+      int flush(bool write_behind);
+      void on_write_behind_complete(int ret);
+      void finish_upload(const boost::mutex::scoped_lock &lock, int ret);
+
+      bool can_stream(file_open_mode mode, off_t size);
+      int stop_streaming(const boost::mutex::scoped_lock &lock);
 
       int download(const boost::shared_ptr<base::request> &);
 
@@ -134,20 +169,74 @@ namespace s3
         std::string *etag);
       int upload_part(const boost::shared_ptr<base::request> &req, const std::string &upload_id, transfer_part *part);
 
+      ssize_t local_pread(char *buffer, size_t size, off_t offset);
+      ssize_t local_pwrite(const char *buffer, size_t size, off_t offset);
+      int local_truncate(off_t length);
+      int reserve_local(const boost::mutex::scoped_lock &, off_t size);
+
       size_t get_local_size();
 
       void on_download_complete(int ret);
 
+      off_t get_download_hint();
+      off_t find_missing_chunk(const boost::mutex::scoped_lock &, size_t size, off_t offset);
+      void mark_chunks_present(size_t size, off_t offset);
+
+      void set_copy_source(const boost::mutex::scoped_lock &, off_t size);
+      void add_dirty_range(const boost::mutex::scoped_lock &, off_t start, off_t end);
+      bool is_range_dirty(size_t size, off_t offset);
+
+      void invalidate_early_upload(const boost::mutex::scoped_lock &, off_t offset);
+      void upload_while_writing(const boost::mutex::scoped_lock &, size_t size, off_t offset);
+      int complete_early_upload(const boost::shared_ptr<services::early_upload> &upload, std::string *returned_etag);
+      int read_part(size_t size, off_t offset, const base::char_vector_ptr &buffer);
+      int read_for_md5(char *buffer, size_t size, off_t offset);
+
       void update_stat(const boost::mutex::scoped_lock &);
 
       boost::mutex _fs_mutex;
       boost::condition _condition;
       crypto::hash_list<crypto::sha256>::ptr _hash_list;
+      crypto::md5_accumulator::ptr _md5_accumulator; // only if there's no sha256 hash
       std::string _sha256_hash;
 
+      // small files are kept in _memory instead of _fd. _in_memory changes
+      // only while both _fs_mutex and _memory_mutex are held.
+      boost::mutex _memory_mutex;
+      std::vector<char> _memory;
+
       // protected by _fs_mutex
-      int _fd, _status, _async_error;
+      int _fd;
+      bool _in_memory;
+      int _status, _async_error;
+
+      // set when a background upload fails, in which case FS_DIRTY stays set
+      // and the local copy is kept (even with no handles open) until the
+      // next flush reports the error and tries again
+      int _write_behind_error;
       uint64_t _ref_count;
+      std::string _cache_name; // set if the local file is managed by data_cache
+      boost::shared_ptr<read_stream> _stream; // set instead of _fd while streaming
+
+      // while the file is being written sequentially from offset zero,
+      // _append_offset is the end of the data written so far (otherwise -1).
+      // parts below _early_upload_end have already been handed to
+      // _early_upload.
+      boost::shared_ptr<services::early_upload> _early_upload;
+      off_t _append_offset, _early_upload_end;
+
+      // ranges written since the local copy last matched the object with etag
+      // _copy_source_etag (start -> end, non-overlapping)
+      typedef std::map<off_t, off_t> dirty_range_map;
+
+      dirty_range_map _dirty_ranges;
+      std::string _copy_source_etag;
+      off_t _copy_source_size;
+
+      // only valid while FS_DOWNLOADING is set
+      std::vector<bool> _chunks_present;
+      size_t _present_chunk_size;
+      off_t _download_size, _wanted_offset;
     };
   }
 }
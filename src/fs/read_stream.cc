@@ -0,0 +1,287 @@
+/*
+ * fs/read_stream.cc
+ * -------------------------------------------------------------------------
+ * Sequential read-ahead implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <boost/detail/atomic_count.hpp>
+
+#include "base/config.h"
+#include "base/logger.h"
+#include "base/request.h"
+#include "base/statistics.h"
+#include "crypto/hex.h"
+#include "fs/read_stream.h"
+#include "services/file_transfer.h"
+#include "services/service.h"
+#include "threads/transfer_scheduler.h"
+
+using boost::mutex;
+using boost::detail::atomic_count;
+using std::ostream;
+using std::string;
+using std::vector;
+
+using s3::base::config;
+using s3::base::request;
+using s3::base::statistics;
+using s3::crypto::hash_list;
+using s3::crypto::hex;
+using s3::crypto::sha256;
+using s3::fs::read_stream;
+using s3::services::service;
+using s3::threads::transfer_scheduler;
+
+namespace
+{
+  atomic_count s_streams(0), s_parts(0), s_parts_retried(0), s_sha256_mismatches(0);
+
+  void statistics_writer(ostream *o)
+  {
+    *o <<
+      "read streams:\n"
+      "  streams: " << s_streams << "\n"
+      "  parts: " << s_parts << "\n"
+      "  parts retried: " << s_parts_retried << "\n"
+      "  sha256 mismatches: " << s_sha256_mismatches << "\n";
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
+}
+
+read_stream::read_stream(
+  const string &url,
+  off_t size,
+  size_t part_size,
+  size_t window_parts,
+  const string &expected_sha256_hash)
+  : _session(transfer_scheduler::create_session(transfer_scheduler::TD_DOWNLOAD, size, threads::RC_TRANSFER)),
+    _url(url),
+    _expected_sha256_hash(expected_sha256_hash),
+    _size(size),
+    _part_size(part_size),
+    _window_parts(window_parts),
+    _parts_hashed(0),
+    _next_offset(0),
+    _error(0),
+    _verified(false)
+{
+  if (!_expected_sha256_hash.empty())
+    _hash_list.reset(new hash_list<sha256>(size));
+
+  ++s_streams;
+}
+
+read_stream::~read_stream()
+{
+  // parts in flight hold a pointer to us
+  for (size_t i = 0; i < _window.size(); i++)
+    _window[i]->handle->wait();
+}
+
+int read_stream::read(char *buffer, size_t size, off_t offset)
+{
+  mutex::scoped_lock lock(_mutex);
+  vector<part_ptr> needed, consumed;
+  off_t end;
+  int r;
+
+  if (_error)
+    return _error;
+
+  if (offset >= _size)
+    return 0;
+
+  if (static_cast<off_t>(offset + size) > _size)
+    size = _size - offset;
+
+  end = offset + size;
+
+  // keep one full part behind the reader so that slightly out-of-order reads
+  // don't force a fallback
+  while (!_window.empty() && _window.front()->offset + static_cast<off_t>(_window.front()->size + _part_size) <= offset) {
+    consumed.push_back(_window.front());
+    _window.pop_front();
+  }
+
+  if (offset > _next_offset || (!_window.empty() && offset < _window.front()->offset))
+    return NOT_SEQUENTIAL;
+
+  while (_next_offset < _size && _next_offset < static_cast<off_t>(end + _window_parts * _part_size)) {
+    part_ptr p(new part());
+
+    p->offset = _next_offset;
+    p->size = std::min(static_cast<off_t>(_part_size), _size - _next_offset);
+
+    _next_offset += p->size;
+    _window.push_back(p);
+
+    post(p);
+  }
+
+  for (size_t i = 0; i < _window.size(); i++) {
+    const part_ptr &p = _window[i];
+
+    if (p->offset < end && p->offset + static_cast<off_t>(p->size) > offset)
+      needed.push_back(p);
+  }
+
+  lock.unlock();
+
+  // parts we skipped past still have to finish before they can be freed
+  for (size_t i = 0; i < consumed.size(); i++)
+    consumed[i]->handle->wait();
+
+  for (size_t i = 0; i < needed.size(); i++) {
+    const part_ptr &p = needed[i];
+    off_t from = std::max(offset, p->offset);
+    off_t to = std::min(end, static_cast<off_t>(p->offset + p->size));
+
+    r = wait(p);
+
+    if (r)
+      return r;
+
+    memcpy(buffer + (from - offset), &p->buffer[from - p->offset], to - from);
+  }
+
+  if (end == _size) {
+    r = verify();
+
+    if (r)
+      return r;
+  }
+
+  return size;
+}
+
+void read_stream::post(const part_ptr &p)
+{
+  p->handle = _session->post(
+    bind(&read_stream::fetch, this, _1, p),
+    p->size,
+    0 /* don't retry on timeout since we handle that here */);
+}
+
+int read_stream::wait(const part_ptr &p)
+{
+  while (true) {
+    threads::wait_async_handle::ptr handle;
+    int r;
+
+    {
+      mutex::scoped_lock lock(_mutex);
+
+      handle = p->handle;
+    }
+
+    r = handle->wait();
+
+    if (r == 0)
+      return 0;
+
+    mutex::scoped_lock lock(_mutex);
+
+    // another reader may already have retried this part
+    if (p->handle != handle)
+      continue;
+
+    if ((r == -EAGAIN || r == -ETIMEDOUT) && p->retry_count < config::get_max_transfer_retries()) {
+      S3_LOG(LOG_DEBUG, "read_stream::wait", "retrying part at offset %jd of [%s].\n", static_cast<intmax_t>(p->offset), _url.c_str());
+
+      ++s_parts_retried;
+      p->retry_count++;
+      post(p);
+
+      continue;
+    }
+
+    if (_error == 0)
+      _error = r;
+
+    return r;
+  }
+}
+
+int read_stream::fetch(const request::ptr &req, const part_ptr &p)
+{
+  ++s_parts;
+
+  return service::get_file_transfer()->download_byte_range(
+    req,
+    _url,
+    p->size,
+    p->offset,
+    bind(&read_stream::store, this, p, _1, _2, _3));
+}
+
+int read_stream::store(const part_ptr &p, const char *buffer, size_t size, off_t offset)
+{
+  // parts arrive in pieces, in order
+  if (p->buffer.size() != p->size)
+    p->buffer.resize(p->size);
+
+  memcpy(&p->buffer[offset - p->offset], buffer, size);
+
+  if (_hash_list) {
+    _hash_list->compute_hash(offset, reinterpret_cast<const uint8_t *>(buffer), size);
+
+    if (offset + size == p->offset + p->size)
+      ++_parts_hashed;
+  }
+
+  return 0;
+}
+
+int read_stream::verify()
+{
+  mutex::scoped_lock lock(_mutex);
+  string computed_hash;
+
+  if (_verified || !_hash_list)
+    return _error;
+
+  _verified = true;
+
+  // if the reader skipped over a part that then failed, the hash list is
+  // incomplete and there's nothing to verify
+  if (_parts_hashed != static_cast<long>((_size + _part_size - 1) / _part_size)) {
+    S3_LOG(LOG_DEBUG, "read_stream::verify", "skipping hash check for %s.\n", _url.c_str());
+    return _error;
+  }
+
+  computed_hash = _hash_list->get_root_hash<hex>();
+
+  if (computed_hash != _expected_sha256_hash) {
+    ++s_sha256_mismatches;
+
+    S3_LOG(
+      LOG_WARNING,
+      "read_stream::verify",
+      "sha256 mismatch for %s. expected %s, got %s.\n",
+      _url.c_str(),
+      _expected_sha256_hash.c_str(),
+      computed_hash.c_str());
+
+    _error = -EIO;
+  }
+
+  return _error;
+}
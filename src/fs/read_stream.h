@@ -0,0 +1,110 @@
+/*
+ * fs/read_stream.h
+ * -------------------------------------------------------------------------
+ * Sequential read-ahead over ranged GETs, without a local copy.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_FS_READ_STREAM_H
+#define S3_FS_READ_STREAM_H
+
+#include <errno.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+#include "crypto/hash_list.h"
+#include "crypto/sha256.h"
+#include "threads/async_handle.h"
+#include "threads/transfer_scheduler.h"
+
+namespace s3
+{
+  namespace base
+  {
+    class request;
+  }
+
+  namespace fs
+  {
+    // keeps a bounded window of ranged GETs in flight ahead of a reader that
+    // starts at offset zero and moves forward. memory use is bounded by the
+    // window size; nothing is written to local disk.
+    class read_stream
+    {
+    public:
+      typedef boost::shared_ptr<read_stream> ptr;
+
+      // returned by read() if the requested range can't be served from the
+      // window, in which case the caller should fall back to a local copy
+      enum { NOT_SEQUENTIAL = -ESPIPE };
+
+      read_stream(
+        const std::string &url,
+        off_t size,
+        size_t part_size,
+        size_t window_parts,
+        const std::string &expected_sha256_hash);
+
+      ~read_stream();
+
+      int read(char *buffer, size_t size, off_t offset);
+
+    private:
+      struct part
+      {
+        off_t offset;
+        size_t size;
+        int retry_count;
+        std::vector<char> buffer;
+        threads::wait_async_handle::ptr handle;
+
+        inline part() : offset(0), size(0), retry_count(0) { }
+      };
+
+      typedef boost::shared_ptr<part> part_ptr;
+
+      void post(const part_ptr &p);
+      int wait(const part_ptr &p);
+
+      int fetch(const boost::shared_ptr<base::request> &req, const part_ptr &p);
+      int store(const part_ptr &p, const char *buffer, size_t size, off_t offset);
+
+      int verify();
+
+      boost::mutex _mutex;
+      threads::transfer_scheduler::session::ptr _session;
+      std::string _url, _expected_sha256_hash;
+      off_t _size;
+      size_t _part_size, _window_parts;
+      crypto::hash_list<crypto::sha256>::ptr _hash_list;
+      boost::detail::atomic_count _parts_hashed;
+
+      // protected by _mutex
+      std::deque<part_ptr> _window;
+      off_t _next_offset;
+      int _error;
+      bool _verified;
+    };
+  }
+}
+
+#endif
@@ -28,13 +28,16 @@
 #include "base/xml.h"
 #include "crypto/buffer.h"
 #include "fs/cache.h"
+#include "fs/data_cache.h"
 #include "fs/encryption.h"
 #include "fs/file.h"
 #include "fs/list_reader.h"
 #include "fs/mime_types.h"
 #include "fs/object.h"
 #include "services/service.h"
+#include "threads/io_engine.h"
 #include "threads/pool.h"
+#include "threads/transfer_scheduler.h"
 
 #ifdef WITH_AWS
 #include "services/aws/impl.h"
@@ -59,6 +62,7 @@ using s3::base::statistics;
 using s3::base::xml;
 using s3::crypto::buffer;
 using s3::fs::cache;
+using s3::fs::data_cache;
 using s3::fs::encryption;
 using s3::fs::file;
 using s3::fs::list_reader;
@@ -66,7 +70,9 @@ using s3::fs::mime_types;
 using s3::fs::object;
 using s3::services::impl;
 using s3::services::service;
+using s3::threads::io_engine;
 using s3::threads::pool;
+using s3::threads::transfer_scheduler;
 
 namespace
 {
@@ -136,6 +142,7 @@ void init::fs()
   file::test_transfer_chunk_sizes();
 
   cache::init();
+  data_cache::init();
   encryption::init();
   mime_types::init();
 
@@ -176,6 +183,10 @@ void init::services()
 void init::threads()
 {
   pool::init();
+  transfer_scheduler::init();
+
+  if (config::get_download_parts_in_flight() > 0)
+    io_engine::init();
 }
 
 string init::get_enabled_services()
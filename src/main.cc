@@ -27,7 +27,10 @@
 #include "base/config.h"
 #include "base/logger.h"
 #include "base/statistics.h"
+#include "fs/file.h"
+#include "threads/io_engine.h"
 #include "threads/pool.h"
+#include "threads/transfer_scheduler.h"
 
 using std::cerr;
 using std::cout;
@@ -38,7 +41,10 @@ using s3::init;
 using s3::operations;
 using s3::base::config;
 using s3::base::statistics;
+using s3::fs::file;
+using s3::threads::io_engine;
 using s3::threads::pool;
+using s3::threads::transfer_scheduler;
 
 namespace
 {
@@ -258,6 +264,12 @@ int main(int argc, char **argv)
   fuse_opt_free_args(&args);
 
   try {
+    // uploads queued by write-behind flushes still need the thread pools
+    file::wait_for_write_behind();
+
+    // stop handing out transfer parts before the pool goes away
+    transfer_scheduler::terminate();
+    io_engine::terminate();
     pool::terminate();
 
     // these won't do anything if statistics::init() wasn't called
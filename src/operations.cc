@@ -79,6 +79,24 @@ namespace
       cache::remove(path);
   }
 
+  // a file closed in write-behind mode may still have its upload pending in
+  // the background. returns the upload's error, if any.
+  inline int wait_for_upload(const object::ptr &obj)
+  {
+    if (obj->get_type() != S_IFREG)
+      return 0;
+
+    return static_pointer_cast<file>(obj)->wait_for_upload();
+  }
+
+  // as above, for a file that's about to go away, so that changes kept after
+  // a failed upload don't keep it from being removed
+  inline void discard_upload(const object::ptr &obj)
+  {
+    if (obj->get_type() == S_IFREG)
+      static_pointer_cast<file>(obj)->discard_failed_upload();
+  }
+
   int touch(const string &path)
   {
     object::ptr obj;
@@ -226,6 +244,7 @@ void operations::build_fuse_operations(fuse_operations *ops)
   ops->getattr = operations::getattr;
   ops->getxattr = operations::getxattr;
   ops->flush = operations::flush;
+  ops->fsync = operations::fsync;
   ops->ftruncate = operations::ftruncate;
   ops->listxattr = operations::listxattr;
   ops->mkdir = operations::mkdir;
@@ -355,6 +374,17 @@ int operations::flush(const char *path, fuse_file_info *file_info)
   END_TRY;
 }
 
+int operations::fsync(const char *path, int datasync, fuse_file_info *file_info)
+{
+  file *f = file::from_handle(file_info->fh);
+
+  S3_LOG(LOG_DEBUG, "fsync", "path: %s\n", f->get_path().c_str());
+
+  BEGIN_TRY;
+    return f->sync();
+  END_TRY;
+}
+
 int operations::ftruncate(const char *path, off_t offset, fuse_file_info *file_info)
 {
   file *f = file::from_handle(file_info->fh);
@@ -522,9 +552,17 @@ int operations::open(const char *path, fuse_file_info *file_info)
   ASSERT_VALID_PATH(path);
 
   BEGIN_TRY;
+    int mode = s3::fs::OPEN_DEFAULT;
+
+    if (file_info->flags & O_TRUNC)
+      mode |= s3::fs::OPEN_TRUNCATE_TO_ZERO;
+
+    if ((file_info->flags & O_ACCMODE) == O_RDONLY)
+      mode |= s3::fs::OPEN_READ_ONLY;
+
     RETURN_ON_ERROR(file::open(
       static_cast<string>(path), 
-      (file_info->flags & O_TRUNC) ? s3::fs::OPEN_TRUNCATE_TO_ZERO : s3::fs::OPEN_DEFAULT, 
+      static_cast<s3::fs::file_open_mode>(mode), 
       &file_info->fh));
 
     // successful open with O_TRUNC updates ctime and mtime
@@ -641,9 +679,14 @@ int operations::rename(const char *from, const char *to)
         return -ENOTDIR;
       }
 
+      // the upload is about to be overwritten anyway, so its result doesn't
+      // matter
+      discard_upload(to_obj);
+
       RETURN_ON_ERROR(to_obj->remove());
     }
 
+    RETURN_ON_ERROR(wait_for_upload(from_obj));
     RETURN_ON_ERROR(from_obj->rename(to));
 
     for (int i = 0; i < config::get_max_inconsistent_state_retries(); i++) {
@@ -795,6 +838,9 @@ int operations::unlink(const char *path)
 
     invalidate(parent);
 
+    // don't care whether the upload succeeded, since we're removing the file
+    discard_upload(obj);
+
     RETURN_ON_ERROR(obj->remove());
 
     return touch(parent);
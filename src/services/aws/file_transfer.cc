@@ -19,6 +19,7 @@
  * limitations under the License.
  */
 
+#include <deque>
 #include <vector>
 #include <boost/lexical_cast.hpp>
 #include <boost/detail/atomic_count.hpp>
@@ -27,52 +28,317 @@
 #include "base/logger.h"
 #include "base/statistics.h"
 #include "base/xml.h"
-#include "crypto/hash.h"
-#include "crypto/hex_with_quotes.h"
-#include "crypto/md5.h"
+#include "services/service.h"
 #include "services/aws/file_transfer.h"
 #include "threads/parallel_work_queue.h"
 #include "threads/pool.h"
+#include "threads/transfer_scheduler.h"
 
 using boost::lexical_cast;
+using boost::mutex;
 using boost::scoped_ptr;
 using boost::detail::atomic_count;
+using std::deque;
 using std::ostream;
 using std::string;
 using std::vector;
 
-using s3::base::char_vector;
-using s3::base::char_vector_ptr;
 using s3::base::config;
 using s3::base::request;
 using s3::base::statistics;
 using s3::base::xml;
-using s3::crypto::hash;
-using s3::crypto::hex_with_quotes;
-using s3::crypto::md5;
+using s3::services::early_upload;
+using s3::services::service;
+using s3::services::upload_source;
 using s3::services::aws::file_transfer;
 using s3::threads::parallel_work_queue;
 using s3::threads::pool;
+using s3::threads::transfer_scheduler;
 
 namespace
 {
   const size_t UPLOAD_CHUNK_SIZE = 5 * 1024 * 1024;
 
+  const char *COPY_PART_ETAG_XPATH = "/CopyPartResult/ETag";
   const char *MULTIPART_ETAG_XPATH = "/CompleteMultipartUploadResult/ETag";
   const char *MULTIPART_UPLOAD_ID_XPATH = "/InitiateMultipartUploadResult/UploadId";
 
-  atomic_count s_uploads_multi_chunks_failed(0);
+  atomic_count s_uploads_multi_chunks_failed(0), s_uploads_multi_chunks_copied(0), s_uploads_multi_stale_sources(0);
+  atomic_count s_early_uploads(0), s_early_upload_chunks(0), s_early_upload_chunks_resent(0);
 
   void statistics_writer(ostream *o)
   {
     *o <<
       "aws multi-part uploads:\n"
-      "  chunks failed: " << s_uploads_multi_chunks_failed << "\n";
+      "  chunks failed: " << s_uploads_multi_chunks_failed << "\n"
+      "  chunks copied: " << s_uploads_multi_chunks_copied << "\n"
+      "  stale copy sources: " << s_uploads_multi_stale_sources << "\n"
+      "aws early uploads:\n"
+      "  started: " << s_early_uploads << "\n"
+      "  chunks sent while writing: " << s_early_upload_chunks << "\n"
+      "  chunks re-sent: " << s_early_upload_chunks_resent << "\n";
   }
 
   statistics::writers::entry s_writer(statistics_writer, 0);
+
+  template <class iterator_type>
+  string build_complete_upload(iterator_type begin, iterator_type end)
+  {
+    string complete_upload = "<CompleteMultipartUpload>";
+
+    for (iterator_type itor = begin; itor != end; ++itor) {
+      // part numbers are 1-based
+      complete_upload += "<Part><PartNumber>" + lexical_cast<string>(itor->id + 1) + "</PartNumber><ETag>" + itor->etag + "</ETag></Part>";
+    }
+
+    complete_upload += "</CompleteMultipartUpload>";
+
+    return complete_upload;
+  }
+
+  inline bool is_retryable(int r)
+  {
+    return r == -EAGAIN || r == -ETIMEDOUT;
+  }
 }
 
+class file_transfer::early_multipart_upload 
+  : public early_upload,
+    public boost::enable_shared_from_this<file_transfer::early_multipart_upload>
+{
+public:
+  inline early_multipart_upload(file_transfer *ft, const string &url, const read_chunk_fn &on_read)
+    : _ft(ft),
+      _url(url),
+      _on_read(on_read),
+      _session(transfer_scheduler::create_session(transfer_scheduler::TD_UPLOAD, 0, threads::RC_TRANSFER)),
+      _init_done(false),
+      _initialized(false),
+      _cancelled(false),
+      _finished(false),
+      _error(0),
+      _in_progress(0),
+      _next_offset(0)
+  {
+  }
+
+  virtual ~early_multipart_upload()
+  {
+    // nothing is in flight by now, since parts hold a reference to us
+    if (_initialized && !_finished)
+      pool::post(
+        threads::PR_REQ_0, 
+        threads::RC_BACKGROUND,
+        bind(&file_transfer::upload_multi_cancel, _ft, _1, _url, _upload_id));
+  }
+
+  void start()
+  {
+    ++s_early_uploads;
+
+    pool::post(
+      threads::PR_REQ_0,
+      threads::RC_TRANSFER,
+      bind(&file_transfer::upload_multi_init, _ft, _1, _url, &_upload_id),
+      bind(&early_multipart_upload::on_init_done, shared_from_this(), _1));
+  }
+
+  virtual off_t send_parts(size_t size)
+  {
+    mutex::scoped_lock lock(_mutex);
+
+    while (_next_offset + _ft->_upload_chunk_size <= size) {
+      _queue.push_back(add_part(lock, _ft->_upload_chunk_size));
+      _next_offset += _ft->_upload_chunk_size;
+    }
+
+    post_parts(lock);
+
+    return _next_offset;
+  }
+
+  virtual int complete(size_t size, string *returned_etag)
+  {
+    mutex::scoped_lock lock(_mutex);
+    vector<upload_range> remaining, all;
+    string complete_upload;
+    int r;
+
+    while (!_init_done || _in_progress > 0)
+      _condition.wait(lock);
+
+    if (_error)
+      return _error;
+
+    if (size < static_cast<size_t>(_next_offset))
+      return -EINVAL;
+
+    // parts that were still queued, or that failed but can be retried
+    for (size_t i = 0; i < _parts.size(); i++) {
+      if (_parts[i].result) {
+        if (_parts[i].result != PART_QUEUED)
+          ++s_early_upload_chunks_resent;
+
+        remaining.push_back(_parts[i].range);
+      }
+    }
+
+    _queue.clear();
+
+    while (static_cast<size_t>(_next_offset) < size) {
+      size_t part_size = std::min(_ft->_upload_chunk_size, size - _next_offset);
+
+      remaining.push_back(_parts[add_part(lock, part_size)].range);
+      _next_offset += part_size;
+    }
+
+    if (_parts.empty())
+      return -EINVAL;
+
+    // nothing else touches the parts now, so we don't need the lock
+    lock.unlock();
+
+    if (!remaining.empty()) {
+      parallel_work_queue<upload_range> upload(
+        remaining.begin(),
+        remaining.end(),
+        bind(&file_transfer::upload_part, _ft, _1, _url, _upload_id, _on_read, string(), _2, false),
+        bind(&file_transfer::upload_part, _ft, _1, _url, _upload_id, _on_read, string(), _2, true));
+
+      upload.enable_hedging();
+      upload.set_transfer(transfer_scheduler::TD_UPLOAD, &file_transfer::get_upload_size);
+      r = upload.process();
+
+      if (r)
+        return r;
+
+      for (size_t i = 0; i < remaining.size(); i++)
+        _parts[remaining[i].id].range.etag = remaining[i].etag;
+    }
+
+    for (size_t i = 0; i < _parts.size(); i++)
+      all.push_back(_parts[i].range);
+
+    complete_upload = build_complete_upload(all.begin(), all.end());
+
+    r = pool::call(
+      threads::PR_REQ_0, 
+      bind(&file_transfer::upload_multi_complete, _ft, _1, _url, _upload_id, complete_upload, returned_etag));
+
+    lock.lock();
+
+    if (r == 0)
+      _finished = true;
+
+    return r;
+  }
+
+  virtual void cancel()
+  {
+    mutex::scoped_lock lock(_mutex);
+
+    _cancelled = true;
+    _queue.clear();
+  }
+
+private:
+  enum { PART_QUEUED = 1 };
+
+  struct early_part
+  {
+    upload_range range;
+    int result; // PART_QUEUED until the part has been sent
+
+    inline early_part() : result(PART_QUEUED) { }
+  };
+
+  size_t add_part(const mutex::scoped_lock &, size_t size)
+  {
+    early_part p;
+
+    p.range.id = _parts.size();
+    p.range.offset = _next_offset;
+    p.range.size = size;
+    p.range.copy = false;
+
+    _parts.push_back(p);
+
+    return p.range.id;
+  }
+
+  void post_parts(const mutex::scoped_lock &)
+  {
+    while (
+      _initialized && 
+      !_cancelled && 
+      _error == 0 && 
+      !_queue.empty() && 
+      _in_progress < static_cast<size_t>(config::get_max_parts_in_progress())) {
+      early_part *p = &_parts[_queue.front()];
+
+      _queue.pop_front();
+      _in_progress++;
+
+      // deque elements don't move when others are added, so it's safe to
+      // hand out pointers to them
+      _session->post(
+        bind(&file_transfer::upload_part, _ft, _1, _url, _upload_id, _on_read, string(), &p->range, false),
+        p->range.size,
+        bind(&early_multipart_upload::on_part_done, shared_from_this(), p, _1),
+        0 /* retried in complete() */);
+    }
+  }
+
+  void on_init_done(int r)
+  {
+    mutex::scoped_lock lock(_mutex);
+
+    _init_done = true;
+
+    if (r) {
+      S3_LOG(LOG_DEBUG, "file_transfer::early_multipart_upload", "failed to start upload for [%s].\n", _url.c_str());
+      _error = r;
+    } else {
+      _initialized = true;
+      post_parts(lock);
+    }
+
+    _condition.notify_all();
+  }
+
+  void on_part_done(early_part *p, int r)
+  {
+    mutex::scoped_lock lock(_mutex);
+
+    p->result = r;
+    _in_progress--;
+
+    if (r == 0)
+      ++s_early_upload_chunks;
+    else if (!is_retryable(r) && _error == 0)
+      _error = r;
+
+    post_parts(lock);
+    _condition.notify_all();
+  }
+
+  file_transfer *_ft;
+  string _url, _upload_id;
+  read_chunk_fn _on_read;
+  transfer_scheduler::session::ptr _session;
+
+  mutex _mutex;
+  boost::condition _condition;
+
+  // protected by _mutex
+  bool _init_done, _initialized, _cancelled, _finished;
+  int _error;
+  size_t _in_progress;
+  off_t _next_offset;
+  deque<early_part> _parts;
+  deque<size_t> _queue; // parts not yet posted
+};
+
 file_transfer::file_transfer()
 {
   _upload_chunk_size = 
@@ -86,7 +352,16 @@ size_t file_transfer::get_upload_chunk_size()
   return _upload_chunk_size;
 }
 
-int file_transfer::upload_multi(const string &url, size_t size, const read_chunk_fn &on_read, string *returned_etag)
+early_upload::ptr file_transfer::start_early_upload(const string &url, const read_chunk_fn &on_read)
+{
+  boost::shared_ptr<early_multipart_upload> upload(new early_multipart_upload(this, url, on_read));
+
+  upload->start();
+
+  return upload;
+}
+
+int file_transfer::upload_multi(const string &url, size_t size, const read_chunk_fn &on_read, const copy_source *source, string *returned_etag)
 {
   typedef parallel_work_queue<upload_range> multipart_upload;
 
@@ -107,14 +382,25 @@ int file_transfer::upload_multi(const string &url, size_t size, const read_chunk
     part->id = i;
     part->offset = i * _upload_chunk_size;
     part->size = (i != num_parts - 1) ? _upload_chunk_size : (size - _upload_chunk_size * i);
+
+    // parts that lie entirely within the existing object and haven't been
+    // modified can be copied server-side
+    part->copy = 
+      source && 
+      part->offset + part->size <= source->size && 
+      !source->is_range_dirty(part->size, part->offset);
   }
 
   upload.reset(new multipart_upload(
     parts.begin(),
     parts.end(),
-    bind(&file_transfer::upload_part, this, _1, url, upload_id, on_read, _2, false),
-    bind(&file_transfer::upload_part, this, _1, url, upload_id, on_read, _2, true)));
+    bind(&file_transfer::upload_part, this, _1, url, upload_id, on_read, source ? source->etag : string(), _2, false),
+    bind(&file_transfer::upload_part, this, _1, url, upload_id, on_read, source ? source->etag : string(), _2, true)));
 
+  // a part uploaded twice just replaces itself with the same data (both
+  // copies read, and so hash, the same range; hash_list allows that)
+  upload->enable_hedging();
+  upload->set_transfer(transfer_scheduler::TD_UPLOAD, &file_transfer::get_upload_size);
   r = upload->process();
 
   if (r) {
@@ -125,14 +411,7 @@ int file_transfer::upload_multi(const string &url, size_t size, const read_chunk
     return r;
   }
 
-  complete_upload = "<CompleteMultipartUpload>";
-
-  for (size_t i = 0; i < parts.size(); i++) {
-    // part numbers are 1-based
-    complete_upload += "<Part><PartNumber>" + lexical_cast<string>(i + 1) + "</PartNumber><ETag>" + parts[i].etag + "</ETag></Part>";
-  }
-
-  complete_upload += "</CompleteMultipartUpload>";
+  complete_upload = build_complete_upload(parts.begin(), parts.end());
 
   return pool::call(
     threads::PR_REQ_0, 
@@ -144,33 +423,45 @@ int file_transfer::upload_part(
   const string &url, 
   const string &upload_id, 
   const read_chunk_fn &on_read, 
+  const string &source_etag,
   upload_range *range, 
   bool is_retry)
 {
+  upload_source source(on_read, range->size, range->offset);
   int r = 0;
-  char_vector_ptr buffer(new char_vector());
 
   if (is_retry)
     ++s_uploads_multi_chunks_failed;
 
-  r = on_read(range->size, range->offset, buffer);
+  if (range->copy) {
+    // copied parts are still read so that on_read() sees (and hashes) the
+    // whole file, and so that we can check the copy against the local data
+    r = source.read_all();
 
-  if (r)
-    return r;
+    if (r)
+      return r;
+
+    range->etag = source.get_md5_etag();
 
-  range->etag = hash::compute<md5, hex_with_quotes>(*buffer);
+    return upload_part_copy(req, url, upload_id, source_etag, range);
+  }
 
   req->init(base::HTTP_PUT);
 
   // part numbers are 1-based
   req->set_url(url + "?partNumber=" + lexical_cast<string>(range->id + 1) + "&uploadId=" + upload_id);
-  req->set_input_buffer(buffer);
+  req->set_input_source(bind(&upload_source::read, &source, _1, _2, _3), range->size);
 
   req->run(config::get_transfer_timeout_in_s());
 
+  if (req->get_input_source_error())
+    return req->get_input_source_error();
+
   if (req->get_response_code() != base::HTTP_SC_OK)
     return -EIO;
 
+  range->etag = source.get_md5_etag();
+
   if (req->get_response_header("ETag") != range->etag) {
     S3_LOG(LOG_WARNING, "file_transfer::upload_part", "md5 mismatch. expected %s, got %s.\n", range->etag.c_str(), req->get_response_header("ETag").c_str());
     return -EAGAIN; // assume it's a temporary failure
@@ -179,6 +470,63 @@ int file_transfer::upload_part(
   return 0;
 }
 
+int file_transfer::upload_part_copy(
+  const request::ptr &req, 
+  const string &url, 
+  const string &upload_id, 
+  const string &source_etag,
+  upload_range *range)
+{
+  xml::document_ptr doc;
+  string etag;
+  int r;
+
+  ++s_uploads_multi_chunks_copied;
+
+  req->init(base::HTTP_PUT);
+
+  // part numbers are 1-based
+  req->set_url(url + "?partNumber=" + lexical_cast<string>(range->id + 1) + "&uploadId=" + upload_id);
+  req->set_header(service::get_header_prefix() + "copy-source", url);
+  req->set_header(service::get_header_prefix() + "copy-source-if-match", source_etag);
+  req->set_header(service::get_header_prefix() + "copy-source-range", 
+    "bytes=" + 
+    lexical_cast<string>(range->offset) + 
+    "-" + 
+    lexical_cast<string>(range->offset + range->size - 1));
+
+  req->run(config::get_transfer_timeout_in_s());
+
+  if (req->get_response_code() == base::HTTP_SC_PRECONDITION_FAILED) {
+    ++s_uploads_multi_stale_sources;
+    S3_LOG(LOG_WARNING, "file_transfer::upload_part_copy", "copy source for [%s] changed.\n", url.c_str());
+    return -ESTALE;
+  }
+
+  if (req->get_response_code() != base::HTTP_SC_OK)
+    return -EIO;
+
+  doc = xml::parse(req->get_output_string());
+
+  if (!doc) {
+    S3_LOG(LOG_WARNING, "file_transfer::upload_part_copy", "failed to parse response.\n");
+    return -EIO;
+  }
+
+  if ((r = xml::find(doc, COPY_PART_ETAG_XPATH, &etag)))
+    return r;
+
+  if (etag != range->etag) {
+    // the remote range doesn't match what we have locally, so we can't trust
+    // any of the copied parts
+    ++s_uploads_multi_stale_sources;
+    S3_LOG(LOG_WARNING, "file_transfer::upload_part_copy", "md5 mismatch. expected %s, got %s.\n", range->etag.c_str(), etag.c_str());
+    return -ESTALE;
+  }
+
+  return 0;
+}
+
 int file_transfer::upload_multi_init(const request::ptr &req, const string &url, string *upload_id)
 {
   xml::document_ptr doc;
@@ -39,30 +39,53 @@ namespace s3
 
         virtual size_t get_upload_chunk_size();
 
+        virtual boost::shared_ptr<early_upload> start_early_upload(
+          const std::string &url,
+          const read_chunk_fn &on_read);
+
       protected:
         virtual int upload_multi(
           const std::string &url, 
           size_t size, 
           const read_chunk_fn &on_read, 
+          const copy_source *source,
           std::string *returned_etag);
 
       private:
+        class early_multipart_upload;
+        friend class early_multipart_upload;
+
         struct upload_range
         {
           int id;
           size_t size;
           off_t offset;
+          bool copy; // copy from the existing object rather than upload
           std::string etag;
         };
 
+        // bytes sent for a part (none if it's copied server-side)
+        inline static size_t get_upload_size(const upload_range *range)
+        {
+          return range->copy ? 0 : range->size;
+        }
+
         int upload_part(
           const base::request::ptr &req, 
           const std::string &url, 
           const std::string &upload_id, 
           const read_chunk_fn &on_read, 
+          const std::string &source_etag,
           upload_range *range, 
           bool is_retry);
 
+        int upload_part_copy(
+          const base::request::ptr &req, 
+          const std::string &url, 
+          const std::string &upload_id, 
+          const std::string &source_etag,
+          upload_range *range);
+
         int upload_multi_init(
           const base::request::ptr &req, 
           const std::string &url, 
@@ -19,53 +19,131 @@
  * limitations under the License.
  */
 
+#include <string.h>
+
 #include <boost/lexical_cast.hpp>
 #include <boost/detail/atomic_count.hpp>
 
+#include "base/buffer_pool.h"
 #include "base/config.h"
 #include "base/logger.h"
 #include "base/request.h"
 #include "base/statistics.h"
 #include "crypto/base64.h"
 #include "crypto/encoder.h"
-#include "crypto/hash.h"
+#include "crypto/hash_list.h"
 #include "crypto/hex_with_quotes.h"
 #include "crypto/md5.h"
+#include "crypto/sha256.h"
 #include "services/file_transfer.h"
+#include "services/service.h"
+#include "threads/io_engine.h"
 #include "threads/parallel_work_queue.h"
-#include "threads/pool.h"
+#include "threads/transfer_scheduler.h"
 
+using boost::condition;
 using boost::lexical_cast;
+using boost::mutex;
 using boost::scoped_ptr;
 using boost::detail::atomic_count;
 using std::ostream;
 using std::string;
 using std::vector;
 
-using s3::base::char_vector;
+using s3::base::buffer_pool;
 using s3::base::char_vector_ptr;
 using s3::base::config;
 using s3::base::request;
 using s3::base::statistics;
 using s3::crypto::base64;
 using s3::crypto::encoder;
-using s3::crypto::hash;
+using s3::crypto::hash_list;
 using s3::crypto::hex_with_quotes;
 using s3::crypto::md5;
+using s3::crypto::sha256;
+using s3::services::early_upload;
 using s3::services::file_transfer;
+using s3::services::service;
+using s3::services::upload_source;
+using s3::threads::io_engine;
 using s3::threads::parallel_work_queue;
-using s3::threads::pool;
+using s3::threads::transfer_scheduler;
 
 namespace
 {
+  // on_write() may hash what it's given, so it has to be handed whole hash
+  // list chunks
+  const size_t BODY_BLOCK_SIZE = hash_list<sha256>::CHUNK_SIZE;
+
   struct download_range
   {
     size_t size;
     off_t offset;
   };
 
+  // collects a ranged GET's body as it arrives and passes it on to on_write()
+  // one block at a time, so that a part never has to be held in memory in
+  // its entirety
+  class body_writer
+  {
+  public:
+    inline body_writer(const file_transfer::write_chunk_fn &on_write, size_t size, off_t offset, bool wait_for_budget = true)
+      : _on_write(on_write),
+        _size(size),
+        _offset(offset),
+        _written(0),
+        _block(buffer_pool::acquire(std::min(size, BODY_BLOCK_SIZE), wait_for_budget))
+    {
+    }
+
+    int write(const char *data, size_t size, off_t body_offset)
+    {
+      // the request was retried, so start over
+      if (body_offset == 0) {
+        _block->clear();
+        _written = 0;
+      }
+
+      // ignore anything past the range we asked for
+      if (body_offset >= static_cast<off_t>(_size))
+        return 0;
+
+      size = std::min(size, _size - body_offset);
+
+      while (size) {
+        size_t n = std::min(size, BODY_BLOCK_SIZE - _block->size());
+
+        _block->insert(_block->end(), data, data + n);
+        data += n;
+        size -= n;
+
+        if (_block->size() == BODY_BLOCK_SIZE || _written + _block->size() == _size) {
+          int r = _on_write(&(*_block)[0], _block->size(), _offset + _written);
+
+          if (r)
+            return r;
+
+          _written += _block->size();
+          _block->clear();
+        }
+      }
+
+      return 0;
+    }
+
+    inline bool is_complete() const { return _written == _size; }
+
+  private:
+    file_transfer::write_chunk_fn _on_write;
+    size_t _size;
+    off_t _offset;
+    size_t _written;
+    char_vector_ptr _block;
+  };
+
   atomic_count s_downloads_single(0), s_downloads_single_failed(0);
   atomic_count s_downloads_multi(0), s_downloads_multi_failed(0), s_downloads_multi_chunks_failed(0);
+  atomic_count s_downloads_evented(0);
   atomic_count s_uploads_single(0), s_uploads_single_failed(0);
   atomic_count s_uploads_multi(0), s_uploads_multi_failed(0);
 
@@ -79,6 +157,7 @@ namespace
       "  succeeded: " << s_downloads_multi << "\n"
       "  failed: " << s_downloads_multi_failed << "\n"
       "  chunks failed: " << s_downloads_multi_chunks_failed << "\n"
+      "  run on io engine: " << s_downloads_evented << "\n"
       "common single-part uploads:\n"
       "  succeeded: " << s_uploads_single << "\n"
       "  failed: " << s_uploads_single_failed << "\n"
@@ -89,30 +168,240 @@ namespace
 
   statistics::writers::entry s_writer(statistics_writer, 0);
 
-  int download_part(const request::ptr &req, const string &url, download_range *range, const file_transfer::write_chunk_fn &on_write, bool is_retry)
+  void init_byte_range(const request::ptr &req, const string &url, size_t size, off_t offset, body_writer *writer)
   {
-    // yes, relying on is_retry will result in the chunks failed count being off by one, maybe, but we don't care
-    if (is_retry)
-      ++s_downloads_multi_chunks_failed; 
-
     req->init(s3::base::HTTP_GET);
     req->set_url(url);
     req->set_header("Range", 
       string("bytes=") + 
-      lexical_cast<string>(range->offset) + 
+      lexical_cast<string>(offset) + 
       string("-") + 
-      lexical_cast<string>(range->offset + range->size));
+      lexical_cast<string>(offset + size));
 
-    req->run(config::get_transfer_timeout_in_s());
+    req->set_output_sink(bind(&body_writer::write, writer, _1, _2, _3), s3::base::HTTP_SC_PARTIAL_CONTENT);
+  }
+
+  int check_byte_range(const request::ptr &req, const body_writer &writer)
+  {
+    if (req->get_output_sink_error())
+      return req->get_output_sink_error();
 
     if (req->get_response_code() != s3::base::HTTP_SC_PARTIAL_CONTENT)
       return -EIO;
-    else if (req->get_output_buffer().size() < range->size)
+    else if (!writer.is_complete())
       return -EIO;
 
-    return on_write(&req->get_output_buffer()[0], range->size, range->offset);
+    return 0;
   }
 
+  int download_part(file_transfer *ft, const request::ptr &req, const string &url, download_range *range, const file_transfer::write_chunk_fn &on_write, bool is_retry)
+  {
+    // yes, relying on is_retry will result in the chunks failed count being off by one, maybe, but we don't care
+    if (is_retry)
+      ++s_downloads_multi_chunks_failed; 
+
+    return ft->download_byte_range(req, url, range->size, range->offset, on_write);
+  }
+
+  size_t get_range_size(const download_range *range)
+  {
+    return range->size;
+  }
+
+  int hint_to_part(const file_transfer::download_hint_fn &on_hint, size_t chunk_size)
+  {
+    off_t offset = on_hint();
+
+    return (offset < 0) ? -1 : static_cast<int>(offset / chunk_size);
+  }
+
+  // keeps up to "in_flight" ranged GETs in progress on the io engine, each
+  // with a request of its own, so that parts don't each hold a pool thread
+  // while they wait on the network. parts go straight to the engine rather
+  // than through the transfer scheduler, so the scheduler's parts cap,
+  // bandwidth limit and request classes don't apply to them.
+  //
+  // on_done(), and with it on_hint for the next part and on_write (which
+  // hashes each block it's handed), run on the io engine's thread, so every
+  // download in progress waits while they do. parts started there therefore
+  // never wait for the buffer budget: only run(), on the caller's thread,
+  // does, and only for the first part.
+  class evented_download
+  {
+  public:
+    inline evented_download(
+      const string &url,
+      const vector<download_range> &parts,
+      const file_transfer::write_chunk_fn &on_write,
+      const file_transfer::download_hint_fn &on_hint,
+      size_t chunk_size,
+      size_t in_flight)
+      : _url(url),
+        _parts(parts),
+        _on_write(on_write),
+        _on_hint(on_hint),
+        _chunk_size(chunk_size),
+        _started(parts.size(), false),
+        _slots(std::min(in_flight, parts.size())),
+        _next_part(0),
+        _in_flight(0),
+        _error(0)
+    {
+    }
+
+    int run()
+    {
+      mutex::scoped_lock lock(_mutex);
+      vector<slot *> ready;
+
+      // once the first slot holds a buffer, the rest mustn't wait for one
+      for (size_t i = 0; i < _slots.size(); i++)
+        if (prepare_next(&_slots[i], i == 0))
+          ready.push_back(&_slots[i]);
+
+      // the engine may complete a request right away (if it isn't running, for
+      // instance), so we can't hold _mutex while posting
+      lock.unlock();
+
+      for (size_t i = 0; i < ready.size(); i++)
+        post(ready[i]);
+
+      lock.lock();
+
+      while (_in_flight > 0)
+        _condition.wait(lock);
+
+      return _error;
+    }
+
+  private:
+    struct slot
+    {
+      request::ptr req;
+      boost::shared_ptr<body_writer> writer;
+      size_t part;
+      int attempts;
+
+      inline slot() : part(0), attempts(0) { }
+    };
+
+    // the rest are called with _mutex held, except for post()
+
+    bool next_part(size_t *part)
+    {
+      int hinted = _on_hint ? hint_to_part(_on_hint, _chunk_size) : -1;
+
+      if (hinted >= 0 && static_cast<size_t>(hinted) < _parts.size() && !_started[hinted]) {
+        *part = hinted;
+
+      } else {
+        while (_next_part < _parts.size() && _started[_next_part])
+          _next_part++;
+
+        if (_next_part == _parts.size())
+          return false;
+
+        *part = _next_part;
+      }
+
+      _started[*part] = true;
+
+      return true;
+    }
+
+    bool prepare_next(slot *s, bool wait_for_budget)
+    {
+      if (_error || !next_part(&s->part))
+        return false;
+
+      s->attempts = 0;
+      prepare(s, wait_for_budget);
+
+      return true;
+    }
+
+    void prepare(slot *s, bool wait_for_budget)
+    {
+      const download_range &range = _parts[s->part];
+
+      if (!s->req) {
+        s->req.reset(new request());
+        s->req->set_hook(service::get_request_hook());
+      }
+
+      // give back the last part's buffer before taking another
+      s->writer.reset();
+      s->writer.reset(new body_writer(_on_write, range.size, range.offset, wait_for_budget));
+      init_byte_range(s->req, _url, range.size, range.offset, s->writer.get());
+
+      _in_flight++;
+    }
+
+    void post(slot *s)
+    {
+      io_engine::post(
+        s->req,
+        config::get_transfer_timeout_in_s(),
+        boost::bind(&evented_download::on_done, this, s, _1));
+    }
+
+    void on_done(slot *s, int r)
+    {
+      mutex::scoped_lock lock(_mutex);
+      bool again = false;
+
+      if (r == 0)
+        r = check_byte_range(s->req, *s->writer);
+
+      // a request that timed out can't be reused
+      if (r == -ETIMEDOUT)
+        s->req.reset();
+
+      _in_flight--;
+
+      if (r == 0) {
+        again = prepare_next(s, false);
+
+      } else if (!_error) {
+        ++s_downloads_multi_chunks_failed;
+
+        // as with parallel_work_queue, only retry parts that might succeed
+        // if tried again
+        if ((r == -EAGAIN || r == -ETIMEDOUT) && s->attempts < config::get_max_transfer_retries()) {
+          s->attempts++;
+          prepare(s, false);
+          again = true;
+        } else {
+          _error = r;
+        }
+      }
+
+      if (!again)
+        s->writer.reset();
+
+      if (_in_flight == 0)
+        _condition.notify_all();
+
+      lock.unlock();
+
+      if (again)
+        post(s);
+    }
+
+    string _url;
+    vector<download_range> _parts;
+    file_transfer::write_chunk_fn _on_write;
+    file_transfer::download_hint_fn _on_hint;
+    size_t _chunk_size;
+
+    mutex _mutex;
+    condition _condition;
+    vector<bool> _started;
+    vector<slot> _slots;
+    size_t _next_part, _in_flight;
+    int _error;
+  };
+
   int increment_on_result(int r, atomic_count *success, atomic_count *failure)
   {
     if (r)
@@ -138,34 +427,54 @@ size_t file_transfer::get_upload_chunk_size()
   return 0; // this file_transfer impl doesn't do chunks
 }
 
-int file_transfer::download(const string &url, size_t size, const write_chunk_fn &on_write)
+int file_transfer::download(const string &url, size_t size, const write_chunk_fn &on_write, const download_hint_fn &on_hint)
 {
   if (get_download_chunk_size() > 0 && size > get_download_chunk_size())
     return increment_on_result(
-      download_multi(url, size, on_write), 
+      download_multi(url, size, on_write, on_hint), 
       &s_downloads_multi,
       &s_downloads_multi_failed);
   else
     return increment_on_result(
-      pool::call(threads::PR_REQ_1, bind(&file_transfer::download_single, this, _1, url, size, on_write)),
+      transfer_scheduler::create_session(transfer_scheduler::TD_DOWNLOAD, size)->call(
+        bind(&file_transfer::download_single, this, _1, url, size, on_write),
+        size),
       &s_downloads_single, 
       &s_downloads_single_failed);
 }
 
-int file_transfer::upload(const string &url, size_t size, const read_chunk_fn &on_read, string *returned_etag)
+int file_transfer::upload(const string &url, size_t size, const read_chunk_fn &on_read, string *returned_etag, const copy_source *source)
 {
   if (get_upload_chunk_size() > 0 && size > get_upload_chunk_size())
     return increment_on_result(
-      upload_multi(url, size, on_read, returned_etag),
+      upload_multi(url, size, on_read, source, returned_etag),
       &s_uploads_multi,
       &s_uploads_multi_failed);
   else
     return increment_on_result(
-      pool::call(threads::PR_REQ_1, bind(&file_transfer::upload_single, this, _1, url, size, on_read, returned_etag)),
+      transfer_scheduler::create_session(transfer_scheduler::TD_UPLOAD, size)->call(
+        bind(&file_transfer::upload_single, this, _1, url, size, on_read, returned_etag),
+        size),
       &s_uploads_single,
       &s_uploads_single_failed);
 }
 
+early_upload::ptr file_transfer::start_early_upload(const string &url, const read_chunk_fn &on_read)
+{
+  return early_upload::ptr();
+}
+
+int file_transfer::download_byte_range(const request::ptr &req, const string &url, size_t size, off_t offset, const write_chunk_fn &on_write)
+{
+  body_writer writer(on_write, size, offset);
+
+  init_byte_range(req, url, size, offset, &writer);
+
+  req->run(config::get_transfer_timeout_in_s());
+
+  return check_byte_range(req, writer);
+}
+
 int file_transfer::download_single(const request::ptr &req, const string &url, size_t size, const write_chunk_fn &on_write)
 {
   long rc = 0;
@@ -184,7 +493,11 @@ int file_transfer::download_single(const request::ptr &req, const string &url, s
   return on_write(&req->get_output_buffer()[0], req->get_output_buffer().size(), 0);
 }
 
-int file_transfer::download_multi(const string &url, size_t size, const file_transfer::write_chunk_fn &on_write)
+int file_transfer::download_multi(
+  const string &url, 
+  size_t size, 
+  const file_transfer::write_chunk_fn &on_write,
+  const file_transfer::download_hint_fn &on_hint)
 {
   typedef parallel_work_queue<download_range> multipart_download;
 
@@ -199,11 +512,30 @@ int file_transfer::download_multi(const string &url, size_t size, const file_tra
     range->size = (i != num_parts - 1) ? get_download_chunk_size() : (size - get_download_chunk_size() * i);
   }
 
+  if (config::get_download_parts_in_flight() > 0 && io_engine::is_running()) {
+    ++s_downloads_evented;
+
+    return evented_download(
+      url,
+      parts,
+      on_write,
+      on_hint,
+      get_download_chunk_size(),
+      config::get_download_parts_in_flight()).run();
+  }
+
   dl.reset(new multipart_download(
     parts.begin(),
     parts.end(),
-    bind(&download_part, _1, url, _2, on_write, false),
-    bind(&download_part, _1, url, _2, on_write, true)));
+    bind(&download_part, this, _1, url, _2, on_write, false),
+    bind(&download_part, this, _1, url, _2, on_write, true)));
+
+  if (on_hint)
+    dl->set_next_part_hint(bind(&hint_to_part, on_hint, get_download_chunk_size()));
+
+  // byte ranges can safely be downloaded twice
+  dl->enable_hedging();
+  dl->set_transfer(transfer_scheduler::TD_DOWNLOAD, &get_range_size);
 
   return dl->process();
 }
@@ -211,16 +543,27 @@ int file_transfer::download_multi(const string &url, size_t size, const file_tra
 int file_transfer::upload_single(const request::ptr &req, const string &url, size_t size, const read_chunk_fn &on_read, string *returned_etag)
 {
   int r = 0;
-  char_vector_ptr buffer(new char_vector());
+  char_vector_ptr buffer(buffer_pool::acquire(size));
+  char_vector_ptr block(buffer_pool::acquire(std::min(size, BODY_BLOCK_SIZE), false));
   string expected_md5_b64, expected_md5_hex, etag;
   uint8_t read_hash[md5::HASH_LEN];
+  md5::context ctx;
 
-  r = on_read(size, 0, buffer);
+  // reading a block at a time lets on_read() hash and transform each block,
+  // and lets us md5 it, while it's still in cache
+  buffer->resize(size);
 
-  if (r)
-    return r;
+  for (size_t offset = 0; offset < size; offset += BODY_BLOCK_SIZE) {
+    r = on_read(std::min(BODY_BLOCK_SIZE, size - offset), offset, block);
+
+    if (r)
+      return r;
+
+    memcpy(&(*buffer)[offset], &(*block)[0], block->size());
+    ctx.update(reinterpret_cast<const uint8_t *>(&(*block)[0]), block->size());
+  }
 
-  hash::compute<md5>(*buffer, read_hash);
+  ctx.finish(read_hash);
 
   expected_md5_b64 = encoder::encode<base64>(read_hash, md5::HASH_LEN);
   expected_md5_hex = encoder::encode<hex_with_quotes>(read_hash, md5::HASH_LEN);
@@ -250,8 +593,91 @@ int file_transfer::upload_single(const request::ptr &req, const string &url, siz
   return 0;
 }
 
-int file_transfer::upload_multi(const string &url, size_t size, const read_chunk_fn &on_read, string *returned_etag)
+int file_transfer::upload_multi(const string &url, size_t size, const read_chunk_fn &on_read, const copy_source *source, string *returned_etag)
 {
   return -ENOTSUP;
 }
 
+
+upload_source::upload_source(const file_transfer::read_chunk_fn &on_read, size_t size, off_t offset)
+  : _on_read(on_read),
+    _size(size),
+    _offset(offset),
+    _block(buffer_pool::acquire(std::min(size, BODY_BLOCK_SIZE))),
+    _block_offset(-1),
+    _md5_offset(0)
+{
+}
+
+int upload_source::read(char *buffer, size_t size, off_t body_offset)
+{
+  off_t block_offset = body_offset - body_offset % BODY_BLOCK_SIZE;
+
+  // the request was rewound, so start over
+  if (body_offset == 0 && _md5_offset != 0) {
+    _md5.reset();
+    _md5_offset = 0;
+  }
+
+  if (body_offset >= static_cast<off_t>(_size))
+    return 0;
+
+  // on_read() may hash what it reads, so it has to be asked for whole hash
+  // list chunks
+  if (block_offset != _block_offset) {
+    int r = _on_read(std::min(BODY_BLOCK_SIZE, _size - block_offset), _offset + block_offset, _block);
+
+    if (r) {
+      _block_offset = -1;
+      return r;
+    }
+
+    _block_offset = block_offset;
+  }
+
+  size = std::min(size, static_cast<size_t>(_block_offset + _block->size() - body_offset));
+  memcpy(buffer, &(*_block)[body_offset - _block_offset], size);
+
+  if (body_offset == _md5_offset) {
+    _md5.update(reinterpret_cast<const uint8_t *>(buffer), size);
+    _md5_offset += size;
+  }
+
+  return size;
+}
+
+int upload_source::read_all()
+{
+  // _block is already held
+  char_vector_ptr buffer(buffer_pool::acquire(std::min(_size, BODY_BLOCK_SIZE), false));
+  off_t body_offset = 0;
+
+  buffer->resize(std::min(_size, BODY_BLOCK_SIZE));
+
+  while (body_offset < static_cast<off_t>(_size)) {
+    int r = read(&(*buffer)[0], buffer->size(), body_offset);
+
+    if (r < 0)
+      return r;
+
+    if (r == 0)
+      return -EIO;
+
+    body_offset += r;
+  }
+
+  return 0;
+}
+
+string upload_source::get_md5_etag()
+{
+  md5::context ctx = _md5;
+  uint8_t hash[md5::HASH_LEN];
+
+  if (_md5_offset != static_cast<off_t>(_size))
+    return string();
+
+  ctx.finish(hash);
+
+  return encoder::encode<hex_with_quotes>(hash, md5::HASH_LEN);
+}
@@ -27,24 +27,72 @@
 #include <boost/smart_ptr.hpp>
 
 #include "base/request.h"
+#include "crypto/md5.h"
 
 namespace s3
 {
   namespace services
   {
+    class early_upload;
+
     class file_transfer
     {
     public:
       typedef boost::function3<int, const char *, size_t, off_t> write_chunk_fn;
       typedef boost::function3<int, size_t, off_t, const base::char_vector_ptr &> read_chunk_fn;
 
+      // returns the offset of the byte that's most urgently needed by a
+      // reader, or -1 if there's no such byte
+      typedef boost::function0<off_t> download_hint_fn;
+
+      // returns true if the range was modified since the copy source was read
+      typedef boost::function2<bool, size_t, off_t> is_range_dirty_fn;
+
+      // describes the object currently at the upload URL, so that services
+      // that support it can copy unchanged ranges server-side instead of
+      // uploading them again
+      struct copy_source
+      {
+        std::string etag;
+        size_t size;
+        is_range_dirty_fn is_range_dirty;
+
+        inline copy_source() : size(0) { }
+      };
+
       virtual ~file_transfer();
 
       virtual size_t get_download_chunk_size();
       virtual size_t get_upload_chunk_size();
 
-      int download(const std::string &url, size_t size, const write_chunk_fn &on_write);
-      int upload(const std::string &url, size_t size, const read_chunk_fn &on_read, std::string *returned_etag);
+      int download(
+        const std::string &url, 
+        size_t size, 
+        const write_chunk_fn &on_write, 
+        const download_hint_fn &on_hint = download_hint_fn());
+      // if the copy source turns out to be stale, returns -ESTALE, and the
+      // caller should retry without it
+      int upload(
+        const std::string &url, 
+        size_t size, 
+        const read_chunk_fn &on_read, 
+        std::string *returned_etag,
+        const copy_source *source = NULL);
+
+      // starts a multipart upload whose parts can be sent while the file is
+      // still being written. returns an empty pointer if the service doesn't
+      // support this.
+      virtual boost::shared_ptr<early_upload> start_early_upload(
+        const std::string &url,
+        const read_chunk_fn &on_read);
+
+      // fetches a single byte range with a ranged GET. doesn't retry.
+      int download_byte_range(
+        const base::request::ptr &req,
+        const std::string &url,
+        size_t size,
+        off_t offset,
+        const write_chunk_fn &on_write);
 
     protected:
       virtual int download_single(
@@ -56,7 +104,8 @@ namespace s3
       virtual int download_multi(
         const std::string &url,
         size_t size,
-        const write_chunk_fn &on_write);
+        const write_chunk_fn &on_write,
+        const download_hint_fn &on_hint);
 
       virtual int upload_single(
         const base::request::ptr &req, 
@@ -69,8 +118,61 @@ namespace s3
         const std::string &url,
         size_t size,
         const read_chunk_fn &on_read,
+        const copy_source *source,
         std::string *returned_etag);
     };
+
+    class early_upload
+    {
+    public:
+      typedef boost::shared_ptr<early_upload> ptr;
+
+      inline virtual ~early_upload()
+      {
+      }
+
+      // sends, in the background, every whole part that lies below "size" and
+      // hasn't been sent yet. returns the offset below which data has been
+      // handed off, and so must not change.
+      virtual off_t send_parts(size_t size) = 0;
+
+      // sends whatever remains of a file of the given size and completes the
+      // upload
+      virtual int complete(size_t size, std::string *returned_etag) = 0;
+
+      // stops sending parts. the upload is aborted once parts already in
+      // flight are done.
+      virtual void cancel() = 0;
+    };
+
+    // feeds a request body from on_read() one block at a time (see
+    // request::set_input_source()), so that a part never has to be held in
+    // memory in its entirety. the md5 hash of the range is computed as it's
+    // sent.
+    class upload_source
+    {
+    public:
+      upload_source(const file_transfer::read_chunk_fn &on_read, size_t size, off_t offset);
+
+      int read(char *buffer, size_t size, off_t body_offset);
+
+      // reads the whole range without sending it anywhere
+      int read_all();
+
+      // returns an empty string unless the whole range has been read
+      std::string get_md5_etag();
+
+    private:
+      file_transfer::read_chunk_fn _on_read;
+      size_t _size;
+      off_t _offset;
+
+      base::char_vector_ptr _block;
+      off_t _block_offset;
+
+      crypto::md5::context _md5;
+      off_t _md5_offset;
+    };
   }
 }
 
@@ -28,6 +28,7 @@
 #include "services/gs/file_transfer.h"
 #include "threads/parallel_work_queue.h"
 #include "threads/pool.h"
+#include "threads/transfer_scheduler.h"
 
 using boost::lexical_cast;
 using boost::scoped_ptr;
@@ -36,14 +37,14 @@ using std::ostream;
 using std::string;
 using std::vector;
 
-using s3::base::char_vector;
-using s3::base::char_vector_ptr;
 using s3::base::config;
 using s3::base::request;
 using s3::base::statistics;
+using s3::services::upload_source;
 using s3::services::gs::file_transfer;
 using s3::threads::parallel_work_queue;
 using s3::threads::pool;
+using s3::threads::transfer_scheduler;
 
 namespace
 {
@@ -76,7 +77,7 @@ size_t file_transfer::get_upload_chunk_size()
   return _upload_chunk_size;
 }
 
-int file_transfer::upload_multi(const string &url, size_t size, const read_chunk_fn &on_read, string *returned_etag)
+int file_transfer::upload_multi(const string &url, size_t size, const read_chunk_fn &on_read, const copy_source * /* ignored */, string *returned_etag)
 {
   typedef parallel_work_queue<upload_range> multipart_upload;
 
@@ -110,6 +111,7 @@ int file_transfer::upload_multi(const string &url, size_t size, const read_chunk
     -1, // default max_retries
     1)); // only one part at a time
 
+  upload->set_transfer(transfer_scheduler::TD_UPLOAD, &file_transfer::get_upload_size);
   r = upload->process();
 
   if (r)
@@ -127,19 +129,13 @@ int file_transfer::read_and_upload(
   upload_range *range,
   size_t total_size)
 {
-  int r = 0;
-  char_vector_ptr buffer(new char_vector());
+  upload_source source(on_read, range->size, range->offset);
   string content_range = "bytes ";
 
-  r = on_read(range->size, range->offset, buffer);
-
-  if (r)
-    return r;
-
   req->init(base::HTTP_PUT);
 
   req->set_url(url);
-  req->set_input_buffer(buffer);
+  req->set_input_source(bind(&upload_source::read, &source, _1, _2, _3), range->size);
 
   content_range += 
     lexical_cast<string>(range->offset) + 
@@ -152,7 +148,7 @@ int file_transfer::read_and_upload(
 
   req->run(config::get_transfer_timeout_in_s());
 
-  return 0;
+  return req->get_input_source_error();
 }
 
 int file_transfer::upload_part(
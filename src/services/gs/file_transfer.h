@@ -40,7 +40,7 @@ namespace s3
         virtual size_t get_upload_chunk_size();
 
       protected:
-        virtual int upload_multi(const std::string &url, size_t size, const read_chunk_fn &on_read, std::string *returned_etag);
+        virtual int upload_multi(const std::string &url, size_t size, const read_chunk_fn &on_read, const copy_source *source, std::string *returned_etag);
 
       private:
         struct upload_range
@@ -49,6 +49,11 @@ namespace s3
           off_t offset;
         };
 
+        inline static size_t get_upload_size(const upload_range *range)
+        {
+          return range->size;
+        }
+
         int read_and_upload(
           const base::request::ptr &req,
           const std::string &url,
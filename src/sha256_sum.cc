@@ -20,22 +20,39 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
 
 #include "crypto/hash_list.h"
 #include "crypto/hex.h"
 #include "crypto/sha256.h"
 
+using boost::condition;
+using boost::lexical_cast;
+using boost::mutex;
+using boost::shared_ptr;
+using boost::thread_group;
 using std::cerr;
 using std::cout;
 using std::endl;
-using std::runtime_error;
+using std::string;
+using std::vector;
 
 using s3::crypto::hash_list;
 using s3::crypto::hex;
@@ -44,60 +61,282 @@ using s3::crypto::sha256;
 namespace
 {
   typedef hash_list<sha256> sha256_hash;
+
+  // files are split into segments of this many chunks, which are then hashed
+  // in parallel
+  const size_t CHUNKS_PER_SEGMENT = 64;
+
+  const char *SHORT_OPTIONS = ":j:r";
+
+  const option LONG_OPTIONS[] = {
+    { "jobs",      required_argument, NULL, 'j'  },
+    { "recursive", no_argument,       NULL, 'r'  },
+    { NULL,        0,                 NULL, '\0' } };
+
+  struct file_job
+  {
+    string path;
+    off_t size;
+    sha256_hash::ptr hash;
+    string error;
+
+    // protected by s_mutex
+    int fd;
+    uint8_t *map;
+    size_t segments_left;
+    bool done;
+
+    inline file_job() : size(0), fd(-1), map(NULL), segments_left(0), done(false) { }
+  };
+
+  typedef shared_ptr<file_job> file_job_ptr;
+
+  struct segment
+  {
+    file_job_ptr job;
+    off_t offset;
+    size_t size;
+  };
+
+  mutex s_mutex;
+  condition s_condition;
+  vector<segment> s_segments;
+  size_t s_next_segment = 0; // protected by s_mutex
+
+  inline string describe_error(const string &action, const string &path)
+  {
+    return string("Error [") + strerror(errno) + "] (" + lexical_cast<string>(errno) + ") while " + action + " [" + path + "].";
+  }
+
+  void finish_job(const mutex::scoped_lock &, const file_job_ptr &job)
+  {
+    if (job->map)
+      munmap(job->map, job->size);
+
+    if (job->fd != -1)
+      close(job->fd);
+
+    job->map = NULL;
+    job->fd = -1;
+    job->done = true;
+
+    s_condition.notify_all();
+  }
+
+  // maps the file when its first segment is picked up
+  bool map_job(const mutex::scoped_lock &, const file_job_ptr &job)
+  {
+    void *map;
+
+    if (job->map || !job->error.empty())
+      return job->map != NULL;
+
+    job->fd = open(job->path.c_str(), O_RDONLY);
+
+    if (job->fd == -1) {
+      job->error = describe_error("opening", job->path);
+      return false;
+    }
+
+    map = mmap(NULL, job->size, PROT_READ, MAP_SHARED, job->fd, 0);
+
+    if (map == MAP_FAILED) {
+      job->error = describe_error("mapping", job->path);
+      return false;
+    }
+
+    job->map = static_cast<uint8_t *>(map);
+    madvise(job->map, job->size, MADV_SEQUENTIAL);
+
+    return true;
+  }
+
+  void worker()
+  {
+    mutex::scoped_lock lock(s_mutex);
+
+    while (s_next_segment < s_segments.size()) {
+      const segment &s = s_segments[s_next_segment++];
+      file_job_ptr job = s.job;
+
+      if (map_job(lock, job)) {
+        uint8_t *map = job->map;
+
+        lock.unlock();
+
+        try {
+          job->hash->compute_hash(s.offset, map + s.offset, s.size);
+
+        } catch (const std::exception &e) {
+          lock.lock();
+          job->error = string("Caught exception ") + e.what() + " while hashing [" + job->path + "]";
+          lock.unlock();
+        }
+
+        lock.lock();
+      }
+
+      if (--job->segments_left == 0)
+        finish_job(lock, job);
+    }
+  }
+
+  void add_file(const string &path, vector<file_job_ptr> *jobs)
+  {
+    file_job_ptr job(new file_job());
+    struct stat s;
+
+    job->path = path;
+    jobs->push_back(job);
+
+    if (stat(path.c_str(), &s)) {
+      job->error = describe_error("stat-ing", path);
+      job->done = true;
+      return;
+    }
+
+    job->size = s.st_size;
+    job->hash.reset(new sha256_hash(s.st_size));
+
+    for (off_t offset = 0; offset < job->size; offset += CHUNKS_PER_SEGMENT * sha256_hash::CHUNK_SIZE) {
+      segment seg;
+
+      seg.job = job;
+      seg.offset = offset;
+      seg.size = std::min(static_cast<off_t>(CHUNKS_PER_SEGMENT * sha256_hash::CHUNK_SIZE), job->size - offset);
+
+      s_segments.push_back(seg);
+      job->segments_left++;
+    }
+
+    if (job->segments_left == 0)
+      job->done = true;
+  }
+
+  // adds regular files at or below "path", in name order. symbolic links
+  // are only followed for the path given on the command line.
+  void add_tree(const string &path, bool is_top_level, vector<file_job_ptr> *jobs)
+  {
+    struct stat s;
+    vector<string> names;
+    DIR *dir;
+    dirent *de;
+
+    if ((is_top_level ? stat(path.c_str(), &s) : lstat(path.c_str(), &s)) || S_ISREG(s.st_mode)) {
+      add_file(path, jobs); // reports the error, if any
+      return;
+    }
+
+    if (!S_ISDIR(s.st_mode))
+      return;
+
+    dir = opendir(path.c_str());
+
+    if (!dir) {
+      add_file(path, jobs); // reports the error
+      return;
+    }
+
+    while ((de = readdir(dir))) {
+      string name = de->d_name;
+
+      if (name != "." && name != "..")
+        names.push_back(name);
+    }
+
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    for (vector<string>::const_iterator itor = names.begin(); itor != names.end(); ++itor)
+      add_tree(path + "/" + *itor, false, jobs);
+  }
+
+  void print_usage(const char *arg0)
+  {
+    const char *base_name = strrchr(arg0, '/');
+
+    base_name = base_name ? base_name + 1 : arg0;
+
+    cerr <<
+      "Usage: " << base_name << " [options] <file-name> [...]\n"
+      "\n"
+      "[options] can be:\n"
+      "\n"
+      "  -j, --jobs <n>     Hash with <n> threads rather than one per CPU.\n"
+      "  -r, --recursive    Hash every regular file below directories given as\n"
+      "                     arguments.\n"
+      "\n"
+      "With a single file and no -r, prints only its hash. Otherwise, prints one\n"
+      "\"<hash>  <file-name>\" line per file." << endl;
+
+    exit(1);
+  }
 }
 
 int main(int argc, char **argv)
 {
-  struct stat s;
-  const char *file_name = NULL;
-  int fd = -1;
-  sha256_hash::ptr hash;
+  int opt = 0, ret = 0;
+  int jobs_count = boost::thread::hardware_concurrency();
+  bool recursive = false, with_names = false;
+  vector<file_job_ptr> jobs;
+  thread_group threads;
 
-  if (argc != 2) {
-    const char *arg0 = strrchr(argv[0], '/');
+  while ((opt = getopt_long(argc, argv, SHORT_OPTIONS, LONG_OPTIONS, NULL)) != -1) {
+    switch (opt) {
+      case 'j':
+        jobs_count = atoi(optarg);
+        break;
 
-    cerr << "Usage: " << (arg0 ? arg0 + 1 : argv[0]) << " <file-name>" << endl;
-    return 1;
+      case 'r':
+        recursive = true;
+        break;
+
+      default:
+        print_usage(argv[0]);
+    }
   }
 
-  file_name = argv[1];
-  fd = open(file_name, O_RDONLY);
+  if (optind == argc || jobs_count < 0)
+    print_usage(argv[0]);
 
-  if (fd == -1) {
-    cerr << "Error [" << strerror(errno) << "] (" << errno << ") while opening [" << file_name << "]." << endl;
-    return 1;
-  }
+  if (jobs_count == 0)
+    jobs_count = 1;
 
-  if (fstat(fd, &s)) {
-    cerr << "Error [" << strerror(errno) << "] (" << errno << ") while stat-ing [" << file_name << "]." << endl;
-    return 1;
+  for (int i = optind; i < argc; i++) {
+    if (recursive)
+      add_tree(argv[i], true, &jobs);
+    else
+      add_file(argv[i], &jobs);
   }
 
-  try {
-    off_t offset = 0;
-    size_t remaining = s.st_size;
-    uint8_t buffer[sha256_hash::CHUNK_SIZE];
-
-    hash.reset(new sha256_hash(remaining));
+  with_names = recursive || jobs.size() > 1;
 
-    while (remaining) {
-      size_t this_chunk = (remaining > sha256_hash::CHUNK_SIZE) ? sha256_hash::CHUNK_SIZE : remaining;
+  for (int i = 0; i < jobs_count; i++)
+    threads.create_thread(worker);
 
-      if (pread(fd, buffer, this_chunk, offset) != static_cast<ssize_t>(this_chunk))
-        throw runtime_error("pread() failed");
+  // print results in order, as they're ready
+  for (vector<file_job_ptr>::const_iterator itor = jobs.begin(); itor != jobs.end(); ++itor) {
+    const file_job_ptr &job = *itor;
+    mutex::scoped_lock lock(s_mutex);
 
-      hash->compute_hash(offset, buffer, this_chunk);
+    while (!job->done)
+      s_condition.wait(lock);
 
-      remaining -= this_chunk;
-      offset += this_chunk;
+    if (!job->error.empty()) {
+      cerr << job->error << endl;
+      ret = 1;
+      continue;
     }
 
-    cout << hash->get_root_hash<hex>() << endl;
+    cout << job->hash->get_root_hash<hex>();
 
-  } catch (const std::exception &e) {
-    cerr << "Caught exception " << e.what() << " while hashing [" << file_name << "]" << endl;
-    return 1;
+    if (with_names)
+      cout << "  " << job->path;
+
+    cout << endl;
   }
 
-  return 0;
+  threads.join_all();
+
+  return ret;
 }
@@ -0,0 +1,158 @@
+/*
+ * threads/adaptive_window.cc
+ * -------------------------------------------------------------------------
+ * Adaptive transfer window implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <boost/thread.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+#include "base/statistics.h"
+#include "base/timer.h"
+#include "threads/adaptive_window.h"
+
+using boost::mutex;
+using boost::detail::atomic_count;
+using std::ostream;
+
+using s3::base::statistics;
+using s3::base::timer;
+using s3::threads::adaptive_window;
+
+namespace
+{
+  // a round has to beat the best rate by this much for the window to grow
+  const double GROWTH_THRESHOLD = 1.05;
+
+  // and fall below it by this much for the window to shrink
+  const double SHRINK_THRESHOLD = 0.8;
+
+  mutex s_mutex;
+  size_t s_windows = 0, s_window_sum = 0, s_largest_window = 0; // protected by s_mutex
+
+  atomic_count s_increases(0), s_decreases(0), s_halvings(0);
+
+  void statistics_writer(ostream *o)
+  {
+    mutex::scoped_lock lock(s_mutex);
+
+    *o <<
+      "adaptive transfer windows:\n"
+      "  transfers: " << s_windows << "\n"
+      "  average final window: " << (s_windows ? static_cast<double>(s_window_sum) / s_windows : 0.0) << "\n"
+      "  largest window: " << s_largest_window << "\n"
+      "  increases: " << s_increases << "\n"
+      "  decreases: " << s_decreases << "\n"
+      "  halvings: " << s_halvings << "\n";
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
+}
+
+adaptive_window::adaptive_window(size_t initial, size_t min, size_t max)
+  : _size(initial),
+    _min(min),
+    _max(max),
+    _round_start(0),
+    _best_rate(0),
+    _round_completions(0),
+    _round_started(false)
+{
+  _size = std::max(_min, std::min(_max, _size));
+}
+
+adaptive_window::~adaptive_window()
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  // only transfers whose window could change are interesting
+  if (_min == _max)
+    return;
+
+  s_windows++;
+  s_window_sum += _size;
+  s_largest_window = std::max(s_largest_window, _size);
+}
+
+void adaptive_window::start_round()
+{
+  _round_start = timer::get_current_time();
+  _round_completions = 0;
+  _round_started = true;
+}
+
+void adaptive_window::on_part_posted()
+{
+  if (!_round_started)
+    start_round();
+}
+
+void adaptive_window::on_part_succeeded()
+{
+  double elapsed, rate;
+
+  if (_min == _max || !_round_started)
+    return;
+
+  if (++_round_completions < _size)
+    return;
+
+  elapsed = timer::get_current_time() - _round_start;
+
+  if (elapsed <= 0) {
+    start_round();
+    return;
+  }
+
+  rate = _round_completions / elapsed;
+
+  if (rate > _best_rate * GROWTH_THRESHOLD) {
+    _best_rate = rate;
+
+    if (_size < _max) {
+      _size++;
+      ++s_increases;
+    }
+
+  } else if (rate < _best_rate * SHRINK_THRESHOLD) {
+    // conditions changed; start measuring again from here
+    _best_rate = rate;
+
+    if (_size > _min) {
+      _size--;
+      ++s_decreases;
+    }
+  }
+
+  start_round();
+}
+
+void adaptive_window::on_part_congested()
+{
+  if (_min == _max)
+    return;
+
+  if (_size > _min) {
+    _size = std::max(_min, _size / 2);
+    ++s_halvings;
+  }
+
+  _best_rate = 0;
+  start_round();
+}
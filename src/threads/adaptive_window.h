@@ -0,0 +1,66 @@
+/*
+ * threads/adaptive_window.h
+ * -------------------------------------------------------------------------
+ * Adjusts the number of parts a transfer keeps in progress.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_THREADS_ADAPTIVE_WINDOW_H
+#define S3_THREADS_ADAPTIVE_WINDOW_H
+
+#include <stddef.h>
+
+namespace s3
+{
+  namespace threads
+  {
+    // measures the rate at which parts complete over a round (as many
+    // completions as the window size) and grows the window by one part for
+    // as long as that improves the rate. the window shrinks by one if the
+    // rate drops well below the best seen, and is halved whenever a part
+    // times out or has to be retried.
+    //
+    // parts of a transfer are all about the same size, so parts per second
+    // stands in for bytes per second.
+    //
+    // not thread safe.
+    class adaptive_window
+    {
+    public:
+      // a fixed window of "initial" parts if min == max
+      adaptive_window(size_t initial, size_t min, size_t max);
+      ~adaptive_window();
+
+      inline size_t get_size() const { return _size; }
+
+      void on_part_posted();
+      void on_part_succeeded();
+      void on_part_congested();
+
+    private:
+      void start_round();
+
+      size_t _size, _min, _max;
+
+      double _round_start, _best_rate;
+      size_t _round_completions;
+      bool _round_started;
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * threads/hedge_policy.cc
+ * -------------------------------------------------------------------------
+ * Hedging policy implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <boost/detail/atomic_count.hpp>
+
+#include "base/statistics.h"
+#include "threads/hedge_policy.h"
+
+using boost::detail::atomic_count;
+using std::ostream;
+using std::vector;
+
+using s3::base::statistics;
+using s3::threads::hedge_policy;
+
+namespace
+{
+  // completed parts needed before the percentile means anything
+  const size_t MIN_SAMPLES = 4;
+
+  // parts that have been running for less than this aren't worth hedging
+  const double MIN_THRESHOLD = 0.5; // seconds
+
+  atomic_count s_hedges(0), s_hedges_won(0), s_hedges_lost(0);
+
+  void statistics_writer(ostream *o)
+  {
+    *o <<
+      "hedged transfer parts:\n"
+      "  hedges: " << s_hedges << "\n"
+      "  won by hedge: " << s_hedges_won << "\n"
+      "  won by original: " << s_hedges_lost << "\n";
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
+}
+
+hedge_policy::hedge_policy(int percentile, size_t max_hedges)
+  : _percentile(percentile),
+    _max_hedges(max_hedges),
+    _hedges(0),
+    _threshold(0)
+{
+}
+
+void hedge_policy::on_part_succeeded(double elapsed, bool hedged, bool hedge_won)
+{
+  if (hedged) {
+    if (hedge_won)
+      ++s_hedges_won;
+    else
+      ++s_hedges_lost;
+  }
+
+  if (_percentile <= 0 || _max_hedges == 0)
+    return;
+
+  _times.push_back(elapsed);
+  update_threshold();
+}
+
+void hedge_policy::on_hedge_posted()
+{
+  _hedges++;
+  ++s_hedges;
+}
+
+void hedge_policy::update_threshold()
+{
+  vector<double> times;
+  size_t index;
+
+  if (_times.size() < MIN_SAMPLES)
+    return;
+
+  times = _times;
+  index = std::min(times.size() - 1, times.size() * _percentile / 100);
+
+  std::nth_element(times.begin(), times.begin() + index, times.end());
+
+  _threshold = std::max(MIN_THRESHOLD, times[index]);
+}
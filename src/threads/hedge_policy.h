@@ -0,0 +1,64 @@
+/*
+ * threads/hedge_policy.h
+ * -------------------------------------------------------------------------
+ * Decides when a straggling transfer part should be duplicated.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_THREADS_HEDGE_POLICY_H
+#define S3_THREADS_HEDGE_POLICY_H
+
+#include <stddef.h>
+
+#include <vector>
+
+namespace s3
+{
+  namespace threads
+  {
+    // keeps the times taken by the completed parts of a transfer. once there
+    // are enough of them, a part that has been running for longer than
+    // "percentile" percent of them is a straggler, and may be duplicated
+    // (hedged) so long as fewer than "max_hedges" parts have been already.
+    //
+    // not thread safe.
+    class hedge_policy
+    {
+    public:
+      // percentile == 0 or max_hedges == 0 disables hedging
+      hedge_policy(int percentile, size_t max_hedges);
+
+      inline bool can_hedge() const { return _threshold > 0 && _hedges < _max_hedges; }
+
+      // seconds after which a part is a straggler; only valid if can_hedge()
+      inline double get_threshold() const { return _threshold; }
+
+      void on_part_succeeded(double elapsed, bool hedged, bool hedge_won);
+      void on_hedge_posted();
+
+    private:
+      void update_threshold();
+
+      int _percentile;
+      size_t _max_hedges, _hedges;
+      double _threshold;
+      std::vector<double> _times;
+    };
+  }
+}
+
+#endif
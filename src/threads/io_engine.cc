@@ -0,0 +1,437 @@
+/*
+ * threads/io_engine.cc
+ * -------------------------------------------------------------------------
+ * Event-driven request engine implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <stdexcept>
+#include <boost/thread.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+#include "base/logger.h"
+#include "base/request.h"
+#include "base/statistics.h"
+#include "base/timer.h"
+#include "threads/io_engine.h"
+
+using boost::mutex;
+using boost::scoped_ptr;
+using boost::thread;
+using boost::detail::atomic_count;
+using std::list;
+using std::map;
+using std::ostream;
+using std::runtime_error;
+
+using s3::base::request;
+using s3::base::statistics;
+using s3::base::timer;
+using s3::threads::async_handle;
+using s3::threads::io_engine;
+
+namespace
+{
+  // the loop wakes at least this often to check for timeouts
+  const long MAX_WAIT_IN_MS = 1000;
+
+  struct transfer
+  {
+    request::ptr req;
+    async_handle::ptr ah;
+    double start_at;
+    bool begun; // begin_attempt() has been called
+  };
+
+  typedef list<transfer> transfer_list;
+  typedef map<CURL *, transfer> transfer_map;
+
+  mutex s_mutex;
+  scoped_ptr<thread> s_loop;
+  bool s_running = false, s_done = false;
+  transfer_list s_incoming; // protected by s_mutex
+
+  // posts write to this to wake the loop
+  int s_wake_pipe[2] = { -1, -1 };
+
+  // only used by the loop thread
+  CURLM *s_multi = NULL;
+  size_t s_peak_in_flight = 0;
+
+  atomic_count s_requests(0), s_retries(0), s_timeouts(0), s_failures(0);
+
+  void statistics_writer(ostream *o)
+  {
+    *o <<
+      "io engine:\n"
+      "  requests: " << s_requests << "\n"
+      "  retries: " << s_retries << "\n"
+      "  timeouts: " << s_timeouts << "\n"
+      "  failures: " << s_failures << "\n"
+      "  peak requests in flight: " << s_peak_in_flight << "\n";
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
+
+  void wake()
+  {
+    char c = 0;
+
+    // if the pipe is full, the loop is already due to wake up
+    if (write(s_wake_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+      S3_LOG(LOG_WARNING, "io_engine::wake", "failed to write to wake pipe: %i\n", errno);
+  }
+
+  void drain_wake_pipe()
+  {
+    char buf[64];
+
+    while (read(s_wake_pipe[0], buf, sizeof(buf)) > 0)
+      ; // do nothing
+  }
+
+  void fail(const transfer &t, int r)
+  {
+    ++s_failures;
+    t.ah->complete(r);
+  }
+
+  // called once an attempt is over. queues the next attempt if there is one.
+  void end_attempt(transfer t, CURLcode result, transfer_list *waiting)
+  {
+    double delay;
+
+    try {
+      delay = t.req->end_attempt(result);
+
+      if (delay < 0.0) {
+        t.req->end_run();
+        t.ah->complete(0);
+
+        return;
+      }
+
+    } catch (const std::exception &e) {
+      S3_LOG(LOG_WARNING, "io_engine::end_attempt", "caught exception: %s\n", e.what());
+      fail(t, -ECANCELED);
+
+      return;
+    }
+
+    ++s_retries;
+
+    t.start_at = timer::get_current_time() + delay;
+    t.begun = false;
+
+    waiting->push_back(t);
+  }
+
+  // starts whatever's due, and returns the number of milliseconds until the
+  // next transfer is due, or -1 if nothing's waiting
+  long start_due(transfer_list *waiting, transfer_map *active)
+  {
+    double now = timer::get_current_time();
+    double next = -1.0;
+
+    for (transfer_list::iterator itor = waiting->begin(); itor != waiting->end(); /* do nothing */) {
+      transfer &t = *itor;
+
+      if (t.start_at <= now && !t.begun) {
+        try {
+          t.start_at = now + t.req->begin_attempt();
+          t.begun = true;
+
+        } catch (const std::exception &e) {
+          S3_LOG(LOG_WARNING, "io_engine::start_due", "caught exception: %s\n", e.what());
+          fail(t, -ECANCELED);
+
+          itor = waiting->erase(itor);
+          continue;
+        }
+      }
+
+      if (t.start_at > now) {
+        if (next < 0.0 || t.start_at < next)
+          next = t.start_at;
+
+        ++itor;
+        continue;
+      }
+
+      if (curl_multi_add_handle(s_multi, t.req->get_curl_handle()) != CURLM_OK) {
+        S3_LOG(LOG_WARNING, "io_engine::start_due", "failed to add handle for [%s].\n", t.req->get_url().c_str());
+
+        // end_attempt() throws if the request was canceled meanwhile, and
+        // this thread mustn't exit
+        try {
+          t.req->end_attempt(CURLE_FAILED_INIT);
+        } catch (const std::exception &) {
+          // it's failed below either way
+        }
+
+        fail(t, -ECANCELED);
+
+      } else {
+        (*active)[t.req->get_curl_handle()] = t;
+      }
+
+      itor = waiting->erase(itor);
+    }
+
+    if (active->size() > s_peak_in_flight)
+      s_peak_in_flight = active->size();
+
+    return (next < 0.0) ? -1 : static_cast<long>((next - now) * 1.0e3) + 1;
+  }
+
+  void check_timeouts(transfer_map *active)
+  {
+    for (transfer_map::iterator itor = active->begin(); itor != active->end(); /* do nothing */) {
+      transfer t = itor->second;
+
+      if (!t.req->check_timeout()) {
+        ++itor;
+        continue;
+      }
+
+      curl_multi_remove_handle(s_multi, itor->first);
+      active->erase(itor++);
+
+      ++s_timeouts;
+
+      try {
+        t.req->end_attempt(CURLE_OPERATION_TIMEDOUT);
+      } catch (const std::exception &) {
+        // expected, since the request was canceled
+      }
+
+      fail(t, -ETIMEDOUT);
+    }
+  }
+
+  void wait_for_activity(long timeout_in_ms)
+  {
+#if LIBCURL_VERSION_NUM >= 0x071c00
+    struct curl_waitfd wake_fd;
+    int fd_count = 0;
+
+    wake_fd.fd = s_wake_pipe[0];
+    wake_fd.events = CURL_WAIT_POLLIN;
+    wake_fd.revents = 0;
+
+    curl_multi_wait(s_multi, &wake_fd, 1, timeout_in_ms, &fd_count);
+#else
+    fd_set read_fds, write_fds, except_fds;
+    struct timeval tv;
+    int max_fd = -1;
+
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    FD_ZERO(&except_fds);
+
+    curl_multi_fdset(s_multi, &read_fds, &write_fds, &except_fds, &max_fd);
+
+    FD_SET(s_wake_pipe[0], &read_fds);
+    max_fd = std::max(max_fd, s_wake_pipe[0]);
+
+    tv.tv_sec = timeout_in_ms / 1000;
+    tv.tv_usec = (timeout_in_ms % 1000) * 1000;
+
+    select(max_fd + 1, &read_fds, &write_fds, &except_fds, &tv);
+#endif
+
+    drain_wake_pipe();
+  }
+}
+
+void io_engine::init()
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  if (s_running)
+    return;
+
+  if (pipe(s_wake_pipe) != 0)
+    throw runtime_error("failed to create io engine wake pipe.");
+
+  fcntl(s_wake_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(s_wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+  s_multi = curl_multi_init();
+
+  if (!s_multi)
+    throw runtime_error("failed to create curl multi handle.");
+
+  s_running = true;
+  s_done = false;
+  s_loop.reset(new thread(&io_engine::loop));
+}
+
+void io_engine::terminate()
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  if (!s_running)
+    return;
+
+  s_done = true;
+  wake();
+
+  lock.unlock();
+  s_loop->join();
+  lock.lock();
+
+  s_running = false;
+
+  curl_multi_cleanup(s_multi);
+  s_multi = NULL;
+
+  close(s_wake_pipe[0]);
+  close(s_wake_pipe[1]);
+  s_wake_pipe[0] = s_wake_pipe[1] = -1;
+}
+
+bool io_engine::is_running()
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  return s_running && !s_done;
+}
+
+void io_engine::start(const request::ptr &req, int timeout_in_s, const async_handle::ptr &ah)
+{
+  mutex::scoped_lock lock(s_mutex, boost::defer_lock);
+  transfer t;
+
+  t.req = req;
+  t.ah = ah;
+  t.start_at = 0.0;
+  t.begun = false;
+
+  try {
+    req->begin_run(timeout_in_s);
+
+  } catch (const std::exception &e) {
+    S3_LOG(LOG_WARNING, "io_engine::start", "caught exception: %s\n", e.what());
+    fail(t, -ECANCELED);
+
+    return;
+  }
+
+  lock.lock();
+
+  if (!s_running || s_done) {
+    lock.unlock();
+    fail(t, -ECANCELED);
+
+    return;
+  }
+
+  ++s_requests;
+  s_incoming.push_back(t);
+  wake();
+}
+
+void io_engine::loop()
+{
+  transfer_list waiting;
+  transfer_map active;
+  double last_timeout_check = 0.0;
+
+  while (true) {
+    long wait_in_ms = MAX_WAIT_IN_MS, curl_wait_in_ms = -1, due_in_ms;
+    int running = 0;
+    CURLMsg *msg;
+    int msgs_left = 0;
+
+    {
+      mutex::scoped_lock lock(s_mutex);
+
+      if (s_done)
+        break;
+
+      waiting.splice(waiting.end(), s_incoming);
+    }
+
+    due_in_ms = start_due(&waiting, &active);
+
+    curl_multi_perform(s_multi, &running);
+
+    while ((msg = curl_multi_info_read(s_multi, &msgs_left))) {
+      transfer_map::iterator itor;
+
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+
+      itor = active.find(msg->easy_handle);
+
+      if (itor == active.end())
+        continue;
+
+      CURLcode result = msg->data.result;
+      transfer t = itor->second;
+
+      // msg is invalid once the handle is removed
+      curl_multi_remove_handle(s_multi, itor->first);
+      active.erase(itor);
+
+      end_attempt(t, result, &waiting);
+
+      // a retry may be due right away
+      wait_in_ms = 0;
+    }
+
+    if (timer::get_current_time() - last_timeout_check >= 1.0) {
+      check_timeouts(&active);
+      last_timeout_check = timer::get_current_time();
+    }
+
+    curl_multi_timeout(s_multi, &curl_wait_in_ms);
+
+    if (curl_wait_in_ms >= 0 && curl_wait_in_ms < wait_in_ms)
+      wait_in_ms = curl_wait_in_ms;
+
+    if (due_in_ms >= 0 && due_in_ms < wait_in_ms)
+      wait_in_ms = due_in_ms;
+
+    if (wait_in_ms > 0)
+      wait_for_activity(wait_in_ms);
+  }
+
+  // we're shutting down, so whatever's left won't run
+  {
+    mutex::scoped_lock lock(s_mutex);
+
+    waiting.splice(waiting.end(), s_incoming);
+  }
+
+  for (transfer_map::iterator itor = active.begin(); itor != active.end(); ++itor) {
+    curl_multi_remove_handle(s_multi, itor->first);
+    fail(itor->second, -ECANCELED);
+  }
+
+  for (transfer_list::iterator itor = waiting.begin(); itor != waiting.end(); ++itor)
+    fail(*itor, -ECANCELED);
+}
@@ -0,0 +1,85 @@
+/*
+ * threads/io_engine.h
+ * -------------------------------------------------------------------------
+ * Runs requests on a single event-driven thread.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_THREADS_IO_ENGINE_H
+#define S3_THREADS_IO_ENGINE_H
+
+#include <boost/smart_ptr.hpp>
+
+#include "threads/async_handle.h"
+
+namespace s3
+{
+  namespace base
+  {
+    class request;
+  }
+
+  namespace threads
+  {
+    // drives any number of requests from one thread with a curl multi
+    // handle, so that a request waiting on the network doesn't hold a pool
+    // thread. the request's hooks, output sink and input source, and the
+    // completion, all run on that thread, so none of them may block for long.
+    class io_engine
+    {
+    public:
+      static void init();
+      static void terminate();
+
+      static bool is_running();
+
+      // runs "req", which should be set up as it would be for
+      // request::run(). completes with 0 once the request has run (check the
+      // response as you would after run()), -ETIMEDOUT if it timed out (after
+      // which "req" can't be reused), or -ECANCELED if it failed otherwise or
+      // the engine isn't running.
+      inline static wait_async_handle::ptr post(
+        const boost::shared_ptr<base::request> &req,
+        int timeout_in_s)
+      {
+        wait_async_handle::ptr ah(new wait_async_handle());
+
+        start(req, timeout_in_s, ah);
+
+        return ah;
+      }
+
+      inline static void post(
+        const boost::shared_ptr<base::request> &req,
+        int timeout_in_s,
+        const callback_async_handle::callback_function &cb)
+      {
+        start(req, timeout_in_s, async_handle::ptr(new callback_async_handle(cb)));
+      }
+
+    private:
+      static void start(
+        const boost::shared_ptr<base::request> &req,
+        int timeout_in_s,
+        const async_handle::ptr &ah);
+
+      static void loop();
+    };
+  }
+}
+
+#endif
@@ -22,20 +22,26 @@
 #ifndef S3_THREADS_PARALLEL_WORK_QUEUE_H
 #define S3_THREADS_PARALLEL_WORK_QUEUE_H
 
+#include <deque>
 #include <iostream>
+#include <list>
 #include <vector>
+#include <boost/smart_ptr.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
 
 #include "base/config.h"
 #include "base/logger.h"
+#include "base/request.h"
+#include "base/timer.h"
+#include "threads/adaptive_window.h"
+#include "threads/hedge_policy.h"
 #include "threads/pool.h"
+#include "threads/transfer_scheduler.h"
 
 namespace s3
 {
-  namespace base
-  {
-    class request;
-  }
-
   namespace threads
   {
     template <class T>
@@ -44,6 +50,8 @@ namespace s3
     public:
       typedef boost::function2<int, const boost::shared_ptr<base::request> &, T *> process_part_fn;
       typedef boost::function2<int, const boost::shared_ptr<base::request> &, T *> retry_part_fn;
+      typedef boost::function0<int> next_part_hint_fn;
+      typedef boost::function1<size_t, const T *> part_size_fn;
 
       template <class iterator_type>
       inline parallel_work_queue(
@@ -54,7 +62,9 @@ namespace s3
         int max_retries = -1,
         int max_parts_in_progress = -1)
         : _on_process_part(on_process_part),
-          _on_retry_part(on_retry_part)
+          _on_retry_part(on_retry_part),
+          _hedging(false),
+          _next_unposted(0)
       {
         size_t id = 0;
 
@@ -68,63 +78,160 @@ namespace s3
         }
 
         _max_retries = (max_retries == -1) ? base::config::get_max_transfer_retries() : max_retries;
-        _max_parts_in_progress = (max_parts_in_progress == -1) ? base::config::get_max_parts_in_progress() : max_parts_in_progress;
+
+        // callers that ask for a specific number of parts get exactly that
+        if (max_parts_in_progress != -1)
+          _window.reset(new adaptive_window(max_parts_in_progress, max_parts_in_progress, max_parts_in_progress));
+        else if (base::config::get_adaptive_parts_in_progress())
+          _window.reset(new adaptive_window(
+            base::config::get_max_parts_in_progress(),
+            1,
+            std::max(base::config::get_max_parts_in_progress(), base::config::get_max_adaptive_parts_in_progress())));
+        else
+          _window.reset(new adaptive_window(
+            base::config::get_max_parts_in_progress(),
+            base::config::get_max_parts_in_progress(),
+            base::config::get_max_parts_in_progress()));
+      }
+
+      // if set, on_next_part_hint is consulted each time a new part is about to
+      // be posted. it should return the index of the part that's most urgently
+      // needed (or -1 if there's no preference). the first part at or after
+      // that index that hasn't been posted yet goes next; otherwise parts are
+      // posted in order.
+      inline void set_next_part_hint(const next_part_hint_fn &on_next_part_hint)
+      {
+        _on_next_part_hint = on_next_part_hint;
+      }
+
+      // allows a part that's taking much longer than the others to be posted
+      // a second time, in which case the first copy to succeed is used and
+      // the other is aborted. only for parts that can safely be processed
+      // twice, concurrently.
+      //
+      // each copy of a part is processed on its own copy of T, which is
+      // copied back when it succeeds.
+      inline void enable_hedging()
+      {
+        _hedging = true;
+      }
+
+      // posts parts through the transfer scheduler, which shares request
+      // threads and bandwidth with other transfers, instead of directly to
+      // the pool. on_part_size gives the number of bytes a part transfers.
+      inline void set_transfer(transfer_scheduler::direction dir, const part_size_fn &on_part_size)
+      {
+        uint64_t total_size = 0;
+
+        for (size_t i = 0; i < _parts.size(); i++)
+          total_size += on_part_size(_parts[i].part);
+
+        _on_part_size = on_part_size;
+        _session = transfer_scheduler::create_session(dir, total_size);
       }
 
       int process()
       {
-        size_t last_part = 0;
+        boost::shared_ptr<completion_channel> channel(new completion_channel());
+        hedge_policy hedging(
+          _hedging ? base::config::get_transfer_part_hedge_percentile() : 0,
+          std::max<size_t>(1, _parts.size() * base::config::get_max_hedged_parts_percent() / 100));
         std::list<process_part *> parts_in_progress;
+        size_t attempts_in_progress = 0;
         int r = 0;
 
-        for (last_part = 0; last_part < std::min(_max_parts_in_progress, _parts.size()); last_part++) {
-          process_part *part = &_parts[last_part];
+        for (size_t i = 0; i < std::min(_window->get_size(), _parts.size()); i++) {
+          process_part *part = get_next_part();
 
-          part->handle = threads::pool::post(
-            threads::PR_REQ_1, 
-            bind(_on_process_part, _1, part->part),
-            0 /* don't retry on timeout since we handle that here */);
+          post_attempt(channel, part, _on_process_part, false);
 
+          _window->on_part_posted();
           parts_in_progress.push_back(part);
+          attempts_in_progress++;
         }
 
-        while (!parts_in_progress.empty()) {
-          process_part *part = parts_in_progress.front();
+        // parts are handled in the order in which they finish, so a slow part
+        // only holds up its own slot rather than every part posted after it.
+        // we keep going until the losing copies of hedged parts are done too,
+        // since they may still be using our caller's data.
+
+        while (attempts_in_progress) {
+          typename completion_channel::event e;
+          typename attempt::ptr a;
+          process_part *part = NULL;
+          double wait_time = -1.0;
           int part_r;
 
-          parts_in_progress.pop_front();
-          part_r = part->handle->wait();
+          if (r == 0 && hedging.can_hedge())
+            wait_time = hedge_stragglers(channel, &hedging, parts_in_progress, &attempts_in_progress);
+
+          if (!channel->wait(&e, wait_time))
+            continue;
+
+          a = e.a;
+          part = a->part;
+
+          // a part may wait in the transfer scheduler for a while, so its
+          // time only starts once it's actually run
+          if (e.started) {
+            if (!a->hedge)
+              part->start_time = e.start_time;
+
+            continue;
+          }
+
+          part_r = e.return_code;
+          attempts_in_progress--;
+
+          part->attempts.remove(a);
+
+          if (part->succeeded)
+            continue; // the losing copy of a hedged part
+
+          if (part_r == 0) {
+            part->succeeded = true;
+            *part->part = a->value;
+
+            // abort the other copy, if there is one
+            for (typename std::list<typename attempt::ptr>::iterator itor = part->attempts.begin(); itor != part->attempts.end(); ++itor)
+              ++(*itor)->aborted;
+
+            _window->on_part_succeeded();
+            hedging.on_part_succeeded(base::timer::get_current_time() - part->start_time, part->hedged, a->hedge);
 
-          if (part_r) {
+            parts_in_progress.remove(part);
+
+          } else if (!part->attempts.empty()) {
+            S3_LOG(LOG_DEBUG, "parallel_work_queue::process", "part %i returned status %i, waiting for its other copy.\n", part->id, part_r);
+
+          } else {
             S3_LOG(LOG_DEBUG, "parallel_work_queue::process", "part %i returned status %i.\n", part->id, part_r);
 
+            if (part_r == -EAGAIN || part_r == -ETIMEDOUT)
+              _window->on_part_congested();
+
             if ((part_r == -EAGAIN || part_r == -ETIMEDOUT) && part->retry_count < _max_retries) {
-              part->handle = threads::pool::post(
-                threads::PR_REQ_1, 
-                bind(_on_retry_part, _1, part->part),
-                0);
+              post_attempt(channel, part, _on_retry_part, false);
 
               part->retry_count++;
-
-              parts_in_progress.push_back(part);
+              attempts_in_progress++;
             } else {
               if (r == 0) // only save the first non-successful return code
                 r = part_r;
+
+              parts_in_progress.remove(part);
             }
           }
 
           // keep collecting parts until we have nothing left pending
           // if one part fails, keep going but stop posting new parts
 
-          if (r == 0 && last_part < _parts.size()) {
-            part = &_parts[last_part++];
-
-            part->handle = threads::pool::post(
-              threads::PR_REQ_1, 
-              bind(_on_process_part, _1, part->part),
-              0);
+          while (r == 0 && parts_in_progress.size() < _window->get_size() && (part = get_next_part())) {
+            post_attempt(channel, part, _on_process_part, false);
 
+            _window->on_part_posted();
             parts_in_progress.push_back(part);
+            attempts_in_progress++;
           }
         }
 
@@ -132,29 +239,252 @@ namespace s3
       }
 
     private:
+      struct process_part;
+
+      // one copy of a part being processed
+      struct attempt
+      {
+        typedef boost::shared_ptr<attempt> ptr;
+
+        process_part *part;
+        T value;
+        bool hedge;
+        boost::detail::atomic_count aborted;
+
+        inline attempt(process_part *part_, bool hedge_)
+          : part(part_),
+            value(*part_->part),
+            hedge(hedge_),
+            aborted(0)
+        {
+        }
+
+        inline bool is_aborted() const
+        {
+          return aborted != 0;
+        }
+      };
+
       struct process_part
       {
         int id;
         int retry_count;
-        threads::wait_async_handle::ptr handle;
+        bool posted;
+        bool hedged; // a second copy was posted
+        bool succeeded;
+        double start_time; // of the current try, or 0 if it hasn't started
+        std::list<typename attempt::ptr> attempts; // in progress
 
         T *part;
 
         inline process_part()
           : id(-1),
             retry_count(0),
+            posted(false),
+            hedged(false),
+            succeeded(false),
+            start_time(0),
             part(NULL)
         {
         }
       };
 
+      // collects the starts and return codes of attempts. held by
+      // shared_ptr because the pool runs attempts on its own threads.
+      class completion_channel
+      {
+      public:
+        struct event
+        {
+          typename attempt::ptr a;
+          bool started; // otherwise, it finished
+          double start_time;
+          int return_code;
+
+          inline event() : started(false), start_time(0), return_code(0) { }
+        };
+
+        inline void start(const typename attempt::ptr &a)
+        {
+          event e;
+
+          e.a = a;
+          e.started = true;
+          e.start_time = base::timer::get_current_time();
+
+          push(e);
+        }
+
+        inline void complete(const typename attempt::ptr &a, int return_code)
+        {
+          event e;
+
+          e.a = a;
+          e.return_code = return_code;
+
+          push(e);
+        }
+
+        // waits for at most "timeout" seconds (forever if negative). returns
+        // false if nothing happened in that time.
+        inline bool wait(event *e, double timeout)
+        {
+          boost::mutex::scoped_lock lock(_mutex);
+
+          if (timeout < 0) {
+            while (_events.empty())
+              _condition.wait(lock);
+
+          } else if (_events.empty()) {
+            _condition.timed_wait(lock, boost::posix_time::milliseconds(static_cast<long>(timeout * 1.0e3) + 1));
+
+            if (_events.empty())
+              return false;
+          }
+
+          *e = _events.front();
+          _events.pop_front();
+
+          return true;
+        }
+
+      private:
+        inline void push(const event &e)
+        {
+          boost::mutex::scoped_lock lock(_mutex);
+
+          _events.push_back(e);
+          _condition.notify_all();
+        }
+
+        boost::mutex _mutex;
+        boost::condition _condition;
+        std::deque<event> _events;
+      };
+
+      inline static int run_attempt(
+        const boost::shared_ptr<completion_channel> &channel,
+        const process_part_fn &fn,
+        const typename attempt::ptr &a,
+        const boost::shared_ptr<base::request> &req)
+      {
+        if (a->is_aborted())
+          return -ECANCELED;
+
+        channel->start(a);
+        req->set_abort_check(boost::bind(&attempt::is_aborted, a));
+
+        return fn(req, &a->value);
+      }
+
+      void post_attempt(
+        const boost::shared_ptr<completion_channel> &channel,
+        process_part *part,
+        const process_part_fn &fn,
+        bool hedge)
+      {
+        typename attempt::ptr a(new attempt(part, hedge));
+
+        if (!hedge)
+          part->start_time = 0; // set once the attempt starts
+
+        part->attempts.push_back(a);
+
+        if (_session)
+          _session->post(
+            boost::bind(&parallel_work_queue::run_attempt, channel, fn, a, _1),
+            _on_part_size(part->part),
+            boost::bind(&completion_channel::complete, channel, a, _1),
+            0 /* don't retry on timeout since we handle that here */);
+        else
+          threads::pool::post(
+            threads::PR_REQ_1,
+            boost::bind(&parallel_work_queue::run_attempt, channel, fn, a, _1),
+            boost::bind(&completion_channel::complete, channel, a, _1),
+            0);
+      }
+
+      // posts a second copy of parts that have been running for longer than
+      // the hedging threshold. returns the time until the next part could
+      // become a straggler, or -1 if none can.
+      double hedge_stragglers(
+        const boost::shared_ptr<completion_channel> &channel,
+        hedge_policy *hedging,
+        const std::list<process_part *> &parts_in_progress,
+        size_t *attempts_in_progress)
+      {
+        double now = base::timer::get_current_time();
+        double wait_time = -1.0;
+
+        for (typename std::list<process_part *>::const_iterator itor = parts_in_progress.begin(); itor != parts_in_progress.end(); ++itor) {
+          process_part *part = *itor;
+          double remaining;
+
+          if (part->hedged || part->attempts.size() != 1 || part->start_time == 0)
+            continue;
+
+          remaining = part->start_time + hedging->get_threshold() - now;
+
+          if (remaining <= 0) {
+            if (!hedging->can_hedge())
+              return -1.0;
+
+            S3_LOG(LOG_DEBUG, "parallel_work_queue::hedge_stragglers", "hedging part %i after %.3f s.\n", part->id, now - part->start_time);
+
+            post_attempt(channel, part, _on_process_part, true);
+
+            part->hedged = true;
+            hedging->on_hedge_posted();
+            (*attempts_in_progress)++;
+
+          } else if (wait_time < 0 || remaining < wait_time) {
+            wait_time = remaining;
+          }
+        }
+
+        return hedging->can_hedge() ? wait_time : -1.0;
+      }
+
+      process_part * get_next_part()
+      {
+        size_t next = _next_unposted;
+
+        if (_on_next_part_hint) {
+          int hint = _on_next_part_hint();
+
+          if (hint >= 0) {
+            for (size_t i = hint; i < _parts.size(); i++) {
+              if (!_parts[i].posted) {
+                next = i;
+                break;
+              }
+            }
+          }
+        }
+
+        if (next >= _parts.size())
+          return NULL;
+
+        _parts[next].posted = true;
+
+        while (_next_unposted < _parts.size() && _parts[_next_unposted].posted)
+          _next_unposted++;
+
+        return &_parts[next];
+      }
+
       std::vector<process_part> _parts;
 
       process_part_fn _on_process_part;
       retry_part_fn _on_retry_part;
+      next_part_hint_fn _on_next_part_hint;
+      part_size_fn _on_part_size;
+      transfer_scheduler::session::ptr _session;
 
       int _max_retries;
-      size_t _max_parts_in_progress;
+      boost::scoped_ptr<adaptive_window> _window;
+      bool _hedging;
+      size_t _next_unposted;
     };
   }
 }
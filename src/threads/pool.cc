@@ -20,24 +20,36 @@
  */
 
 #include <list>
+#include <vector>
+
+#include <boost/detail/atomic_count.hpp>
 
 #include "base/config.h"
 #include "base/logger.h"
+#include "base/request.h"
 #include "base/statistics.h"
+#include "base/timer.h"
+#include "services/service.h"
 #include "threads/request_worker.h"
 #include "threads/pool.h"
 #include "threads/work_item_queue.h"
-#include "threads/worker.h"
 
 using boost::bind;
 using boost::scoped_ptr;
 using boost::thread;
-using std::string;
+using boost::detail::atomic_count;
+using std::ostream;
+using std::vector;
 
 using s3::base::config;
+using s3::base::request;
 using s3::base::statistics;
+using s3::base::timer;
+using s3::services::service;
 using s3::threads::async_handle;
 using s3::threads::pool;
+using s3::threads::request_class;
+using s3::threads::request_worker;
 using s3::threads::work_item;
 using s3::threads::work_item_queue;
 
@@ -46,9 +58,28 @@ namespace
   BOOST_STATIC_ASSERT(s3::threads::PR_0 == 0);
   BOOST_STATIC_ASSERT(s3::threads::PR_REQ_0 == 1);
   BOOST_STATIC_ASSERT(s3::threads::PR_REQ_1 == 2);
+  BOOST_STATIC_ASSERT(s3::threads::RC_BACKGROUND < static_cast<int>(work_item_queue::MAX_PRIORITIES));
 
   const int POOL_COUNT = 3; // PR_0, PR_REQ_0, PR_REQ_1
-  const int NUM_THREADS_PER_POOL = 8;
+
+  // PR_0 items wait on PR_REQ_0 and PR_REQ_1 items, and PR_REQ_0 items wait
+  // on PR_REQ_1 items, so reserve threads accordingly (see work_item_queue)
+  const size_t RESERVED_THREADS[POOL_COUNT] = { 2, 1, 0 };
+
+  // try PR_REQ_0 first, as before, since it's where most requests go
+  const int CLASS_ORDER[POOL_COUNT] = { s3::threads::PR_REQ_0, s3::threads::PR_0, s3::threads::PR_REQ_1 };
+
+  // retire a thread once more than one has been idle for this many seconds
+  const int IDLE_SECONDS_BEFORE_RETIRING = 30;
+
+  atomic_count s_spawned(0), s_retired(0), s_respawned(0);
+  atomic_count s_inline_calls(0), s_inline_timeouts(0);
+  size_t s_peak_threads = 0, s_stolen = 0;
+
+  // for calls run on threads outside the pool. the priority is that of the
+  // call in progress, or -1 if there isn't one.
+  boost::thread_specific_ptr<request::ptr> s_inline_request;
+  boost::thread_specific_ptr<int> s_inline_priority;
 
   void sleep_one_second()
   {
@@ -63,68 +94,67 @@ namespace
   class _pool
   {
   public:
-    virtual ~_pool()
+    _pool()
+      : _next_lane(0),
+        _idle_seconds(0),
+        _done(false)
     {
-    }
+      _min_threads = config::get_min_threads();
+      _max_threads = config::get_max_threads();
 
-    virtual void post(const work_item::worker_function &fn, const async_handle::ptr &ah, int timeout_retries) = 0;
-  };
+      _queue.reset(new work_item_queue(
+        _max_threads,
+        vector<int>(CLASS_ORDER, CLASS_ORDER + POOL_COUNT),
+        vector<size_t>(RESERVED_THREADS, RESERVED_THREADS + POOL_COUNT)));
 
-  template <class worker_type, bool use_watchdog>
-  class _pool_impl : public _pool
-  {
-  public:
-    _pool_impl(const string &id)
-      : _queue(new work_item_queue()),
-        _id(id),
-        _respawn_counter(0),
-        _done(false)
-    {
-      if (use_watchdog)
-        _watchdog_thread.reset(new thread(bind(&_pool_impl::watchdog, this)));
+      for (size_t i = 0; i < _min_threads; i++)
+        spawn();
 
-      for (int i = 0; i < NUM_THREADS_PER_POOL; i++)
-        _threads.push_back(worker_type::create(_queue));
+      _watchdog_thread.reset(new thread(bind(&_pool::watchdog, this)));
     }
 
-    ~_pool_impl()
+    ~_pool()
     {
       _queue->abort();
       _done = true;
 
-      if (use_watchdog) {
-        // shut watchdog down first so it doesn't use _threads
-        _watchdog_thread->join();
-      }
+      // shut watchdog down first so it doesn't use _threads
+      _watchdog_thread->join();
 
       _threads.clear();
 
       // give the threads precisely one second to clean up (and print debug info), otherwise skip them and move on
       sleep_one_second();
 
-      if (use_watchdog)
-        statistics::write(
-          "thread pool",
-          _id,
-          "\n  respawn_counter: %i",
-          _respawn_counter);
+      s_stolen = _queue->get_stolen_count();
     }
 
-    virtual void post(const work_item::worker_function &fn, const async_handle::ptr &ah, int timeout_retries)
+    inline void post(const work_item &item)
     {
-      _queue->post(work_item(fn, ah, timeout_retries));
+      _queue->post(item);
     }
 
   private:
-    typedef std::list<typename worker_type::ptr> wt_list;
+    typedef std::list<request_worker::ptr> wt_list;
+
+    void spawn()
+    {
+      _queue->add_thread();
+      _threads.push_back(request_worker::create(_queue, _next_lane++ % _max_threads));
+
+      if (_queue->get_thread_count() > s_peak_threads)
+        s_peak_threads = _queue->get_thread_count();
+    }
 
     void watchdog()
     {
       while (!_done) {
         int respawn = 0;
 
-        for (typename wt_list::iterator itor = _threads.begin(); itor != _threads.end(); /* do nothing */) {
-          if (!(*itor)->check_timeout())
+        for (wt_list::iterator itor = _threads.begin(); itor != _threads.end(); /* do nothing */) {
+          if ((*itor)->is_stopped())
+            itor = _threads.erase(itor);
+          else if (!(*itor)->check_timeout())
             ++itor;
           else {
             respawn++;
@@ -132,10 +162,34 @@ namespace
           }
         }
 
-        for (int i = 0; i < respawn; i++)
-          _threads.push_back(worker_type::create(_queue));
+        // replacements for hung threads don't change the thread count
+        for (int i = 0; i < respawn; i++) {
+          ++s_respawned;
+          _threads.push_back(request_worker::create(_queue, _next_lane++ % _max_threads));
+        }
+
+        if (_queue->get_queued_count() > 0 && _queue->get_idle_count() == 0) {
+          _idle_seconds = 0;
+
+          if (_queue->get_thread_count() < _max_threads) {
+            ++s_spawned;
+            spawn();
+          }
+
+        } else if (_queue->get_idle_count() > 1) {
+          if (++_idle_seconds >= IDLE_SECONDS_BEFORE_RETIRING) {
+            _idle_seconds = 0;
+
+            if (_queue->get_thread_count() > _min_threads) {
+              ++s_retired;
+              _queue->retire_one();
+            }
+          }
+
+        } else {
+          _idle_seconds = 0;
+        }
 
-        _respawn_counter += respawn;
         sleep_one_second();
       }
     }
@@ -143,37 +197,157 @@ namespace
     work_item_queue::ptr _queue;
     wt_list _threads;
     scoped_ptr<thread> _watchdog_thread;
-    string _id;
-    int _respawn_counter;
+    size_t _min_threads, _max_threads, _next_lane;
+    int _idle_seconds;
     bool _done;
   };
 
-  _pool *s_pools[POOL_COUNT];
+  _pool *s_pool = NULL;
+
+  void statistics_writer(ostream *o)
+  {
+    *o <<
+      "thread pool:\n"
+      "  peak threads: " << s_peak_threads << "\n"
+      "  threads spawned: " << s_spawned << "\n"
+      "  threads retired: " << s_retired << "\n"
+      "  hung threads respawned: " << s_respawned << "\n"
+      "  items stolen: " << s_stolen << "\n"
+      "  calls run inline: " << s_inline_calls << "\n"
+      "  inline calls timed out: " << s_inline_timeouts << "\n";
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
 }
 
 void pool::init()
 {
-  s_pools[PR_0] = new _pool_impl<worker, false>("PR_0");
-  s_pools[PR_REQ_0] = new _pool_impl<request_worker, true>("PR_REQ_0");
-  s_pools[PR_REQ_1] = new _pool_impl<request_worker, true>("PR_REQ_1");
+  s_pool = new _pool();
 }
 
 void pool::terminate()
 {
-  for (int i = 0; i < POOL_COUNT; i++)
-    delete s_pools[i];
+  delete s_pool;
+  s_pool = NULL;
+
+  // other threads drop theirs when they exit, but this one may not exit
+  // until curl has been cleaned up
+  s_inline_request.reset();
+  s_inline_priority.reset();
+}
+
+request_class pool::get_current_request_class()
+{
+  int priority = request_worker::get_current_priority();
+
+  if (priority < 0 && s_inline_priority.get())
+    priority = *s_inline_priority;
+
+  return (priority < 0) ? RC_INTERACTIVE : static_cast<request_class>(priority);
+}
+
+int pool::internal_call(
+  pool_id p,
+  request_class rc,
+  const work_item::worker_function &fn,
+  int timeout_retries)
+{
+  int r = 0;
+
+  if (
+    !config::get_inline_synchronous_calls() ||
+    request_worker::get_current_priority() >= 0 ||
+    (s_inline_priority.get() && *s_inline_priority >= 0)
+  ) {
+    return post(p, rc, fn, timeout_retries)->wait();
+  }
+
+  if (rc == RC_INHERIT)
+    rc = RC_INTERACTIVE;
+
+  if (!s_inline_request.get()) {
+    s_inline_request.reset(new request::ptr(new request()));
+    s_inline_priority.reset(new int(-1));
+
+    (*s_inline_request)->set_hook(service::get_request_hook());
+
+    // nothing watches this thread, so curl has to enforce the timeout
+    (*s_inline_request)->set_curl_timeout(true);
+  }
+
+  const request::ptr &req = *s_inline_request;
+
+  if (timeout_retries == DEFAULT_TIMEOUT_RETRIES)
+    timeout_retries = config::get_timeout_retries();
+
+  req->set_abort_check(request::abort_check_fn());
+
+  ++s_inline_calls;
+  *s_inline_priority = rc;
+
+  // curl doesn't retry requests that time out here, so, as with a posted
+  // item, the function is run again up to timeout_retries times
+  while (true) {
+    bool timed_out = false;
+
+    // a timeout left over from an earlier call isn't this call's
+    req->reset_current_run_time();
+    req->clear_last_result();
+
+    try {
+      r = fn(req);
+      timed_out = req->did_time_out();
+
+    } catch (const std::exception &e) {
+      if (req->did_time_out()) {
+        timed_out = true;
+
+      } else {
+        S3_LOG(LOG_WARNING, "pool::internal_call", "caught exception: %s\n", e.what());
+        r = -ECANCELED;
+      }
+
+    } catch (...) {
+      S3_LOG(LOG_WARNING, "pool::internal_call", "caught unknown exception.\n");
+      r = -ECANCELED;
+    }
+
+    if (!timed_out)
+      break;
+
+    ++s_inline_timeouts;
+
+    if (timeout_retries-- <= 0) {
+      r = -ETIMEDOUT;
+      break;
+    }
+  }
+
+  *s_inline_priority = -1;
+
+  return r;
 }
 
 void pool::internal_post(
   pool_id p,
+  request_class rc,
   const work_item::worker_function &fn,
   const async_handle::ptr &ah,
-  int timeout_retries)
+  int timeout_retries,
+  double deadline_in_s,
+  const work_item::wanted_function &is_wanted)
 {
   assert(p < POOL_COUNT);
 
-  s_pools[p]->post(
+  if (rc == RC_INHERIT)
+    rc = get_current_request_class();
+
+  s_pool->post(work_item(
     fn, 
     ah,
-    (timeout_retries == DEFAULT_TIMEOUT_RETRIES) ? config::get_timeout_retries() : timeout_retries);
+    (timeout_retries == DEFAULT_TIMEOUT_RETRIES) ? config::get_timeout_retries() : timeout_retries,
+    p,
+    rc,
+    (deadline_in_s > 0) ? timer::get_current_time() + deadline_in_s : 0,
+    is_wanted));
 }
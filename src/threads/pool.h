@@ -36,6 +36,21 @@ namespace s3
       PR_REQ_1 = 2
     };
 
+    // pool_id says what an item may wait on; request_class says how soon it
+    // should run. interactive items always go first.
+    enum request_class
+    {
+      RC_INTERACTIVE = 0, // metadata operations that a user is waiting on
+      RC_TRANSFER = 1,    // uploads and downloads that a user started
+      RC_PREFETCH = 2,    // speculative work (see post_speculative())
+      RC_BACKGROUND = 3,  // work that nobody is waiting on
+
+      // the class of the item running on the calling thread, or
+      // RC_INTERACTIVE if the caller isn't a pool thread (i.e., it's a FUSE
+      // thread)
+      RC_INHERIT = -1
+    };
+
     class pool
     {
     public:
@@ -46,14 +61,25 @@ namespace s3
       static void init();
       static void terminate();
 
+      static request_class get_current_request_class();
+
+      inline static wait_async_handle::ptr post(
+        pool_id p,
+        const worker_function &fn,
+        int timeout_retries = DEFAULT_TIMEOUT_RETRIES)
+      {
+        return post(p, RC_INHERIT, fn, timeout_retries);
+      }
+
       inline static wait_async_handle::ptr post(
         pool_id p,
+        request_class rc,
         const worker_function &fn,
         int timeout_retries = DEFAULT_TIMEOUT_RETRIES)
       {
         wait_async_handle::ptr ah(new wait_async_handle());
 
-        internal_post(p, fn, ah, timeout_retries);
+        internal_post(p, rc, fn, ah, timeout_retries);
 
         return ah;
       }
@@ -63,20 +89,62 @@ namespace s3
         const worker_function &fn, 
         const callback_async_handle::callback_function &cb,
         int timeout_retries = DEFAULT_TIMEOUT_RETRIES)
+      {
+        post(p, RC_INHERIT, fn, cb, timeout_retries);
+      }
+
+      inline static void post(
+        pool_id p,
+        request_class rc,
+        const worker_function &fn, 
+        const callback_async_handle::callback_function &cb,
+        int timeout_retries = DEFAULT_TIMEOUT_RETRIES)
       {
         internal_post(
           p,
+          rc,
           fn,
           async_handle::ptr(new callback_async_handle(cb)),
           timeout_retries);
       }
 
+      // runs "fn" as RC_PREFETCH, unless it hasn't started "deadline_in_s"
+      // seconds from now, or "is_wanted" (if set) returns false just before
+      // it would start, in which case it's dropped
+      inline static void post_speculative(
+        pool_id p,
+        const worker_function &fn,
+        double deadline_in_s,
+        const work_item::wanted_function &is_wanted = work_item::wanted_function())
+      {
+        internal_post(
+          p,
+          RC_PREFETCH,
+          fn,
+          async_handle::ptr(new wait_async_handle()),
+          DEFAULT_TIMEOUT_RETRIES,
+          deadline_in_s,
+          is_wanted);
+      }
+
+      // calls from threads outside the pool (i.e., FUSE threads) run "fn" on
+      // the calling thread, with a request of the thread's own, unless
+      // inline_synchronous_calls is off or the thread is already running one
+      inline static int call(
+        pool_id p, 
+        const worker_function &fn, 
+        int timeout_retries = DEFAULT_TIMEOUT_RETRIES)
+      {
+        return internal_call(p, RC_INHERIT, fn, timeout_retries);
+      }
+
       inline static int call(
         pool_id p, 
+        request_class rc,
         const worker_function &fn, 
         int timeout_retries = DEFAULT_TIMEOUT_RETRIES)
       {
-        return post(p, fn, timeout_retries)->wait();
+        return internal_call(p, rc, fn, timeout_retries);
       }
 
       inline static void call_async(
@@ -88,11 +156,21 @@ namespace s3
       }
 
     private:
+      static int internal_call(
+        pool_id p,
+        request_class rc,
+        const worker_function &fn,
+        int timeout_retries);
+
+      // "deadline_in_s" is relative to now, and 0 means no deadline
       static void internal_post(
         pool_id p, 
+        request_class rc,
         const worker_function &fn, 
         const async_handle::ptr &ah,
-        int timeout_retries);
+        int timeout_retries,
+        double deadline_in_s = 0,
+        const work_item::wanted_function &is_wanted = work_item::wanted_function());
     };
   }
 }
@@ -49,7 +49,9 @@ namespace
   double s_total_fn_time = 0.0;
 
   mutex s_stats_mutex;
-  atomic_count s_reposted_items(0);
+  atomic_count s_reposted_items(0), s_dropped_items(0);
+
+  boost::thread_specific_ptr<int> s_current_priority;
 
   void statistics_writer(ostream *o)
   {
@@ -60,17 +62,20 @@ namespace
       "  total request time: " << setprecision(3) << s_total_req_time << " s\n"
       "  total function time: " << s_total_fn_time << " s\n"
       "  request wait: " << setprecision(2) << s_total_req_time / s_total_fn_time * 100.0 << " %\n"
-      "  reposted items: " << s_reposted_items << "\n";
+      "  reposted items: " << s_reposted_items << "\n"
+      "  dropped speculative items: " << s_dropped_items << "\n";
   }
 
   statistics::writers::entry s_writer(statistics_writer, 0);
 }
 
-request_worker::request_worker(const work_item_queue::ptr &queue)
+request_worker::request_worker(const work_item_queue::ptr &queue, size_t lane)
   : _request(new request()),
     _time_in_function(0.),
     _time_in_request(0.),
-    _queue(queue)
+    _lane(lane),
+    _queue(queue),
+    _stopped(false)
 {
   _request->set_hook(service::get_request_hook());
 }
@@ -85,6 +90,13 @@ request_worker::~request_worker()
   }
 }
 
+int request_worker::get_current_priority()
+{
+  int *p = s_current_priority.get();
+
+  return p ? *p : -1;
+}
+
 bool request_worker::check_timeout()
 {
   mutex::scoped_lock lock(_mutex);
@@ -99,6 +111,10 @@ bool request_worker::check_timeout()
       _current_item.get_ah()->complete(-ETIMEDOUT);
     }
 
+    // this thread will be replaced, so the item no longer holds it
+    if (queue)
+      queue->on_item_done(_current_item);
+
     // prevent worker() from continuing
     _queue.reset();
     _current_item = work_item();
@@ -111,6 +127,8 @@ bool request_worker::check_timeout()
 
 void request_worker::work()
 {
+  s_current_priority.reset(new int(-1));
+
   while (true) {
     mutex::scoped_lock lock(_mutex);
     work_item_queue::ptr queue;
@@ -129,12 +147,23 @@ void request_worker::work()
     if (!queue)
       break;
 
-    item = queue->get_next();
-    queue.reset();
+    item = queue->get_next(_lane);
 
     if (!item.is_valid())
       break;
 
+    if (item.is_stale(timer::get_current_time())) {
+      ++s_dropped_items;
+
+      item.get_ah()->complete(-ECANCELED);
+      queue->on_item_done(item);
+
+      continue;
+    }
+
+    queue.reset();
+    *s_current_priority = item.get_priority();
+
     lock.lock();
     _current_item = item;
     lock.unlock();
@@ -144,6 +173,7 @@ void request_worker::work()
 
       start_time = timer::get_current_time();
       _request->reset_current_run_time();
+      _request->set_abort_check(request::abort_check_fn());
 
       r = item.get_function()(_request);
 
@@ -166,9 +196,23 @@ void request_worker::work()
       _current_item.get_ah()->complete(r);
 
       _current_item = work_item();
+      queue = _queue.lock();
+    }
+
+    lock.unlock();
+
+    if (queue) {
+      queue->on_item_done(item);
+      queue.reset();
     }
   }
 
+  {
+    mutex::scoped_lock lock(_mutex);
+
+    _stopped = true;
+  }
+
   // the boost::thread in _thread holds a shared_ptr to this, and will keep it from being destructed
   _thread.reset();
 }
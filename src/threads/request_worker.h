@@ -44,9 +44,11 @@ namespace s3
     public:
       typedef boost::shared_ptr<request_worker> ptr;
 
-      static ptr create(const boost::shared_ptr<work_item_queue> &queue)
+      // "lane" is the lane of the queue that this worker takes items from
+      // first
+      static ptr create(const boost::shared_ptr<work_item_queue> &queue, size_t lane)
       {
-        ptr wt(new request_worker(queue));
+        ptr wt(new request_worker(queue, lane));
 
         // passing "wt", a shared_ptr, for "this" keeps the object alive so long as worker() hasn't returned
         wt->_thread.reset(new boost::thread(boost::bind(&request_worker::work, wt)));
@@ -54,12 +56,24 @@ namespace s3
         return wt;
       }
 
+      // the priority of the item running on the calling thread, or -1 if the
+      // caller isn't a request_worker thread
+      static int get_current_priority();
+
       ~request_worker();
 
       bool check_timeout(); // return true if thread has hanged
 
+      // true once the thread has exited (e.g., because it was retired)
+      inline bool is_stopped()
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+
+        return _stopped;
+      }
+
     private:
-      request_worker(const boost::shared_ptr<work_item_queue> &queue);
+      request_worker(const boost::shared_ptr<work_item_queue> &queue, size_t lane);
 
       void work();
 
@@ -67,10 +81,12 @@ namespace s3
       boost::shared_ptr<boost::thread> _thread;
       boost::shared_ptr<base::request> _request;
       double _time_in_function, _time_in_request;
+      size_t _lane;
 
       // access controlled by _mutex
       boost::weak_ptr<work_item_queue> _queue;
       work_item _current_item;
+      bool _stopped;
     };
   }
 }
@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+
+#include "threads/hedge_policy.h"
+
+using s3::threads::hedge_policy;
+
+TEST(hedge_policy, disabled)
+{
+  hedge_policy no_percentile(0, 10), no_hedges(50, 0);
+
+  for (int i = 0; i < 10; i++) {
+    no_percentile.on_part_succeeded(1.0, false, false);
+    no_hedges.on_part_succeeded(1.0, false, false);
+  }
+
+  EXPECT_FALSE(no_percentile.can_hedge());
+  EXPECT_FALSE(no_hedges.can_hedge());
+}
+
+TEST(hedge_policy, min_samples)
+{
+  hedge_policy p(50, 10);
+
+  for (int i = 0; i < 3; i++) {
+    p.on_part_succeeded(1.0, false, false);
+    EXPECT_FALSE(p.can_hedge());
+  }
+
+  p.on_part_succeeded(1.0, false, false);
+
+  EXPECT_TRUE(p.can_hedge());
+  EXPECT_DOUBLE_EQ(1.0, p.get_threshold());
+}
+
+TEST(hedge_policy, percentile)
+{
+  hedge_policy p50(50, 10), p90(90, 10), p99(99, 10);
+
+  // out of order, so that the policy has to sort them
+  for (int i = 10; i >= 1; i--) {
+    p50.on_part_succeeded(i, false, false);
+    p90.on_part_succeeded(i, false, false);
+    p99.on_part_succeeded(i, false, false);
+  }
+
+  // index = size * percentile / 100, capped at the last sample
+  EXPECT_DOUBLE_EQ(6.0, p50.get_threshold());
+  EXPECT_DOUBLE_EQ(10.0, p90.get_threshold());
+  EXPECT_DOUBLE_EQ(10.0, p99.get_threshold());
+}
+
+TEST(hedge_policy, min_threshold)
+{
+  hedge_policy p(50, 10);
+
+  for (int i = 0; i < 10; i++)
+    p.on_part_succeeded(0.01, false, false);
+
+  EXPECT_TRUE(p.can_hedge());
+  EXPECT_DOUBLE_EQ(0.5, p.get_threshold());
+}
+
+TEST(hedge_policy, max_hedges)
+{
+  hedge_policy p(50, 2);
+
+  for (int i = 0; i < 4; i++)
+    p.on_part_succeeded(1.0, false, false);
+
+  EXPECT_TRUE(p.can_hedge());
+  p.on_hedge_posted();
+
+  EXPECT_TRUE(p.can_hedge());
+  p.on_hedge_posted();
+
+  EXPECT_FALSE(p.can_hedge());
+
+  // more samples don't restore the budget
+  p.on_part_succeeded(1.0, true, true);
+  EXPECT_FALSE(p.can_hedge());
+}
@@ -0,0 +1,72 @@
+#include <errno.h>
+
+#include <vector>
+#include <boost/bind.hpp>
+#include <gtest/gtest.h>
+
+#include "base/request.h"
+#include "threads/io_engine.h"
+
+using std::vector;
+
+using s3::base::request;
+using s3::threads::io_engine;
+using s3::threads::wait_async_handle;
+
+TEST(io_engine, not_running)
+{
+  request::ptr r(new request());
+
+  r->init(s3::base::HTTP_GET);
+  r->set_url("http://www.google.com/");
+
+  EXPECT_EQ(-ECANCELED, io_engine::post(r, 30)->wait());
+}
+
+TEST(io_engine, bad_url)
+{
+  request::ptr r(new request());
+
+  io_engine::init();
+
+  r->init(s3::base::HTTP_GET);
+  r->set_url("some:bad:url");
+
+  EXPECT_EQ(-ECANCELED, io_engine::post(r, 30)->wait());
+
+  io_engine::terminate();
+}
+
+TEST(io_engine, concurrent_requests)
+{
+  const int COUNT = 20;
+
+  vector<request::ptr> requests;
+  vector<wait_async_handle::ptr> handles;
+
+  io_engine::init();
+
+  for (int i = 0; i < COUNT; i++) {
+    request::ptr r(new request());
+
+    r->init(s3::base::HTTP_GET);
+    r->set_url((i % 2) ? "http://www.google.com/" : "http://www.google.com/this_shouldnt_exist");
+
+    requests.push_back(r);
+    handles.push_back(io_engine::post(r, 30));
+  }
+
+  for (int i = 0; i < COUNT; i++) {
+    ASSERT_EQ(0, handles[i]->wait());
+    EXPECT_EQ((i % 2) ? s3::base::HTTP_SC_OK : s3::base::HTTP_SC_NOT_FOUND, requests[i]->get_response_code());
+  }
+
+  // requests can be run again once they're done
+  requests[0]->init(s3::base::HTTP_GET);
+  requests[0]->set_url("http://www.google.com/");
+
+  ASSERT_EQ(0, io_engine::post(requests[0], 30)->wait());
+  EXPECT_EQ(s3::base::HTTP_SC_OK, requests[0]->get_response_code());
+
+  io_engine::terminate();
+}
@@ -0,0 +1,110 @@
+#include <errno.h>
+
+#include <vector>
+#include <boost/detail/atomic_count.hpp>
+#include <gtest/gtest.h>
+
+#include "base/request.h"
+#include "base/timer.h"
+#include "threads/parallel_work_queue.h"
+#include "threads/pool.h"
+
+using boost::detail::atomic_count;
+using std::vector;
+
+using s3::base::request;
+using s3::base::timer;
+using s3::threads::parallel_work_queue;
+using s3::threads::pool;
+
+namespace
+{
+  const int PART_COUNT = 8;
+  const int SLOW_PART = 5;
+
+  struct part
+  {
+    int id;
+    int copy; // which copy of the part last wrote this
+  };
+
+  atomic_count s_slow_copies(0);
+  bool s_loser_aborted = false, s_loser_done = false;
+
+  int process_part(const request::ptr &req, part *p)
+  {
+    int copy;
+
+    if (p->id != SLOW_PART) {
+      timer::sleep_for(0.02);
+      p->copy = 1;
+
+      return 0;
+    }
+
+    copy = ++s_slow_copies;
+
+    if (copy > 1) {
+      p->copy = copy;
+
+      return 0;
+    }
+
+    // the original copy stalls until it's aborted, and then takes a while
+    // longer to clean up
+    for (int i = 0; i < 1000 && !req->is_abort_requested(); i++)
+      timer::sleep_for(0.01);
+
+    s_loser_aborted = req->is_abort_requested();
+    p->copy = copy;
+
+    timer::sleep_for(0.3);
+    s_loser_done = true;
+
+    return -ECANCELED;
+  }
+}
+
+TEST(parallel_work_queue, hedge_straggler)
+{
+  vector<part> parts(PART_COUNT);
+  int r;
+
+  for (int i = 0; i < PART_COUNT; i++) {
+    parts[i].id = i;
+    parts[i].copy = 0;
+  }
+
+  pool::init();
+
+  {
+    parallel_work_queue<part> pwq(
+      parts.begin(),
+      parts.end(),
+      process_part,
+      process_part,
+      0,
+      PART_COUNT);
+
+    pwq.enable_hedging();
+    r = pwq.process();
+  }
+
+  // process() only returns once the losing copy is done
+  EXPECT_TRUE(s_loser_done);
+
+  pool::terminate();
+
+  EXPECT_EQ(0, r);
+  EXPECT_EQ(2, s_slow_copies);
+  EXPECT_TRUE(s_loser_aborted);
+
+  // the winning copy's part is the one that's kept
+  EXPECT_EQ(2, parts[SLOW_PART].copy);
+
+  for (int i = 0; i < PART_COUNT; i++) {
+    if (i != SLOW_PART) {
+      EXPECT_EQ(1, parts[i].copy);
+    }
+  }
+}
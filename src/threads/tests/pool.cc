@@ -0,0 +1,200 @@
+#include <errno.h>
+
+#include <string>
+#include <vector>
+#include <boost/detail/atomic_count.hpp>
+#include <boost/thread.hpp>
+#include <gtest/gtest.h>
+
+#include "base/request.h"
+#include "base/timer.h"
+#include "threads/pool.h"
+#include "threads/tests/silent_server.h"
+#include "threads/tests/test_config.h"
+
+using boost::thread;
+using boost::detail::atomic_count;
+using std::string;
+using std::vector;
+
+using s3::base::request;
+using s3::base::timer;
+using s3::threads::pool;
+using s3::threads::request_class;
+using s3::threads::wait_async_handle;
+using s3::threads::tests::silent_server;
+using s3::threads::tests::test_config;
+
+namespace
+{
+  atomic_count s_leaves(0);
+
+  int leaf(const request::ptr &)
+  {
+    timer::sleep_for(0.01);
+    ++s_leaves;
+
+    return 0;
+  }
+
+  int middle(const request::ptr &)
+  {
+    for (int i = 0; i < 2; i++) {
+      int r = pool::call(s3::threads::PR_REQ_1, leaf);
+
+      if (r)
+        return r;
+    }
+
+    return 0;
+  }
+
+  int top(const request::ptr &)
+  {
+    for (int i = 0; i < 2; i++) {
+      int r = pool::call(s3::threads::PR_REQ_0, middle);
+
+      if (r)
+        return r;
+    }
+
+    return 0;
+  }
+
+  struct call_info
+  {
+    thread::id thread_id;
+    request_class rc;
+  };
+
+  int record(const request::ptr &, call_info *info)
+  {
+    info->thread_id = boost::this_thread::get_id();
+    info->rc = pool::get_current_request_class();
+
+    return 0;
+  }
+
+  int record_nested(const request::ptr &req, call_info *outer, call_info *inner)
+  {
+    record(req, outer);
+
+    return pool::call(s3::threads::PR_REQ_1, boost::bind(record, _1, inner));
+  }
+
+  int hang(const request::ptr &req, const string &url, atomic_count *calls)
+  {
+    ++(*calls);
+
+    req->init(s3::base::HTTP_GET);
+    req->set_url(url);
+    req->run(1);
+
+    return 0;
+  }
+
+  int count(const request::ptr &, atomic_count *calls)
+  {
+    ++(*calls);
+
+    return 0;
+  }
+
+  void wait_all(const vector<wait_async_handle::ptr> &handles, vector<int> *results)
+  {
+    for (size_t i = 0; i < handles.size(); i++)
+      results->push_back(handles[i]->wait());
+  }
+}
+
+TEST(pool, nested_calls_at_min_threads)
+{
+  const int COUNT = 32;
+
+  vector<wait_async_handle::ptr> handles;
+  vector<int> results;
+
+  test_config::load(
+    "min_threads=4\n"
+    "max_threads=4\n");
+
+  pool::init();
+
+  // far more PR_0 items than threads, each waiting on PR_REQ_0 items that
+  // wait on PR_REQ_1 items
+  for (int i = 0; i < COUNT; i++)
+    handles.push_back(pool::post(s3::threads::PR_0, top));
+
+  {
+    thread t(boost::bind(wait_all, handles, &results));
+
+    ASSERT_TRUE(t.timed_join(boost::posix_time::seconds(60)));
+  }
+
+  pool::terminate();
+
+  ASSERT_EQ(static_cast<size_t>(COUNT), results.size());
+
+  for (int i = 0; i < COUNT; i++)
+    EXPECT_EQ(0, results[i]);
+
+  EXPECT_EQ(COUNT * 4, s_leaves);
+}
+
+TEST(pool, inline_calls)
+{
+  call_info outer, inner;
+
+  test_config::load(
+    "min_threads=4\n"
+    "max_threads=4\n"
+    "inline_synchronous_calls=true\n");
+
+  pool::init();
+
+  // runs here, in the class it was given, or RC_INTERACTIVE by default
+  EXPECT_EQ(0, pool::call(s3::threads::PR_REQ_0, s3::threads::RC_BACKGROUND, boost::bind(record, _1, &outer)));
+  EXPECT_EQ(boost::this_thread::get_id(), outer.thread_id);
+  EXPECT_EQ(s3::threads::RC_BACKGROUND, outer.rc);
+
+  EXPECT_EQ(0, pool::call(s3::threads::PR_REQ_0, boost::bind(record, _1, &outer)));
+  EXPECT_EQ(boost::this_thread::get_id(), outer.thread_id);
+  EXPECT_EQ(s3::threads::RC_INTERACTIVE, outer.rc);
+
+  // calls made from an inline call can't use this thread's request, so they
+  // go to the pool, but keep the class of the call that made them
+  EXPECT_EQ(0, pool::call(s3::threads::PR_REQ_0, s3::threads::RC_TRANSFER, boost::bind(record_nested, _1, &outer, &inner)));
+  EXPECT_EQ(boost::this_thread::get_id(), outer.thread_id);
+  EXPECT_NE(boost::this_thread::get_id(), inner.thread_id);
+  EXPECT_EQ(s3::threads::RC_TRANSFER, outer.rc);
+  EXPECT_EQ(s3::threads::RC_TRANSFER, inner.rc);
+
+  pool::terminate();
+}
+
+TEST(pool, inline_call_timeout)
+{
+  silent_server server;
+  atomic_count calls(0), calls_no_retries(0), calls_no_request(0);
+
+  test_config::load(
+    "min_threads=4\n"
+    "max_threads=4\n"
+    "inline_synchronous_calls=true\n"
+    "timeout_retries=2\n");
+
+  pool::init();
+
+  // curl's timeout isn't retried by the request, only by the call
+  EXPECT_EQ(-ETIMEDOUT, pool::call(s3::threads::PR_REQ_0, boost::bind(hang, _1, server.get_url(), &calls)));
+  EXPECT_EQ(3, calls);
+
+  EXPECT_EQ(-ETIMEDOUT, pool::call(s3::threads::PR_REQ_0, boost::bind(hang, _1, server.get_url(), &calls_no_retries), 0));
+  EXPECT_EQ(1, calls_no_retries);
+
+  // the timeout doesn't stick to this thread's request
+  EXPECT_EQ(0, pool::call(s3::threads::PR_REQ_0, boost::bind(count, _1, &calls_no_request)));
+  EXPECT_EQ(1, calls_no_request);
+
+  pool::terminate();
+}
@@ -0,0 +1,56 @@
+#ifndef S3_THREADS_TESTS_SILENT_SERVER_H
+#define S3_THREADS_TESTS_SILENT_SERVER_H
+
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <boost/lexical_cast.hpp>
+
+namespace s3
+{
+  namespace threads
+  {
+    namespace tests
+    {
+      // accepts connections (into the backlog) but never answers them
+      class silent_server
+      {
+      public:
+        inline silent_server()
+        {
+          struct sockaddr_in addr;
+          socklen_t len = sizeof(addr);
+
+          _fd = socket(AF_INET, SOCK_STREAM, 0);
+
+          memset(&addr, 0, sizeof(addr));
+          addr.sin_family = AF_INET;
+          addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+          ::bind(_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+          listen(_fd, 16);
+          getsockname(_fd, reinterpret_cast<struct sockaddr *>(&addr), &len);
+
+          _url = "http://127.0.0.1:" + boost::lexical_cast<std::string>(ntohs(addr.sin_port)) + "/";
+        }
+
+        // resets any connections, so that requests to the server fail
+        inline ~silent_server()
+        {
+          close(_fd);
+        }
+
+        inline const std::string & get_url() const { return _url; }
+
+      private:
+        int _fd;
+        std::string _url;
+      };
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef S3_THREADS_TESTS_TEST_CONFIG_H
+#define S3_THREADS_TESTS_TEST_CONFIG_H
+
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+
+#include "base/config.h"
+
+namespace s3
+{
+  namespace threads
+  {
+    namespace tests
+    {
+      class test_config
+      {
+      public:
+        // "settings" holds "key=value" lines. options not given keep
+        // whatever value they had, so tests should set everything they
+        // depend on.
+        inline static void load(const std::string &settings)
+        {
+          const char *TEMP_FILE = "/tmp/s3fuse.threads-test.conf";
+
+          {
+            std::ofstream f(TEMP_FILE, std::ofstream::out | std::ofstream::trunc);
+
+            f << "bucket_name=test\n";
+
+            #ifndef FIXED_SERVICE
+              f << "service=test\n";
+            #endif
+
+            f << settings;
+          }
+
+          base::config::init(TEMP_FILE);
+
+          unlink(TEMP_FILE);
+        }
+      };
+    }
+  }
+}
+
+#endif
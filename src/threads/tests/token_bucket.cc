@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+
+#include "threads/token_bucket.h"
+
+using s3::threads::token_bucket;
+
+TEST(token_bucket, no_limit)
+{
+  token_bucket b;
+
+  b.init(0, 100.0);
+  b.take(1000000);
+
+  EXPECT_TRUE(b.is_open(100.0));
+  EXPECT_EQ(0, b.get_wait_time());
+}
+
+TEST(token_bucket, hold_back)
+{
+  token_bucket b;
+
+  b.init(1000, 100.0);
+
+  // a part larger than what's left still goes through
+  EXPECT_TRUE(b.is_open(100.0));
+  b.take(3000);
+
+  EXPECT_FALSE(b.is_open(100.0));
+  EXPECT_DOUBLE_EQ(2.0, b.get_wait_time());
+
+  EXPECT_FALSE(b.is_open(101.5));
+  EXPECT_DOUBLE_EQ(0.5, b.get_wait_time());
+
+  EXPECT_TRUE(b.is_open(102.1));
+  EXPECT_EQ(0, b.get_wait_time());
+}
+
+TEST(token_bucket, burst)
+{
+  token_bucket b;
+
+  b.init(1000, 100.0);
+  b.take(1000);
+
+  // a long idle period only refills one second's worth
+  EXPECT_TRUE(b.is_open(200.0));
+  b.take(1000);
+
+  EXPECT_FALSE(b.is_open(200.0));
+  b.take(500);
+
+  EXPECT_DOUBLE_EQ(0.5, b.get_wait_time());
+}
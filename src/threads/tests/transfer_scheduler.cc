@@ -0,0 +1,320 @@
+#include <errno.h>
+
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
+#include <gtest/gtest.h>
+
+#include "base/request.h"
+#include "base/timer.h"
+#include "threads/pool.h"
+#include "threads/transfer_scheduler.h"
+#include "threads/tests/test_config.h"
+
+using boost::condition;
+using boost::mutex;
+using std::vector;
+
+using s3::base::request;
+using s3::base::timer;
+using s3::threads::pool;
+using s3::threads::transfer_scheduler;
+using s3::threads::wait_async_handle;
+using s3::threads::tests::test_config;
+
+namespace
+{
+  const size_t MB = 1024 * 1024;
+
+  // parts record the order in which they ran, and how many ran at once
+  class recorder
+  {
+  public:
+    inline recorder()
+      : _running(0),
+        _max_running(0),
+        _blocked(false)
+    {
+    }
+
+    int run(const request::ptr &, int id, double duration)
+    {
+      {
+        mutex::scoped_lock lock(_mutex);
+
+        _order.push_back(id);
+
+        if (++_running > _max_running)
+          _max_running = _running;
+      }
+
+      timer::sleep_for(duration);
+
+      mutex::scoped_lock lock(_mutex);
+
+      _running--;
+
+      return 0;
+    }
+
+    // holds its slot until unblock() is called
+    int block(const request::ptr &)
+    {
+      mutex::scoped_lock lock(_mutex);
+
+      _blocked = true;
+      _condition.notify_all();
+
+      while (_blocked)
+        _condition.wait(lock);
+
+      return 0;
+    }
+
+    void wait_until_blocked()
+    {
+      mutex::scoped_lock lock(_mutex);
+
+      while (!_blocked)
+        _condition.wait(lock);
+    }
+
+    void unblock()
+    {
+      mutex::scoped_lock lock(_mutex);
+
+      _blocked = false;
+      _condition.notify_all();
+    }
+
+    inline const vector<int> & get_order() const { return _order; }
+    inline int get_max_running() const { return _max_running; }
+
+  private:
+    mutex _mutex;
+    condition _condition;
+    vector<int> _order;
+    int _running, _max_running;
+    bool _blocked;
+  };
+
+  void start(const char *settings)
+  {
+    test_config::load(settings);
+
+    pool::init();
+    transfer_scheduler::init();
+  }
+
+  void stop()
+  {
+    transfer_scheduler::terminate();
+    pool::terminate();
+  }
+}
+
+TEST(transfer_scheduler, small_transfers_go_first)
+{
+  const int LARGE = 0, SMALL = 1;
+
+  recorder rec;
+  transfer_scheduler::session::ptr blocker, large, small;
+  vector<wait_async_handle::ptr> handles;
+  wait_async_handle::ptr blocker_ah;
+
+  start(
+    "max_transfer_parts_in_progress=1\n"
+    "download_rate_limit_in_kb_s=0\n"
+    "upload_rate_limit_in_kb_s=0\n");
+
+  blocker = transfer_scheduler::create_session(transfer_scheduler::TD_DOWNLOAD, MB);
+  large = transfer_scheduler::create_session(transfer_scheduler::TD_DOWNLOAD, 64 * MB);
+  small = transfer_scheduler::create_session(transfer_scheduler::TD_DOWNLOAD, MB);
+
+  blocker_ah = blocker->post(boost::bind(&recorder::block, &rec, _1), MB);
+  rec.wait_until_blocked();
+
+  // the large transfer's parts are queued first
+  for (int i = 0; i < 4; i++)
+    handles.push_back(large->post(boost::bind(&recorder::run, &rec, _1, LARGE, 0.0), 16 * MB));
+
+  for (int i = 0; i < 4; i++)
+    handles.push_back(small->post(boost::bind(&recorder::run, &rec, _1, SMALL, 0.0), MB / 4));
+
+  rec.unblock();
+
+  EXPECT_EQ(0, blocker_ah->wait());
+
+  for (size_t i = 0; i < handles.size(); i++)
+    EXPECT_EQ(0, handles[i]->wait());
+
+  stop();
+
+  // both start at the same virtual time, so the large transfer gets one
+  // part in, but its finish tag is far enough out that the small transfer
+  // runs to completion before the large transfer's second part
+  ASSERT_EQ(8u, rec.get_order().size());
+  EXPECT_EQ(LARGE, rec.get_order()[0]);
+
+  for (int i = 1; i <= 4; i++)
+    EXPECT_EQ(SMALL, rec.get_order()[i]) << "for part " << i;
+
+  for (int i = 5; i < 8; i++)
+    EXPECT_EQ(LARGE, rec.get_order()[i]) << "for part " << i;
+}
+
+TEST(transfer_scheduler, parts_in_progress_cap)
+{
+  recorder rec;
+  vector<transfer_scheduler::session::ptr> sessions;
+  vector<wait_async_handle::ptr> handles;
+
+  start(
+    "max_transfer_parts_in_progress=2\n"
+    "download_rate_limit_in_kb_s=0\n"
+    "upload_rate_limit_in_kb_s=0\n");
+
+  for (int i = 0; i < 4; i++)
+    sessions.push_back(transfer_scheduler::create_session(
+      (i % 2) ? transfer_scheduler::TD_UPLOAD : transfer_scheduler::TD_DOWNLOAD,
+      4 * MB));
+
+  for (int i = 0; i < 16; i++)
+    handles.push_back(sessions[i % 4]->post(boost::bind(&recorder::run, &rec, _1, i, 0.05), MB));
+
+  for (size_t i = 0; i < handles.size(); i++)
+    EXPECT_EQ(0, handles[i]->wait());
+
+  stop();
+
+  EXPECT_EQ(16u, rec.get_order().size());
+  EXPECT_EQ(2, rec.get_max_running());
+}
+
+TEST(transfer_scheduler, bandwidth_limit)
+{
+  recorder rec;
+  transfer_scheduler::session::ptr down, up;
+  wait_async_handle::ptr first, second, upload;
+  double start_time, second_time, upload_time;
+
+  start(
+    "max_transfer_parts_in_progress=4\n"
+    "download_rate_limit_in_kb_s=100\n"
+    "upload_rate_limit_in_kb_s=0\n");
+
+  down = transfer_scheduler::create_session(transfer_scheduler::TD_DOWNLOAD, 400 * 1024);
+  up = transfer_scheduler::create_session(transfer_scheduler::TD_UPLOAD, 400 * 1024);
+
+  start_time = timer::get_current_time();
+
+  // the first part empties the bucket and then some, so the second has to
+  // wait for it to refill
+  first = down->post(boost::bind(&recorder::run, &rec, _1, 0, 0.0), 200 * 1024);
+  second = down->post(boost::bind(&recorder::run, &rec, _1, 1, 0.0), 200 * 1024);
+
+  // uploads aren't limited, so aren't held back with the downloads
+  upload = up->post(boost::bind(&recorder::run, &rec, _1, 2, 0.0), 400 * 1024);
+
+  EXPECT_EQ(0, upload->wait());
+  upload_time = timer::get_current_time() - start_time;
+
+  EXPECT_EQ(0, first->wait());
+  EXPECT_EQ(0, second->wait());
+  second_time = timer::get_current_time() - start_time;
+
+  stop();
+
+  EXPECT_LT(upload_time, 0.5);
+  EXPECT_GT(second_time, 0.9);
+  EXPECT_LT(second_time, 2.0);
+}
+
+TEST(transfer_scheduler, terminate_cancels_queued_parts)
+{
+  recorder rec;
+  transfer_scheduler::session::ptr s;
+  vector<wait_async_handle::ptr> handles;
+  wait_async_handle::ptr blocker_ah;
+
+  start(
+    "max_transfer_parts_in_progress=1\n"
+    "download_rate_limit_in_kb_s=0\n"
+    "upload_rate_limit_in_kb_s=0\n");
+
+  s = transfer_scheduler::create_session(transfer_scheduler::TD_UPLOAD, 4 * MB);
+
+  blocker_ah = s->post(boost::bind(&recorder::block, &rec, _1), MB);
+  rec.wait_until_blocked();
+
+  for (int i = 0; i < 3; i++)
+    handles.push_back(s->post(boost::bind(&recorder::run, &rec, _1, i, 0.0), MB));
+
+  transfer_scheduler::terminate();
+
+  for (size_t i = 0; i < handles.size(); i++)
+    EXPECT_EQ(-ECANCELED, handles[i]->wait());
+
+  // the part that had started isn't affected
+  rec.unblock();
+  EXPECT_EQ(0, blocker_ah->wait());
+
+  // once terminated, parts go straight to the pool
+  EXPECT_EQ(0, s->call(boost::bind(&recorder::run, &rec, _1, 3, 0.0), MB));
+
+  pool::terminate();
+
+  ASSERT_EQ(1u, rec.get_order().size());
+  EXPECT_EQ(3, rec.get_order()[0]);
+}
+
+TEST(transfer_scheduler, background_transfers_get_a_turn)
+{
+  const int TRANSFER = 0, BACKGROUND = 1;
+  const int TRANSFER_PARTS = 40;
+
+  recorder rec;
+  transfer_scheduler::session::ptr blocker, transfer, background;
+  vector<wait_async_handle::ptr> handles;
+  wait_async_handle::ptr blocker_ah;
+  int first_background = -1;
+
+  start(
+    "max_transfer_parts_in_progress=1\n"
+    "download_rate_limit_in_kb_s=0\n"
+    "upload_rate_limit_in_kb_s=0\n");
+
+  blocker = transfer_scheduler::create_session(transfer_scheduler::TD_DOWNLOAD, MB, s3::threads::RC_TRANSFER);
+  transfer = transfer_scheduler::create_session(transfer_scheduler::TD_DOWNLOAD, 64 * MB, s3::threads::RC_TRANSFER);
+  background = transfer_scheduler::create_session(transfer_scheduler::TD_UPLOAD, MB, s3::threads::RC_BACKGROUND);
+
+  blocker_ah = blocker->post(boost::bind(&recorder::block, &rec, _1), MB);
+  rec.wait_until_blocked();
+
+  for (int i = 0; i < TRANSFER_PARTS; i++)
+    handles.push_back(transfer->post(boost::bind(&recorder::run, &rec, _1, TRANSFER, 0.0), MB));
+
+  handles.push_back(background->post(boost::bind(&recorder::run, &rec, _1, BACKGROUND, 0.0), MB));
+
+  rec.unblock();
+
+  EXPECT_EQ(0, blocker_ah->wait());
+
+  for (size_t i = 0; i < handles.size(); i++)
+    EXPECT_EQ(0, handles[i]->wait());
+
+  stop();
+
+  ASSERT_EQ(static_cast<size_t>(TRANSFER_PARTS + 1), rec.get_order().size());
+
+  for (size_t i = 0; i < rec.get_order().size(); i++) {
+    if (rec.get_order()[i] == BACKGROUND) {
+      first_background = i;
+      break;
+    }
+  }
+
+  // the background part doesn't have to wait for the whole transfer
+  EXPECT_GE(first_background, 0);
+  EXPECT_LE(first_background, 16);
+}
@@ -0,0 +1,249 @@
+#include <errno.h>
+
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+#include <gtest/gtest.h>
+
+#include "base/request.h"
+#include "base/timer.h"
+#include "threads/async_handle.h"
+#include "threads/tests/silent_server.h"
+#include "threads/request_worker.h"
+#include "threads/work_item.h"
+#include "threads/work_item_queue.h"
+
+using boost::thread;
+using std::string;
+using std::vector;
+
+using s3::base::request;
+using s3::base::timer;
+using s3::threads::request_worker;
+using s3::threads::tests::silent_server;
+using s3::threads::wait_async_handle;
+using s3::threads::work_item;
+using s3::threads::work_item_queue;
+
+namespace
+{
+  // PR_0, PR_REQ_0, PR_REQ_1, as the pool sets them up
+  const int ORDER[] = { 1, 0, 2 };
+  const size_t RESERVED[] = { 2, 1, 0 };
+
+  work_item_queue::ptr create_queue(size_t lanes, size_t threads)
+  {
+    work_item_queue::ptr q(new work_item_queue(
+      lanes,
+      vector<int>(ORDER, ORDER + 3),
+      vector<size_t>(RESERVED, RESERVED + 3)));
+
+    for (size_t i = 0; i < threads; i++)
+      q->add_thread();
+
+    return q;
+  }
+
+  int do_nothing(const request::ptr &)
+  {
+    return 0;
+  }
+
+  work_item create_item(int work_class, const wait_async_handle::ptr &ah)
+  {
+    return work_item(do_nothing, ah, 0, work_class);
+  }
+
+  void get_next(const work_item_queue::ptr &q, size_t lane, work_item *item)
+  {
+    *item = q->get_next(lane);
+  }
+
+  // returns false if nothing could be taken in time
+  bool get_next_within(const work_item_queue::ptr &q, size_t lane, double timeout, work_item *item)
+  {
+    thread t(boost::bind(get_next, q, lane, item));
+
+    if (t.timed_join(boost::posix_time::milliseconds(static_cast<long>(timeout * 1.0e3))))
+      return true;
+
+    // unblock the thread so that it can be joined
+    q->abort();
+    t.join();
+
+    return false;
+  }
+
+  // run by a single worker, so no lock is needed
+  int record(const request::ptr &, int id, vector<int> *order)
+  {
+    order->push_back(id);
+
+    return 0;
+  }
+
+  void take_and_post(const work_item_queue::ptr &q, size_t lane, int count, vector<wait_async_handle::ptr> *ah)
+  {
+    work_item item = q->get_next(lane);
+
+    for (int i = 0; i < count; i++) {
+      ah->push_back(wait_async_handle::ptr(new wait_async_handle()));
+      q->post(create_item(2, ah->back()));
+    }
+
+    q->on_item_done(item);
+  }
+
+  int hang(const request::ptr &req, const string &url)
+  {
+    req->init(s3::base::HTTP_GET);
+    req->set_url(url);
+    req->run(1);
+
+    return 0;
+  }
+}
+
+TEST(work_item_queue, starts_in_order)
+{
+  const int COUNT = 8;
+
+  work_item_queue::ptr q = create_queue(4, 1);
+  request_worker::ptr worker = request_worker::create(q, 2);
+  wait_async_handle::ptr ah[COUNT];
+  vector<int> order;
+
+  // posted from outside the pool, so they share a lane
+  for (int i = 0; i < COUNT; i++) {
+    ah[i].reset(new wait_async_handle());
+    q->post(work_item(boost::bind(record, _1, i, &order), ah[i], 0, 2));
+  }
+
+  for (int i = 0; i < COUNT; i++)
+    EXPECT_EQ(0, ah[i]->wait());
+
+  ASSERT_EQ(static_cast<size_t>(COUNT), order.size());
+
+  for (int i = 0; i < COUNT; i++)
+    EXPECT_EQ(i, order[i]);
+
+  EXPECT_EQ(0u, q->get_stolen_count());
+
+  q->abort();
+}
+
+TEST(work_item_queue, steals_across_lanes)
+{
+  work_item_queue::ptr q = create_queue(2, 2);
+  wait_async_handle::ptr first(new wait_async_handle());
+  vector<wait_async_handle::ptr> ah;
+  work_item item;
+
+  // the worker on lane 1 posts three items to its own lane
+  q->post(create_item(2, first));
+
+  {
+    thread t(boost::bind(take_and_post, q, 1, 3, &ah));
+
+    t.join();
+  }
+
+  ASSERT_EQ(3u, ah.size());
+
+  // which the worker on lane 0 steals, oldest first
+  for (int i = 0; i < 3; i++) {
+    item = q->get_next(0);
+    EXPECT_EQ(ah[i], item.get_ah());
+    EXPECT_EQ(static_cast<size_t>(i + 1), q->get_stolen_count());
+  }
+
+  EXPECT_EQ(0u, q->get_queued_count());
+}
+
+TEST(work_item_queue, reserved_threads)
+{
+  // with three threads, only one can run a PR_0 item, since PR_0 leaves two
+  // threads for the items it waits on
+  work_item_queue::ptr q = create_queue(3, 3);
+  wait_async_handle::ptr first(new wait_async_handle()), second(new wait_async_handle()), other(new wait_async_handle());
+  work_item first_item, item;
+
+  q->post(create_item(0, first));
+  q->post(create_item(0, second));
+  q->post(create_item(2, other));
+
+  ASSERT_TRUE(get_next_within(q, 0, 1.0, &first_item));
+  EXPECT_EQ(first, first_item.get_ah());
+
+  // the second PR_0 item has to wait, but PR_REQ_1 items don't
+  ASSERT_TRUE(get_next_within(q, 0, 1.0, &item));
+  EXPECT_EQ(other, item.get_ah());
+
+  q->on_item_done(item);
+  q->on_item_done(first_item);
+
+  ASSERT_TRUE(get_next_within(q, 0, 1.0, &item));
+  EXPECT_EQ(second, item.get_ah());
+}
+
+TEST(request_worker, timeout_releases_reservation)
+{
+  silent_server server;
+  work_item_queue::ptr q = create_queue(3, 3);
+  wait_async_handle::ptr hung(new wait_async_handle()), next(new wait_async_handle());
+  request_worker::ptr worker = request_worker::create(q, 0);
+  work_item item;
+  bool timed_out = false;
+
+  q->post(work_item(boost::bind(hang, _1, server.get_url()), hung, 0, 0));
+
+  // the watchdog does this once a second
+  for (int i = 0; i < 10 && !timed_out; i++) {
+    timer::sleep_for(1.0);
+    timed_out = worker->check_timeout();
+  }
+
+  ASSERT_TRUE(timed_out);
+  EXPECT_EQ(-ETIMEDOUT, hung->wait());
+
+  // the hung thread no longer holds the only PR_0 slot
+  q->post(create_item(0, next));
+
+  ASSERT_TRUE(get_next_within(q, 1, 1.0, &item));
+  EXPECT_EQ(next, item.get_ah());
+
+  q->on_item_done(item);
+  q->abort();
+}
+
+TEST(request_worker, retire)
+{
+  work_item_queue::ptr q = create_queue(2, 2);
+  request_worker::ptr workers[2];
+
+  workers[0] = request_worker::create(q, 0);
+  workers[1] = request_worker::create(q, 1);
+
+  for (int i = 0; i < 100 && q->get_idle_count() < 2; i++)
+    timer::sleep_for(0.01);
+
+  ASSERT_EQ(2u, q->get_idle_count());
+
+  q->retire_one();
+  EXPECT_EQ(1u, q->get_thread_count());
+
+  for (int i = 0; i < 100 && !(workers[0]->is_stopped() || workers[1]->is_stopped()); i++)
+    timer::sleep_for(0.01);
+
+  // exactly one of them exits, and the other keeps taking items
+  EXPECT_NE(workers[0]->is_stopped(), workers[1]->is_stopped());
+
+  {
+    wait_async_handle::ptr ah(new wait_async_handle());
+
+    q->post(create_item(2, ah));
+    EXPECT_EQ(0, ah->wait());
+  }
+
+  q->abort();
+}
@@ -0,0 +1,92 @@
+/*
+ * threads/token_bucket.h
+ * -------------------------------------------------------------------------
+ * Limits the rate at which bytes are let through.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_THREADS_TOKEN_BUCKET_H
+#define S3_THREADS_TOKEN_BUCKET_H
+
+#include <stddef.h>
+
+#include <algorithm>
+
+namespace s3
+{
+  namespace threads
+  {
+    // holds up to one second's worth of bytes at "rate" bytes per second. a
+    // rate of zero or less means no limit. times are in seconds, as returned
+    // by timer::get_current_time().
+    //
+    // not thread safe.
+    class token_bucket
+    {
+    public:
+      inline token_bucket()
+        : _rate(0),
+          _tokens(0),
+          _last_refill(0)
+      {
+      }
+
+      inline void init(double rate, double now)
+      {
+        _rate = rate;
+        _tokens = rate; // allow a one-second burst
+        _last_refill = now;
+      }
+
+      // parts are let through while the bucket isn't empty, even if they're
+      // larger than what's left, so that a part larger than the burst size
+      // can't be held back forever
+      inline bool is_open(double now)
+      {
+        refill(now);
+
+        return _rate <= 0 || _tokens > 0;
+      }
+
+      inline void take(size_t size)
+      {
+        if (_rate > 0)
+          _tokens -= size;
+      }
+
+      // seconds until is_open() returns true, as of the last call to it
+      inline double get_wait_time() const
+      {
+        return (_rate > 0 && _tokens <= 0) ? -_tokens / _rate : 0;
+      }
+
+    private:
+      inline void refill(double now)
+      {
+        if (_rate <= 0)
+          return;
+
+        _tokens = std::min(_rate, _tokens + (now - _last_refill) * _rate);
+        _last_refill = now;
+      }
+
+      double _rate, _tokens, _last_refill;
+    };
+  }
+}
+
+#endif
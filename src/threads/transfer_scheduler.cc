@@ -0,0 +1,344 @@
+/*
+ * threads/transfer_scheduler.cc
+ * -------------------------------------------------------------------------
+ * Transfer scheduler implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+
+#include <iomanip>
+#include <list>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+#include "base/config.h"
+#include "base/statistics.h"
+#include "base/timer.h"
+#include "threads/token_bucket.h"
+#include "threads/transfer_scheduler.h"
+#include "threads/work_item_queue.h"
+
+using boost::condition;
+using boost::mutex;
+using boost::scoped_ptr;
+using boost::thread;
+using boost::detail::atomic_count;
+using std::list;
+using std::ostream;
+using std::vector;
+
+using s3::base::config;
+using s3::base::statistics;
+using s3::base::timer;
+using s3::threads::async_handle;
+using s3::threads::pool;
+using s3::threads::token_bucket;
+using s3::threads::transfer_scheduler;
+using s3::threads::work_item_queue;
+
+namespace
+{
+  // transfers of this size or smaller get the largest weight. the weight
+  // halves each time the size doubles, down to 1.
+  const uint64_t SMALL_TRANSFER_SIZE = 1024 * 1024; // 1 MB
+  const double MAX_WEIGHT = 64;
+
+  // as in work_item_queue, every this many parts the classes other than
+  // RC_INTERACTIVE are tried lowest first, so that a steady stream of
+  // transfers can't hold back write-behind uploads forever
+  const size_t LOW_CLASS_INTERVAL = work_item_queue::LOW_PRIORITY_INTERVAL;
+
+  // the order in which sessions of class "rc" are tried
+  inline int get_rank(s3::threads::request_class rc, bool lowest_first)
+  {
+    return (lowest_first && rc > 0) ? static_cast<int>(work_item_queue::MAX_PRIORITIES) - rc : rc;
+  }
+
+  mutex s_mutex;
+  condition s_condition;
+  scoped_ptr<thread> s_dispatcher;
+  bool s_running = false, s_done = false;
+
+  // all protected by s_mutex
+  list<transfer_scheduler::session::ptr> s_active; // sessions with queued parts
+  size_t s_in_progress = 0, s_max_in_progress = 0, s_picks = 0;
+  double s_virtual_time = 0;
+  token_bucket s_buckets[2];
+
+  double s_total_wait_time = 0;
+  uint64_t s_bytes[2] = { 0, 0 };
+
+  atomic_count s_sessions(0), s_parts(0), s_parts_queued(0), s_bandwidth_waits(0);
+
+  void statistics_writer(ostream *o)
+  {
+    mutex::scoped_lock lock(s_mutex);
+
+    o->setf(ostream::fixed);
+
+    *o <<
+      "transfer scheduler:\n"
+      "  transfers: " << s_sessions << "\n"
+      "  parts: " << s_parts << "\n"
+      "  parts that had to wait: " << s_parts_queued << "\n"
+      "  avg wait per part: " << std::setprecision(3) << (s_parts ? s_total_wait_time / s_parts * 1.0e3 : 0.0) << " ms\n"
+      "  waits for bandwidth: " << s_bandwidth_waits << "\n"
+      "  bytes downloaded: " << s_bytes[transfer_scheduler::TD_DOWNLOAD] << "\n"
+      "  bytes uploaded: " << s_bytes[transfer_scheduler::TD_UPLOAD] << "\n";
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
+}
+
+transfer_scheduler::session::session(direction dir, request_class rc, double weight)
+  : _direction(dir),
+    _request_class(rc),
+    _weight(weight),
+    _start_tag(0),
+    _finish_tag(0)
+{
+}
+
+s3::threads::wait_async_handle::ptr transfer_scheduler::session::post(
+  const pool::worker_function &fn,
+  size_t size,
+  int timeout_retries)
+{
+  wait_async_handle::ptr ah(new wait_async_handle());
+  queued_part part;
+
+  part.fn = fn;
+  part.size = size;
+  part.ah = ah;
+  part.timeout_retries = timeout_retries;
+
+  post(part);
+
+  return ah;
+}
+
+void transfer_scheduler::session::post(
+  const pool::worker_function &fn,
+  size_t size,
+  const callback_async_handle::callback_function &cb,
+  int timeout_retries)
+{
+  queued_part part;
+
+  part.fn = fn;
+  part.size = size;
+  part.ah.reset(new callback_async_handle(cb));
+  part.timeout_retries = timeout_retries;
+
+  post(part);
+}
+
+void transfer_scheduler::session::post(const queued_part &part)
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  if (!s_running) {
+    lock.unlock();
+
+    // not initialized (or already terminated), so there's nothing to share
+    pool::post(PR_REQ_1, _request_class, part.fn, boost::bind(&async_handle::complete, part.ah, _1), part.timeout_retries);
+    return;
+  }
+
+  if (_queue.empty()) {
+    // start-time fair queuing: a session that was idle starts at the current
+    // virtual time, rather than catching up on the time it missed
+    _start_tag = std::max(s_virtual_time, _finish_tag);
+    s_active.push_back(shared_from_this());
+  }
+
+  _queue.push_back(part);
+  _queue.back().queued_at = timer::get_current_time();
+
+  s_condition.notify_all();
+}
+
+void transfer_scheduler::init()
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  s_max_in_progress = config::get_max_transfer_parts_in_progress();
+  s_buckets[TD_DOWNLOAD].init(config::get_download_rate_limit_in_kb_s() * 1024.0, timer::get_current_time());
+  s_buckets[TD_UPLOAD].init(config::get_upload_rate_limit_in_kb_s() * 1024.0, timer::get_current_time());
+
+  s_running = true;
+  s_done = false;
+  s_dispatcher.reset(new thread(&transfer_scheduler::dispatch));
+}
+
+void transfer_scheduler::terminate()
+{
+  mutex::scoped_lock lock(s_mutex);
+  list<session::ptr> abandoned;
+
+  if (!s_running)
+    return;
+
+  s_done = true;
+  s_condition.notify_all();
+
+  lock.unlock();
+  s_dispatcher->join();
+  lock.lock();
+
+  s_running = false;
+  abandoned.swap(s_active);
+
+  lock.unlock();
+
+  for (list<session::ptr>::iterator itor = abandoned.begin(); itor != abandoned.end(); ++itor) {
+    for (size_t i = 0; i < (*itor)->_queue.size(); i++)
+      (*itor)->_queue[i].ah->complete(-ECANCELED);
+
+    (*itor)->_queue.clear();
+  }
+}
+
+transfer_scheduler::session::ptr transfer_scheduler::create_session(
+  direction dir,
+  uint64_t total_size,
+  request_class rc)
+{
+  double weight = 1;
+
+  if (rc == RC_INHERIT)
+    rc = pool::get_current_request_class();
+
+  if (total_size > 0)
+    weight = std::max(1.0, std::min(MAX_WEIGHT, MAX_WEIGHT * SMALL_TRANSFER_SIZE / total_size));
+
+  ++s_sessions;
+
+  return session::ptr(new session(dir, rc, weight));
+}
+
+void transfer_scheduler::dispatch()
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  while (!s_done) {
+    vector<session::queued_part> ready;
+    double now = timer::get_current_time();
+    double bandwidth_wait = -1.0;
+
+    while (s_in_progress + ready.size() < s_max_in_progress) {
+      list<session::ptr>::iterator next = s_active.end();
+      bool lowest_first = ((s_picks + 1) % LOW_CLASS_INTERVAL == 0);
+
+      // the session of the most urgent class (by rank) with the smallest
+      // start tag goes next, among those whose direction still has
+      // bandwidth left
+      for (list<session::ptr>::iterator itor = s_active.begin(); itor != s_active.end(); ++itor) {
+        token_bucket *bucket = &s_buckets[(*itor)->_direction];
+
+        if (!bucket->is_open(now)) {
+          double wait = bucket->get_wait_time();
+
+          if (bandwidth_wait < 0 || wait < bandwidth_wait)
+            bandwidth_wait = wait;
+
+          continue;
+        }
+
+        if (next == s_active.end()) {
+          next = itor;
+          continue;
+        }
+
+        int rank = get_rank((*itor)->_request_class, lowest_first);
+        int next_rank = get_rank((*next)->_request_class, lowest_first);
+
+        if (rank < next_rank || (rank == next_rank && (*itor)->_start_tag < (*next)->_start_tag))
+          next = itor;
+      }
+
+      if (next == s_active.end())
+        break;
+
+      s_picks++;
+
+      session::ptr s = *next;
+      session::queued_part part = s->_queue.front();
+
+      part.rc = s->_request_class;
+
+      s->_queue.pop_front();
+
+      s_virtual_time = s->_start_tag;
+      s->_finish_tag = s->_start_tag + part.size / s->_weight;
+      s->_start_tag = s->_finish_tag;
+
+      if (s->_queue.empty())
+        s_active.erase(next);
+
+      s_buckets[s->_direction].take(part.size);
+      s_bytes[s->_direction] += part.size;
+
+      if (now - part.queued_at > 1.0e-3)
+        ++s_parts_queued;
+
+      s_total_wait_time += now - part.queued_at;
+      ready.push_back(part);
+    }
+
+    if (!ready.empty()) {
+      s_in_progress += ready.size();
+      lock.unlock();
+
+      for (size_t i = 0; i < ready.size(); i++) {
+        ++s_parts;
+
+        pool::post(
+          PR_REQ_1,
+          ready[i].rc,
+          ready[i].fn,
+          boost::bind(&transfer_scheduler::on_part_done, ready[i].ah, _1),
+          ready[i].timeout_retries);
+      }
+
+      lock.lock();
+      continue;
+    }
+
+    if (bandwidth_wait >= 0 && s_in_progress < s_max_in_progress) {
+      ++s_bandwidth_waits;
+      s_condition.timed_wait(lock, boost::posix_time::milliseconds(static_cast<long>(bandwidth_wait * 1.0e3) + 1));
+    } else {
+      s_condition.wait(lock);
+    }
+  }
+}
+
+void transfer_scheduler::on_part_done(const async_handle::ptr &ah, int return_code)
+{
+  {
+    mutex::scoped_lock lock(s_mutex);
+
+    s_in_progress--;
+    s_condition.notify_all();
+  }
+
+  ah->complete(return_code);
+}
@@ -0,0 +1,123 @@
+/*
+ * threads/transfer_scheduler.h
+ * -------------------------------------------------------------------------
+ * Shares the request pool between concurrent file transfers.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_THREADS_TRANSFER_SCHEDULER_H
+#define S3_THREADS_TRANSFER_SCHEDULER_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/smart_ptr.hpp>
+
+#include "threads/pool.h"
+
+namespace s3
+{
+  namespace threads
+  {
+    // parts of file transfers are posted here rather than directly to
+    // PR_REQ_1. at most max_transfer_parts_in_progress parts run at once, so
+    // some PR_REQ_1 threads are always left for other requests. queued parts
+    // are handed out by weighted fair queuing across transfers of the same
+    // request_class, with smaller transfers weighted more heavily, and more
+    // urgent classes going first (but, as in work_item_queue, less urgent
+    // classes get a turn every so often). parts are held back when the
+    // bandwidth limit for their direction has been reached.
+    class transfer_scheduler
+    {
+    public:
+      enum direction
+      {
+        TD_DOWNLOAD = 0,
+        TD_UPLOAD = 1
+      };
+
+      class session : public boost::enable_shared_from_this<session>
+      {
+      public:
+        typedef boost::shared_ptr<session> ptr;
+
+        // "size" is the number of bytes the part will move, and is counted
+        // against the bandwidth limit for the session's direction
+        wait_async_handle::ptr post(
+          const pool::worker_function &fn,
+          size_t size,
+          int timeout_retries = pool::DEFAULT_TIMEOUT_RETRIES);
+
+        void post(
+          const pool::worker_function &fn,
+          size_t size,
+          const callback_async_handle::callback_function &cb,
+          int timeout_retries = pool::DEFAULT_TIMEOUT_RETRIES);
+
+        inline int call(
+          const pool::worker_function &fn,
+          size_t size,
+          int timeout_retries = pool::DEFAULT_TIMEOUT_RETRIES)
+        {
+          return post(fn, size, timeout_retries)->wait();
+        }
+
+      private:
+        friend class transfer_scheduler;
+
+        struct queued_part
+        {
+          pool::worker_function fn;
+          size_t size;
+          async_handle::ptr ah;
+          int timeout_retries;
+          double queued_at;
+          request_class rc; // set when dispatched
+        };
+
+        session(direction dir, request_class rc, double weight);
+
+        void post(const queued_part &part);
+
+        direction _direction;
+        request_class _request_class;
+        double _weight;
+
+        // protected by the scheduler's mutex
+        std::deque<queued_part> _queue;
+        double _start_tag, _finish_tag;
+      };
+
+      static void init();
+      static void terminate();
+
+      // "total_size" is the size of the whole transfer, or 0 if it isn't
+      // known (which is treated like a large transfer)
+      static session::ptr create_session(
+        direction dir,
+        uint64_t total_size,
+        request_class rc = RC_INHERIT);
+
+    private:
+      static void dispatch();
+      static void on_part_done(const async_handle::ptr &ah, int return_code);
+    };
+  }
+}
+
+#endif
@@ -40,16 +40,36 @@ namespace s3
     {
     public:
       typedef boost::function1<int, boost::shared_ptr<base::request> > worker_function;
+      typedef boost::function0<bool> wanted_function;
 
       inline work_item()
-        : _retries(-1)
+        : _retries(-1),
+          _work_class(0),
+          _priority(0),
+          _deadline(0)
       {
       }
 
-      inline work_item(const worker_function &function, const boost::shared_ptr<async_handle> &ah, int retries)
+      // "work_class" is the pool_id the item was posted to, and "priority"
+      // its request_class. an item with a "deadline" (in seconds, as returned
+      // by timer::get_current_time()) or an "is_wanted" function is
+      // speculative, and is dropped if it hasn't started by the deadline or
+      // is no longer wanted when it's about to start.
+      inline work_item(
+        const worker_function &function,
+        const boost::shared_ptr<async_handle> &ah,
+        int retries,
+        int work_class,
+        int priority = 0,
+        double deadline = 0,
+        const wanted_function &is_wanted = wanted_function())
         : _function(function), 
           _ah(ah),
-          _retries(retries)
+          _retries(retries),
+          _work_class(work_class),
+          _priority(priority),
+          _deadline(deadline),
+          _is_wanted(is_wanted)
       {
       }
 
@@ -58,16 +78,27 @@ namespace s3
 
       inline const boost::shared_ptr<async_handle> & get_ah() const { return _ah; }
       inline const worker_function & get_function() const { return _function; }
+      inline int get_work_class() const { return _work_class; }
+      inline int get_priority() const { return _priority; }
+
+      inline bool is_stale(double now) const
+      {
+        return (_deadline > 0 && now > _deadline) || (_is_wanted && !_is_wanted());
+      }
 
       inline work_item decrement_retry_counter() const
       {
-        return work_item(_function, _ah, _retries - 1);
+        return work_item(_function, _ah, _retries - 1, _work_class, _priority, _deadline, _is_wanted);
       }
 
     private:
       worker_function _function;
       boost::shared_ptr<async_handle> _ah;
       int _retries;
+      int _work_class;
+      int _priority;
+      double _deadline;
+      wanted_function _is_wanted;
     };
   }
 }
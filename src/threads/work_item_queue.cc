@@ -0,0 +1,330 @@
+/*
+ * threads/work_item_queue.cc
+ * -------------------------------------------------------------------------
+ * Work-stealing queue implementation.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2012, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "threads/work_item_queue.h"
+
+using boost::mutex;
+using std::runtime_error;
+using std::vector;
+
+using s3::threads::work_item;
+using s3::threads::work_item_queue;
+
+namespace
+{
+  // a worker that's waiting even though there are queued items (that it
+  // isn't allowed to start) checks again after this long in case it missed
+  // a wakeup
+  const int CAPPED_WAIT_IN_MS = 100;
+
+  // the queue and lane that the calling thread last took items from
+  struct worker_lane
+  {
+    const work_item_queue *queue;
+    size_t lane;
+  };
+
+  boost::thread_specific_ptr<worker_lane> s_worker_lane;
+}
+
+work_item_queue::work_item_queue(
+  size_t lanes,
+  const vector<int> &order,
+  const vector<size_t> &reserved)
+  : _order(order),
+    _reserved(reserved),
+    _threads(0),
+    _idle(0),
+    _stolen(0),
+    _picks(0),
+    _used_lanes(0),
+    _retiring(0),
+    _done(false)
+{
+  if (reserved.size() > MAX_CLASSES || order.size() != reserved.size())
+    throw runtime_error("invalid work class configuration.");
+
+  for (size_t i = 0; i < lanes; i++)
+    _lanes.push_back(new lane());
+}
+
+work_item_queue::~work_item_queue()
+{
+  for (size_t i = 0; i < _lanes.size(); i++)
+    delete _lanes[i];
+}
+
+size_t work_item_queue::get_queued_count() const
+{
+  size_t count = 0;
+
+  for (size_t c = 0; c < _reserved.size(); c++)
+    for (int p = 0; p < MAX_PRIORITIES; p++)
+      count += _queued[c][p].value;
+
+  return count;
+}
+
+bool work_item_queue::has_queued(int work_class) const
+{
+  for (int p = 0; p < MAX_PRIORITIES; p++)
+    if (_queued[work_class][p].value > 0)
+      return true;
+
+  return false;
+}
+
+bool work_item_queue::reserve(int work_class)
+{
+  long threads = _threads;
+  size_t reserved = _reserved[work_class];
+  bool ok = true;
+
+  if (reserved == 0)
+    return true;
+
+  for (size_t c = 0; c < _reserved.size(); c++) {
+    if (_reserved[c] == 0 || _reserved[c] > reserved)
+      continue;
+
+    if (++_busy[c].value > threads - static_cast<long>(_reserved[c]))
+      ok = false;
+  }
+
+  if (!ok)
+    release(work_class);
+
+  return ok;
+}
+
+void work_item_queue::release(int work_class)
+{
+  size_t reserved = _reserved[work_class];
+
+  if (reserved == 0)
+    return;
+
+  for (size_t c = 0; c < _reserved.size(); c++)
+    if (_reserved[c] > 0 && _reserved[c] <= reserved)
+      --_busy[c].value;
+}
+
+bool work_item_queue::can_start(int work_class) const
+{
+  long threads = _threads;
+  size_t reserved = _reserved[work_class];
+
+  for (size_t c = 0; c < _reserved.size(); c++) {
+    if (_reserved[c] == 0 || _reserved[c] > reserved)
+      continue;
+
+    if (_busy[c].value + 1 > threads - static_cast<long>(_reserved[c]))
+      return false;
+  }
+
+  return true;
+}
+
+bool work_item_queue::take_front(lane *l, int work_class, int priority, work_item *item)
+{
+  mutex::scoped_lock lock(l->mutex);
+
+  if (l->items[work_class][priority].empty())
+    return false;
+
+  *item = l->items[work_class][priority].front();
+  l->items[work_class][priority].pop_front();
+
+  return true;
+}
+
+bool work_item_queue::take(int work_class, int priority, size_t lane_index, work_item *item)
+{
+  size_t used_lanes = std::min(static_cast<size_t>(_used_lanes), _lanes.size());
+
+  lane_index %= _lanes.size();
+
+  // our own lane first, then items posted from outside the pool
+  if (take_front(_lanes[lane_index], work_class, priority, item) || take_front(&_shared, work_class, priority, item))
+    return true;
+
+  // then the oldest of the other workers' items
+  for (size_t i = 0; i < used_lanes; i++) {
+    if (i == lane_index)
+      continue;
+
+    if (take_front(_lanes[i], work_class, priority, item)) {
+      ++_stolen;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void work_item_queue::set_worker_lane(size_t lane_index)
+{
+  worker_lane *wl = s_worker_lane.get();
+
+  if (wl && wl->queue == this && wl->lane == lane_index)
+    return;
+
+  if (!wl) {
+    wl = new worker_lane();
+    s_worker_lane.reset(wl);
+  }
+
+  wl->queue = this;
+  wl->lane = lane_index;
+
+  mutex::scoped_lock lock(_idle_mutex);
+
+  while (static_cast<size_t>(_used_lanes) <= lane_index)
+    ++_used_lanes;
+}
+
+work_item work_item_queue::get_next(size_t lane_index)
+{
+  lane_index %= _lanes.size();
+  set_worker_lane(lane_index);
+
+  while (true) {
+    bool any_queued = false;
+    bool lowest_first = (++_picks % LOW_PRIORITY_INTERVAL == 0);
+
+    for (int pi = 0; pi < MAX_PRIORITIES; pi++) {
+      int p = (lowest_first && pi > 0) ? MAX_PRIORITIES - pi : pi;
+
+      for (size_t i = 0; i < _order.size(); i++) {
+        int c = _order[i];
+        work_item item;
+
+        if (_done)
+          return work_item();
+
+        if (_queued[c][p].value <= 0)
+          continue;
+
+        any_queued = true;
+
+        if (!reserve(c))
+          continue;
+
+        if (take(c, p, lane_index, &item)) {
+          --_queued[c][p].value;
+          return item;
+        }
+
+        release(c);
+      }
+    }
+
+    mutex::scoped_lock lock(_idle_mutex);
+    bool startable = false;
+
+    if (_done)
+      return work_item();
+
+    if (_retiring > 0) {
+      _retiring--;
+      return work_item();
+    }
+
+    ++_idle;
+
+    // post() and on_item_done() only notify if they see an idle worker, so
+    // check again now that we're counted as one
+    for (size_t c = 0; c < _reserved.size(); c++) {
+      if (has_queued(c)) {
+        any_queued = true;
+
+        if (can_start(c))
+          startable = true;
+      }
+    }
+
+    if (!startable) {
+      if (any_queued)
+        _idle_condition.timed_wait(lock, boost::posix_time::milliseconds(CAPPED_WAIT_IN_MS));
+      else
+        _idle_condition.wait(lock);
+    }
+
+    --_idle;
+  }
+}
+
+void work_item_queue::on_item_done(const work_item &item)
+{
+  release(item.get_work_class());
+
+  // a worker may be waiting for this item's class to drop below its limit
+  if (_reserved[item.get_work_class()] > 0 && _idle > 0 && get_queued_count() > 0) {
+    mutex::scoped_lock lock(_idle_mutex);
+
+    _idle_condition.notify_all();
+  }
+}
+
+void work_item_queue::post(const work_item &item)
+{
+  worker_lane *wl = s_worker_lane.get();
+  lane *l = &_shared;
+
+  // a lane we haven't counted was left by an earlier queue at this address
+  if (wl && wl->queue == this && wl->lane < static_cast<size_t>(_used_lanes))
+    l = _lanes[wl->lane];
+
+  {
+    mutex::scoped_lock lock(l->mutex);
+
+    l->items[item.get_work_class()][item.get_priority()].push_back(item);
+  }
+
+  ++_queued[item.get_work_class()][item.get_priority()].value;
+
+  if (_idle > 0) {
+    mutex::scoped_lock lock(_idle_mutex);
+
+    _idle_condition.notify_one();
+  }
+}
+
+void work_item_queue::retire_one()
+{
+  mutex::scoped_lock lock(_idle_mutex);
+
+  _retiring++;
+  --_threads;
+
+  _idle_condition.notify_one();
+}
+
+void work_item_queue::abort()
+{
+  mutex::scoped_lock lock(_idle_mutex);
+
+  _done = true;
+  _idle_condition.notify_all();
+}
@@ -1,7 +1,7 @@
 /*
  * threads/work_item_queue.h
  * -------------------------------------------------------------------------
- * Pool work item queue.
+ * Work-stealing queue shared by the threads in the pool.
  * -------------------------------------------------------------------------
  *
  * Copyright (c) 2012, Tarick Bedeir.
@@ -23,10 +23,12 @@
 #define S3_THREADS_WORK_ITEM_QUEUE_H
 
 #include <deque>
+#include <vector>
 
 #include <boost/smart_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/condition.hpp>
+#include <boost/detail/atomic_count.hpp>
 
 #include "threads/work_item.h"
 
@@ -34,53 +36,106 @@ namespace s3
 {
   namespace threads
   {
+    // each worker has a deque ("lane") of its own, and each lane keeps a
+    // deque per work class. items posted by a worker go to its own lane, and
+    // items posted by other threads go to a shared lane. a worker takes from
+    // the front of its own lane, then of the shared lane, then steals from
+    // the front of the other workers' lanes, so items are started in the
+    // order they were posted and workers rarely contend for the same lock.
+    //
+    // work classes are tried in the order given by "order". items of a class
+    // may wait on items of classes with fewer reserved threads, so a class
+    // only starts an item if that leaves "reserved[class]" threads free of
+    // items of classes with as many or more reserved threads. a class with
+    // no reserved threads can use any free thread.
+    //
+    // within that, items are taken in order of priority (lowest value
+    // first). priority 0 always goes first, but every LOW_PRIORITY_INTERVAL
+    // items the other priorities are tried lowest first, so that a steady
+    // stream of higher-priority items can't hold them back forever.
     class work_item_queue
     {
     public:
       typedef boost::shared_ptr<work_item_queue> ptr;
 
-      inline work_item_queue()
-        : _done(false)
-      {
-      }
+      enum { MAX_CLASSES = 4 };
+      enum { MAX_PRIORITIES = 4 };
+      enum { LOW_PRIORITY_INTERVAL = 16 };
 
-      inline work_item get_next()
-      {
-        boost::mutex::scoped_lock lock(_mutex);
-        work_item item;
+      work_item_queue(
+        size_t lanes,
+        const std::vector<int> &order,
+        const std::vector<size_t> &reserved);
+
+      ~work_item_queue();
+
+      // returns an invalid item once abort() has been called, or if the
+      // worker should exit because of retire_one(). items the calling thread
+      // posts from then on go to "lane".
+      work_item get_next(size_t lane);
 
-        while (!_done && _queue.empty())
-          _condition.wait(lock);
+      // called by the worker once an item it got from get_next() is done (or
+      // abandoned)
+      void on_item_done(const work_item &item);
 
-        if (_done)
-          return work_item(); // generates an invalid work item
+      void post(const work_item &item);
+      void abort();
 
-        item = _queue.front();
-        _queue.pop_front();
+      // has the next idle worker exit, and stops counting it
+      void retire_one();
 
-        return item;
-      }
+      // the number of workers taking items from the queue
+      inline void add_thread() { ++_threads; }
+      inline void remove_thread() { --_threads; }
 
-      inline void post(const work_item &item)
+      inline size_t get_thread_count() const { return _threads; }
+      inline size_t get_idle_count() const { return _idle; }
+      size_t get_queued_count() const;
+
+      inline size_t get_stolen_count() const { return _stolen; }
+
+    private:
+      struct counter
       {
-        boost::mutex::scoped_lock lock(_mutex);
+        boost::detail::atomic_count value;
 
-        _queue.push_back(item);
-        _condition.notify_all();
-      }
+        inline counter() : value(0) { }
+      };
 
-      inline void abort()
+      struct lane
       {
-        boost::mutex::scoped_lock lock(_mutex);
+        boost::mutex mutex;
+        std::deque<work_item> items[MAX_CLASSES][MAX_PRIORITIES];
+      };
 
-        _done = true;
-        _condition.notify_all();
-      }
+      bool reserve(int work_class);
+      void release(int work_class);
+      bool can_start(int work_class) const;
 
-    private:
-      boost::mutex _mutex;
-      boost::condition _condition;
-      std::deque<work_item> _queue;
+      bool take_front(lane *l, int work_class, int priority, work_item *item);
+      bool take(int work_class, int priority, size_t lane, work_item *item);
+      void set_worker_lane(size_t lane);
+
+      bool has_queued(int work_class) const;
+
+      std::vector<lane *> _lanes;
+      lane _shared;
+      std::vector<int> _order;
+      std::vector<size_t> _reserved;
+
+      // _busy[c] counts workers running items of classes with at least as
+      // many reserved threads as class c
+      counter _busy[MAX_CLASSES];
+      counter _queued[MAX_CLASSES][MAX_PRIORITIES];
+
+      boost::detail::atomic_count _threads, _idle, _stolen, _picks;
+
+      // lanes past this have never had a worker, so they're always empty
+      boost::detail::atomic_count _used_lanes;
+
+      boost::mutex _idle_mutex;
+      boost::condition _idle_condition;
+      size_t _retiring; // protected by _idle_mutex
       bool _done;
     };
   }